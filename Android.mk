@@ -55,7 +55,15 @@ common_src_files += \
     Extfs.cpp \
     Iso.cpp \
     Cifs.cpp \
-    Exfat.cpp
+    Exfat.cpp \
+    ContainerRegistry.cpp \
+    BlockNode.cpp \
+    AsecIndex.cpp \
+    ContainerLocks.cpp \
+    SpaceReclaimer.cpp \
+    ThinPool.cpp \
+    IsoCache.cpp \
+    dm_client.c
 
 common_c_includes += \
     external/icu4c/common/ \
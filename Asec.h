@@ -21,15 +21,28 @@ struct asec_superblock {
 #define ASEC_SB_MAGIC 0xc0def00d
     unsigned int magic;
 
-#define ASEC_SB_VER 1
+// MStar Android Patch Begin
+/*
+ * Version 1 containers are always twofish when they have a key. Version 2
+ * records the dm-crypt cipher in c_cipher, c_chain and c_mode.
+ */
+#define ASEC_SB_VER_1 1
+#define ASEC_SB_VER 2
+// MStar Android Patch End
     unsigned char ver;
 
 #define ASEC_SB_C_CIPHER_NONE    0
 #define ASEC_SB_C_CIPHER_TWOFISH 1
 #define ASEC_SB_C_CIPHER_AES     2
+// MStar Android Patch Begin
+#define ASEC_SB_C_CIPHER_ADIANTUM 3
+// MStar Android Patch End
     unsigned char c_cipher;
 
 #define ASEC_SB_C_CHAIN_NONE 0
+// MStar Android Patch Begin
+#define ASEC_SB_C_CHAIN_XTS  1
+// MStar Android Patch End
     unsigned char c_chain;
 
 #define ASEC_SB_C_OPTS_NONE 0
@@ -37,7 +50,24 @@ struct asec_superblock {
     unsigned char c_opts;
 
 #define ASEC_SB_C_MODE_NONE 0
+// MStar Android Patch Begin
+#define ASEC_SB_C_MODE_PLAIN64 1
+// MStar Android Patch End
     unsigned char c_mode;
 } __attribute__((packed));
 
+// MStar Android Patch Begin
+/*
+ * A thin-provisioned ASEC's .asec file is just this reference, padded to
+ * one sector; the container itself (superblock at the end, as in an
+ * image) lives in thin volume dev_id of vold's pool. See ThinPool.
+ */
+struct asec_thin_ref {
+#define ASEC_THIN_MAGIC 0x7417c0de
+    unsigned int magic;
+    unsigned int dev_id;
+    unsigned long long num_sectors;
+} __attribute__((packed));
+// MStar Android Patch End
+
 #endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+#include "AsecIndex.h"
+#include "Volume.h"
+
+#define ASEC_SUFFIX ".asec"
+
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | \
+        IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef android::KeyedVector<android::String8, AsecIndex::Entry> EntryMap;
+
+struct IndexedDir {
+    const char *path;
+    int wd;
+    bool ready;
+    /* Identity of the directory last scanned; a mount on top changes it */
+    dev_t dev;
+    ino_t ino;
+    EntryMap entries;
+};
+
+static android::Mutex sLock;
+static int sInotifyFd = -1;
+/* Internal first: findAsec() has always preferred it */
+static IndexedDir sDirs[2];
+static const int sNumDirs = sizeof(sDirs) / sizeof(sDirs[0]);
+
+/* Copies the id out of "<id>.asec"; false for anything else */
+static bool idFromName(const char *name, char *id, size_t len) {
+    size_t nameLen = strlen(name);
+    size_t suffixLen = strlen(ASEC_SUFFIX);
+
+    if (name[0] == '.' || nameLen <= suffixLen || nameLen - suffixLen >= len ||
+            strcmp(name + nameLen - suffixLen, ASEC_SUFFIX)) {
+        return false;
+    }
+    memcpy(id, name, nameLen - suffixLen);
+    id[nameLen - suffixLen] = '\0';
+    return true;
+}
+
+static void refreshEntryLocked(IndexedDir *d, int dirfd, const char *name) {
+    char id[256];
+    if (!idFromName(name, id, sizeof(id))) {
+        return;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        d->entries.removeItem(android::String8(id));
+        return;
+    }
+
+    AsecIndex::Entry entry;
+    entry.dir = d->path;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    d->entries.replaceValueFor(android::String8(id), entry);
+}
+
+static void scanLocked(IndexedDir *d) {
+    d->entries.clear();
+    d->ready = false;
+
+    struct stat st;
+    if (stat(d->path, &st)) {
+        d->dev = 0;
+        d->ino = 0;
+        return;
+    }
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+
+    // Watch before reading so nothing added during the scan is missed
+    int wd = inotify_add_watch(sInotifyFd, d->path, WATCH_MASK);
+    if (wd < 0) {
+        SLOGW("Unable to watch %s (%s); not indexing it", d->path, strerror(errno));
+        if (d->wd >= 0) {
+            inotify_rm_watch(sInotifyFd, d->wd);
+            d->wd = -1;
+        }
+        return;
+    }
+    if (d->wd >= 0 && d->wd != wd) {
+        inotify_rm_watch(sInotifyFd, d->wd);
+    }
+    d->wd = wd;
+
+    DIR *dir = opendir(d->path);
+    if (!dir) {
+        SLOGW("Unable to open %s (%s); not indexing it", d->path, strerror(errno));
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        refreshEntryLocked(d, dirfd(dir), de->d_name);
+    }
+    closedir(dir);
+
+    d->ready = true;
+    SLOGI("Indexed %zu ASECs in %s", d->entries.size(), d->path);
+}
+
+/*
+ * Makes sure d still describes what is at its path, which changes under
+ * the watch whenever external storage is bind-mounted over it.
+ */
+static bool currentLocked(IndexedDir *d) {
+    struct stat st;
+    if (stat(d->path, &st)) {
+        d->entries.clear();
+        d->ready = false;
+        return false;
+    }
+    if (st.st_dev != d->dev || st.st_ino != d->ino) {
+        scanLocked(d);
+    }
+    return d->ready;
+}
+
+static IndexedDir *dirForWatchLocked(int wd) {
+    for (int i = 0; i < sNumDirs; i++) {
+        if (sDirs[i].wd == wd) {
+            return &sDirs[i];
+        }
+    }
+    return NULL;
+}
+
+static void handleEventLocked(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        SLOGW("ASEC index events overflowed; rescanning");
+        for (int i = 0; i < sNumDirs; i++) {
+            scanLocked(&sDirs[i]);
+        }
+        return;
+    }
+
+    IndexedDir *d = dirForWatchLocked(ev->wd);
+    if (!d) {
+        return;
+    }
+
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+        // Rescanned by the next lookup if the path comes back
+        d->entries.clear();
+        d->ready = false;
+        d->dev = 0;
+        d->ino = 0;
+        if (ev->mask & IN_IGNORED) {
+            d->wd = -1;
+        }
+        return;
+    }
+
+    if (!ev->len || !d->ready) {
+        return;
+    }
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        char id[256];
+        if (idFromName(ev->name, id, sizeof(id))) {
+            d->entries.removeItem(android::String8(id));
+        }
+    } else {
+        int dirfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd >= 0) {
+            refreshEntryLocked(d, dirfd, ev->name);
+            close(dirfd);
+        }
+    }
+}
+
+void *AsecIndex::threadStart(void *arg) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(sInotifyFd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SLOGE("ASEC index read failed (%s)", strerror(errno));
+            break;
+        }
+
+        android::Mutex::Autolock lock(sLock);
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            handleEventLocked(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    // Without events the index would go stale; stop using it
+    android::Mutex::Autolock lock(sLock);
+    for (int i = 0; i < sNumDirs; i++) {
+        sDirs[i].entries.clear();
+        sDirs[i].ready = false;
+    }
+    close(sInotifyFd);
+    sInotifyFd = -1;
+    return NULL;
+}
+
+int AsecIndex::start() {
+    android::Mutex::Autolock lock(sLock);
+
+    sInotifyFd = inotify_init();
+    if (sInotifyFd < 0) {
+        SLOGE("Unable to init inotify (%s); ASEC index disabled", strerror(errno));
+        return -1;
+    }
+    fcntl(sInotifyFd, F_SETFD, FD_CLOEXEC);
+
+    const char *paths[] = { Volume::SEC_ASECDIR_INT, Volume::SEC_ASECDIR_EXT };
+    for (int i = 0; i < sNumDirs; i++) {
+        sDirs[i].path = paths[i];
+        sDirs[i].wd = -1;
+        scanLocked(&sDirs[i]);
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, threadStart, NULL)) {
+        SLOGE("Unable to start ASEC index thread (%s)", strerror(errno));
+        pthread_attr_destroy(&attr);
+        for (int i = 0; i < sNumDirs; i++) {
+            sDirs[i].entries.clear();
+            sDirs[i].ready = false;
+        }
+        close(sInotifyFd);
+        sInotifyFd = -1;
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+int AsecIndex::lookup(const char *id, Entry *entry) {
+    android::Mutex::Autolock lock(sLock);
+
+    if (sInotifyFd < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    android::String8 key(id);
+    for (int i = 0; i < sNumDirs; i++) {
+        if (!currentLocked(&sDirs[i])) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t idx = sDirs[i].entries.indexOfKey(key);
+        if (idx >= 0) {
+            if (entry) {
+                *entry = sDirs[i].entries.valueAt(idx);
+            }
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int AsecIndex::list(const char *dir, ListCallback callback, void *data) {
+    EntryMap entries;
+    {
+        android::Mutex::Autolock lock(sLock);
+
+        IndexedDir *d = NULL;
+        for (int i = 0; i < sNumDirs; i++) {
+            if (sDirs[i].path && !strcmp(sDirs[i].path, dir)) {
+                d = &sDirs[i];
+            }
+        }
+        if (sInotifyFd < 0 || !d || !currentLocked(d)) {
+            return -1;
+        }
+        // Shares storage until either side changes
+        entries = d->entries;
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        callback(entries.keyAt(i).string(), &entries.valueAt(i), data);
+    }
+    return 0;
+}
+
+void AsecIndex::update(const char *path) {
+    android::Mutex::Autolock lock(sLock);
+
+    for (int i = 0; i < sNumDirs; i++) {
+        IndexedDir *d = &sDirs[i];
+        if (!d->path || !d->ready) {
+            continue;
+        }
+        size_t len = strlen(d->path);
+        if (strncmp(path, d->path, len) || path[len] != '/' || strchr(path + len + 1, '/')) {
+            continue;
+        }
+        int dirfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd >= 0) {
+            refreshEntryLocked(d, dirfd, path + len + 1);
+            close(dirfd);
+        }
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ASECINDEX_H
+#define _ASECINDEX_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * In-memory index of the *.asec images in the internal and external ASEC
+ * directories, kept current with inotify. A directory that can't be
+ * watched (or was replaced by a mount since it was scanned and couldn't be
+ * rescanned) is not indexed, and callers fall back to the filesystem.
+ */
+class AsecIndex {
+public:
+    struct Entry {
+        /* Volume::SEC_ASECDIR_INT or Volume::SEC_ASECDIR_EXT */
+        const char *dir;
+        off64_t size;
+        time_t mtime;
+    };
+
+    typedef void (*ListCallback)(const char *id, const Entry *entry, void *data);
+
+public:
+    static int start();
+
+    /*
+     * Looks id up, internal directory first. Returns 0 if found, or -1 with
+     * errno ENOENT, or EAGAIN when a directory isn't indexed and the
+     * answer has to come from the filesystem.
+     */
+    static int lookup(const char *id, Entry *entry);
+
+    /* Calls callback for every image in dir; -1 if dir isn't indexed */
+    static int list(const char *dir, ListCallback callback, void *data);
+
+    /* Re-reads one image after vold itself created, removed or renamed it */
+    static void update(const char *path);
+
+private:
+    static void *threadStart(void *arg);
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <utils/List.h>
+#include <utils/threads.h>
+
+#include <sysutils/NetlinkEvent.h>
+
+#include "BlockNode.h"
+
+struct NodeWaiter {
+    const char *name;
+    bool announced;
+};
+
+typedef android::List<NodeWaiter *> NodeWaiterCollection;
+
+static android::Mutex sLock;
+static android::Condition sCond;
+static NodeWaiterCollection sWaiters;
+
+static long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool nodeExists(const char *path) {
+    return !access(path, F_OK) || errno != ENOENT;
+}
+
+int BlockNode::waitFor(const char *path, int timeoutMs) {
+    if (nodeExists(path)) {
+        return 0;
+    }
+
+    const char *name = strrchr(path, '/');
+    NodeWaiter waiter;
+    waiter.name = name ? name + 1 : path;
+    waiter.announced = false;
+
+    long long deadline = monotonicMs() + timeoutMs;
+    int rc = 0;
+
+    android::Mutex::Autolock lock(sLock);
+    sWaiters.push_back(&waiter);
+
+    while (!nodeExists(path)) {
+        long long remaining = deadline - monotonicMs();
+        if (remaining <= 0) {
+            SLOGW("Timed out waiting for %s", path);
+            rc = -1;
+            break;
+        }
+
+        /*
+         * The uevent means the kernel has the device; ueventd creates the
+         * node from the same event, so it may still be a moment behind us.
+         */
+        long long wait = waiter.announced ? RECHECK_MS : FALLBACK_MS;
+        if (wait > remaining) {
+            wait = remaining;
+        }
+        sCond.waitRelative(sLock, wait * 1000000LL);
+    }
+
+    for (NodeWaiterCollection::iterator it = sWaiters.begin(); it != sWaiters.end(); ++it) {
+        if (*it == &waiter) {
+            sWaiters.erase(it);
+            break;
+        }
+    }
+
+    if (rc) {
+        errno = ETIMEDOUT;
+    }
+    return rc;
+}
+
+void BlockNode::handleUevent(NetlinkEvent *evt) {
+    if (evt->getAction() != NetlinkEvent::NlActionAdd) {
+        return;
+    }
+    const char *devname = evt->findParam("DEVNAME");
+    if (!devname) {
+        return;
+    }
+
+    android::Mutex::Autolock lock(sLock);
+    bool wake = false;
+    for (NodeWaiterCollection::iterator it = sWaiters.begin(); it != sWaiters.end(); ++it) {
+        if (!strcmp((*it)->name, devname)) {
+            (*it)->announced = true;
+            wake = true;
+        }
+    }
+    if (wake) {
+        sCond.broadcast();
+    }
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BLOCKNODE_H
+#define _BLOCKNODE_H
+
+class NetlinkEvent;
+
+/*
+ * Waits for block device nodes (e.g. a freshly created /dev/block/dm-N)
+ * to show up. Waiters are woken by the block uevents NetlinkHandler sees
+ * instead of polling on a fixed schedule.
+ */
+class BlockNode {
+public:
+    /* How often to look again once the kernel has announced the device */
+    static const int RECHECK_MS = 2;
+    /* Safety net in case the uevent went by before we started waiting */
+    static const int FALLBACK_MS = 50;
+
+public:
+    static int waitFor(const char *path, int timeoutMs);
+    static void handleUevent(NetlinkEvent *evt);
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
 
 #define LOG_TAG "VoldCmdListener"
 #include <cutils/log.h>
@@ -39,6 +40,8 @@
 #include "Devmapper.h"
 #include "cryptfs.h"
 #include "fstrim.h"
+#include "AsecIndex.h"
+#include "ContainerLocks.h"
 
 // MStar Android Patch Begin
 #define DUMP_ARGS 1
@@ -101,7 +104,10 @@ int CommandListener::DumpCmd::runCommand(SocketClient *cli,
         cli->sendMsg(ResponseCode::CommandOkay, "Loop dump failed", true);
     }
     cli->sendMsg(0, "Dumping DM status", false);
-    if (Devmapper::dumpState(cli)) {
+    // MStar Android Patch Begin
+    // "dump <prefix>" limits the DM section to mappings named <prefix>*
+    if (Devmapper::dumpState(cli, argc > 1 ? argv[1] : NULL)) {
+    // MStar Android Patch End
         cli->sendMsg(ResponseCode::CommandOkay, "Devmapper dump failed", true);
     }
     cli->sendMsg(0, "Dumping mounted filesystems", false);
@@ -243,6 +249,18 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
     return 0;
 }
 
+static void sendStorageUser(const Process::Holder *holder, void *data) {
+    SocketClient *cli = (SocketClient *) data;
+    char processName[255];
+    char msg[1024 + PATH_MAX];
+
+    // <pid> <name> <uid> <fd|mmap|cwd|root|exe> <path>
+    Process::getProcessName(holder->pid, processName, sizeof(processName));
+    snprintf(msg, sizeof(msg), "%d %s %d %s %s", holder->pid, processName, holder->uid,
+            Process::holderTypeToStr(holder->type), holder->path);
+    cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
+}
+
 CommandListener::StorageCmd::StorageCmd() :
                  VoldCommand("storage") {
 }
@@ -257,49 +275,219 @@ int CommandListener::StorageCmd::runCommand(SocketClient *cli,
     }
 
     if (!strcmp(argv[1], "users")) {
-        DIR *dir;
-        struct dirent *de;
+        static const char *usage = "Usage: storage users <path> [first] [uid <uid>] "
+                "[pid <pid>] [package <name>] [type <fd|mmap|cwd|root|exe>[,...]]";
+        if (argc < 3) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, usage, false);
+            return 0;
+        }
 
-        if (!(dir = opendir("/proc"))) {
+        Process::HolderFilter filter;
+        bool firstOnly = false;
+        for (int i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "first")) {
+                firstOnly = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                cli->sendMsg(ResponseCode::CommandSyntaxError, usage, false);
+                return 0;
+            }
+            const char *value = argv[++i];
+            if (!strcmp(argv[i - 1], "uid")) {
+                filter.uid = (uid_t) strtoul(value, NULL, 10);
+            } else if (!strcmp(argv[i - 1], "pid")) {
+                filter.pid = atoi(value);
+            } else if (!strcmp(argv[i - 1], "package")) {
+                filter.package = value;
+            } else if (!strcmp(argv[i - 1], "type")) {
+                char types[64];
+                char *save;
+                strlcpy(types, value, sizeof(types));
+                filter.typeMask = 0;
+                for (char *t = strtok_r(types, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+                    int type = Process::holderTypeFromStr(t);
+                    if (type == Process::HOLDER_NONE) {
+                        cli->sendMsg(ResponseCode::CommandSyntaxError, usage, false);
+                        return 0;
+                    }
+                    filter.typeMask |= (1 << type);
+                }
+            } else {
+                cli->sendMsg(ResponseCode::CommandSyntaxError, usage, false);
+                return 0;
+            }
+        }
+
+        // Holders are streamed to the client as the scanner finds them
+        if (Process::findHolders(argv[2], firstOnly, sendStorageUser, cli, &filter) < 0) {
             cli->sendMsg(ResponseCode::OperationFailed, "Failed to open /proc", true);
             return 0;
         }
+        cli->sendMsg(ResponseCode::CommandOkay, "Storage user list complete", false);
+    } else {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown storage cmd", false);
+    }
+    return 0;
+}
+
+// MStar Android Patch Begin
+struct CommandListener::ContainerCmd::Job {
+    ContainerCmd *cmd;
+    /* The connection, referenced until the last reply is relayed */
+    SocketClient *cli;
+    /*
+     * Collects the replies in a pipe, tagged with this command's number.
+     * Closing it tells the relay the command is done.
+     */
+    SocketClient *reply;
+    int relayFd;
+    int argc;
+    char **argv;
+};
+
+void CommandListener::ContainerCmd::freeJob(Job *job) {
+    for (int i = 0; i < job->argc; i++) {
+        free(job->argv[i]);
+    }
+    free(job->argv);
+    delete job->reply;
+    if (job->relayFd >= 0) {
+        close(job->relayFd);
+    }
+    job->cli->decRef();
+    delete job;
+}
 
-        while ((de = readdir(dir))) {
-            int pid = Process::getPid(de->d_name);
+/* Once the pipe is closed the relay may free the job at any moment */
+void CommandListener::ContainerCmd::closeReply(Job *job) {
+    SocketClient *reply = job->reply;
+    job->reply = NULL;
+    delete reply;
+}
 
-            if (pid < 0) {
-                continue;
+void *CommandListener::ContainerCmd::threadStart(void *arg) {
+    Job *job = (Job *) arg;
+    job->cmd->runContainerCommand(job->reply, job->argc, job->argv);
+    closeReply(job);
+    return NULL;
+}
+
+/*
+ * Hands the command's replies to the connection one message at a time.
+ * They go out through cli itself, under the same write lock as every
+ * other reply on the socket, so they can't interleave with them.
+ */
+void *CommandListener::ContainerCmd::relayStart(void *arg) {
+    Job *job = (Job *) arg;
+    size_t size = 1024;
+    size_t len = 0;
+    char *buf = (char *) malloc(size);
+
+    while (buf) {
+        if (len == size) {
+            char *bigger = (char *) realloc(buf, size * 2);
+            if (!bigger) {
+                SLOGE("Out of memory relaying %s replies", job->argv[0]);
+                break;
             }
+            buf = bigger;
+            size *= 2;
+        }
+        ssize_t n = TEMP_FAILURE_RETRY(read(job->relayFd, buf + len, size - len));
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+
+        // Messages are NUL-terminated; keep a partial one for the next read
+        char *msg = buf;
+        char *end;
+        while ((end = (char *) memchr(msg, '\0', buf + len - msg))) {
+            job->cli->sendMsg(msg);
+            msg = end + 1;
+        }
+        len = buf + len - msg;
+        memmove(buf, msg, len);
+    }
+    free(buf);
 
-            char processName[255];
-            Process::getProcessName(pid, processName, sizeof(processName));
+    // Drain anything left so the command never blocks on a full pipe
+    char discard[256];
+    while (TEMP_FAILURE_RETRY(read(job->relayFd, discard, sizeof(discard))) > 0) {
+    }
+    freeJob(job);
+    return NULL;
+}
 
-            if (Process::checkFileDescriptorSymLinks(pid, argv[2]) ||
-                Process::checkFileMaps(pid, argv[2]) ||
-                Process::checkSymLink(pid, argv[2], "cwd") ||
-                Process::checkSymLink(pid, argv[2], "root") ||
-                Process::checkSymLink(pid, argv[2], "exe")) {
+/*
+ * Replies carry the command number, so the framework can match them to
+ * commands however they complete. The listener moves on to the next
+ * command as soon as the threads are started. ContainerLocks keeps two
+ * operations on a container from overlapping, but doesn't run them in
+ * the order they arrived; a client that cares waits for the reply.
+ */
+int CommandListener::ContainerCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        SLOGW("Running %s inline (%s)", argv[0], strerror(errno));
+        return runContainerCommand(cli, argc, argv);
+    }
 
-                char msg[1024];
-                snprintf(msg, sizeof(msg), "%d %s", pid, processName);
-                cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
-            }
+    Job *job = new Job;
+    job->cmd = this;
+    job->cli = cli;
+    job->reply = new SocketClient(fds[1], true, true);
+    job->reply->setCmdNum(cli->getCmdNum());
+    job->relayFd = fds[0];
+    job->argc = 0;
+    job->argv = (char **) calloc(argc, sizeof(char *));
+    for (int i = 0; job->argv && i < argc; i++) {
+        if (!(job->argv[i] = strdup(argv[i]))) {
+            break;
         }
-        closedir(dir);
-        cli->sendMsg(ResponseCode::CommandOkay, "Storage user list complete", false);
-    } else {
-        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown storage cmd", false);
+        job->argc++;
+    }
+    cli->incRef();
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = job->argc == argc ? pthread_create(&thread, &attr, relayStart, job) : ENOMEM;
+    if (rc) {
+        pthread_attr_destroy(&attr);
+        SLOGW("Running %s inline (%s)", argv[0], strerror(rc));
+        freeJob(job);
+        return runContainerCommand(cli, argc, argv);
+    }
+    rc = pthread_create(&thread, &attr, threadStart, job);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        SLOGW("Running %s inline (%s)", argv[0], strerror(rc));
+        closeReply(job);
+        return runContainerCommand(cli, argc, argv);
     }
     return 0;
 }
+// MStar Android Patch End
 
 CommandListener::AsecCmd::AsecCmd() :
-                 VoldCommand("asec") {
+                 ContainerCmd("asec") {
 }
 
+// MStar Android Patch Begin
+static void sendAsecListResult(const char *id, const AsecIndex::Entry *entry, void *data) {
+    ((SocketClient *) data)->sendMsg(ResponseCode::AsecListResult, id, false);
+}
+// MStar Android Patch End
+
 void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const char *directory) {
     // MStar Android Patch Begin
+    if (!AsecIndex::list(directory, sendAsecListResult, cli)) {
+        return;
+    }
+
     // The front method to read all directory entries may cause some strange crash
     // when vold tries to free some memory which vold has allocated.
     // These code below comes form ICS "CommandListener.cpp" .
@@ -325,7 +513,7 @@ void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const cha
     // MStar Android Patch ENd
 }
 
-int CommandListener::AsecCmd::runCommand(SocketClient *cli,
+int CommandListener::AsecCmd::runContainerCommand(SocketClient *cli,
                                                       int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
@@ -336,7 +524,9 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
     int rc = 0;
 
     // MStar Android Patch Begin
-    vm->lockActiveContainers();
+    const bool hasId = argc > 2 && strcmp(argv[1], "list") && strcmp(argv[1], "info");
+    const bool isPair = argc > 3 && (!strcmp(argv[1], "rename") || !strcmp(argv[1], "snapshot"));
+    ContainerLocks::Autolock lock(hasId ? argv[2] : NULL, isPair ? argv[3] : NULL);
 
     if (!strcmp(argv[1], "list")) {
         dumpArgs(argc, argv, -1);
@@ -345,22 +535,32 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         listAsecsInDirectory(cli, Volume::SEC_ASECDIR_INT);
     } else if (!strcmp(argv[1], "create")) {
         dumpArgs(argc, argv, 5);
-        if (argc != 8) {
+        int imageFlags = 0;
+        bool badOption = false;
+        if (argc == 9) {
+            if (!strcmp(argv[8], "sparse")) {
+                imageFlags = Loop::IMAGE_SPARSE;
+            } else if (!strcmp(argv[8], "checkextents")) {
+                imageFlags = Loop::IMAGE_REPORT_EXTENTS;
+            } else {
+                badOption = true;
+            }
+        }
+        if ((argc != 8 && argc != 9) || badOption) {
             cli->sendMsg(ResponseCode::CommandSyntaxError,
                     "Usage: asec create <container-id> <size_mb> <fstype> <key> <ownerUid> "
-                    "<isExternal>", false);
-            vm->unlockActiveContainers();
+                    "<isExternal> [sparse|checkextents]", false);
             return 0;
         }
 
         unsigned int numSectors = (atoi(argv[3]) * (1024 * 1024)) / 512;
         const bool isExternal = (atoi(argv[7]) == 1);
-        rc = vm->createAsec(argv[2], numSectors, argv[4], argv[5], atoi(argv[6]), isExternal);
+        rc = vm->createAsec(argv[2], numSectors, argv[4], argv[5], atoi(argv[6]), isExternal,
+                imageFlags);
     } else if (!strcmp(argv[1], "finalize")) {
         dumpArgs(argc, argv, -1);
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec finalize <container-id>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         rc = vm->finalizeAsec(argv[2]);
@@ -368,7 +568,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         dumpArgs(argc, argv, -1);
         if  (argc != 5) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec fixperms <container-id> <gid> <filename>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
 
@@ -376,7 +575,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         gid_t gid = (gid_t) strtoul(argv[3], &endptr, 10);
         if (*endptr != '\0') {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec fixperms <container-id> <gid> <filename>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
 
@@ -385,7 +583,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         dumpArgs(argc, argv, -1);
         if (argc < 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec destroy <container-id> [force]", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         bool force = false;
@@ -398,7 +595,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         if (argc != 5) {
             cli->sendMsg(ResponseCode::CommandSyntaxError,
                     "Usage: asec mount <namespace-id> <key> <ownerUid>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         rc = vm->mountAsec(argv[2], argv[3], atoi(argv[4]));
@@ -406,7 +602,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         dumpArgs(argc, argv, -1);
         if (argc < 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec unmount <container-id> [force]", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         bool force = false;
@@ -419,36 +614,67 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         if (argc != 4) {
             cli->sendMsg(ResponseCode::CommandSyntaxError,
                     "Usage: asec rename <old_id> <new_id>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         rc = vm->renameAsec(argv[2], argv[3]);
+    } else if (!strcmp(argv[1], "resize")) {
+        dumpArgs(argc, argv, 4);
+        if (argc != 5) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: asec resize <container-id> <size_mb> <key>", false);
+            return 0;
+        }
+        unsigned long long numBytes = strtoull(argv[3], NULL, 10) * 1024 * 1024;
+        if (numBytes / 512 > UINT_MAX) {
+            cli->sendMsg(ResponseCode::CommandParameterError, "Container size too large", false);
+            return 0;
+        }
+        unsigned int numSectors = numBytes / 512;
+        rc = vm->resizeAsec(argv[2], numSectors, argv[4]);
+    } else if (!strcmp(argv[1], "snapshot")) {
+        dumpArgs(argc, argv, -1);
+        if (argc != 4) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: asec snapshot <container-id> <snapshot-id>", false);
+            return 0;
+        }
+        rc = vm->snapshotAsec(argv[2], argv[3]);
+    } else if (!strcmp(argv[1], "trim")) {
+        dumpArgs(argc, argv, -1);
+        if (argc != 2) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec trim", false);
+            return 0;
+        }
+        rc = vm->trimContainers(cli);
+    } else if (!strcmp(argv[1], "info")) {
+        dumpArgs(argc, argv, -1);
+        if (argc != 3 || strcmp(argv[2], "all")) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec info all", false);
+            return 0;
+        }
+        rc = vm->listAsecInfo(cli);
     } else if (!strcmp(argv[1], "path")) {
         dumpArgs(argc, argv, -1);
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec path <container-id>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         char path[255];
 
         if (!(rc = vm->getAsecMountPath(argv[2], path, sizeof(path)))) {
             cli->sendMsg(ResponseCode::AsecPathResult, path, false);
-            vm->unlockActiveContainers();
             return 0;
         }
     } else if (!strcmp(argv[1], "fspath")) {
         dumpArgs(argc, argv, -1);
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: asec fspath <container-id>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         char path[255];
 
         if (!(rc = vm->getAsecFilesystemPath(argv[2], path, sizeof(path)))) {
             cli->sendMsg(ResponseCode::AsecPathResult, path, false);
-            vm->unlockActiveContainers();
             return 0;
         }
     } else {
@@ -456,7 +682,6 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown asec cmd", false);
     }
 
-    vm->unlockActiveContainers();
     // MStar Android Patch End
 
     if (!rc) {
@@ -470,10 +695,10 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
 }
 
 CommandListener::ObbCmd::ObbCmd() :
-                 VoldCommand("obb") {
+                 ContainerCmd("obb") {
 }
 
-int CommandListener::ObbCmd::runCommand(SocketClient *cli,
+int CommandListener::ObbCmd::runContainerCommand(SocketClient *cli,
                                                       int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
@@ -484,18 +709,17 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
     int rc = 0;
 
     // MStar Android Patch Begin
-    vm->lockActiveContainers();
+    ContainerLocks::Autolock lock(argc > 2 && strcmp(argv[1], "list") ? argv[2] : NULL);
 
     if (!strcmp(argv[1], "list")) {
         dumpArgs(argc, argv, -1);
 
-        rc = vm->listMountedObbs(cli);
+        rc = vm->listMountedObbs(cli, argc > 2 && !strcmp(argv[2], "detail"));
     } else if (!strcmp(argv[1], "mount")) {
             dumpArgs(argc, argv, 3);
             if (argc != 5) {
                 cli->sendMsg(ResponseCode::CommandSyntaxError,
                         "Usage: obb mount <filename> <key> <ownerGid>", false);
-                vm->unlockActiveContainers();
                 return 0;
             }
             rc = vm->mountObb(argv[2], argv[3], atoi(argv[4]));
@@ -503,7 +727,6 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
         dumpArgs(argc, argv, -1);
         if (argc < 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: obb unmount <source file> [force]", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         bool force = false;
@@ -515,14 +738,12 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
         dumpArgs(argc, argv, -1);
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: obb path <source file>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         char path[255];
 
         if (!(rc = vm->getObbMountPath(argv[2], path, sizeof(path)))) {
             cli->sendMsg(ResponseCode::AsecPathResult, path, false);
-            vm->unlockActiveContainers();
             return 0;
         }
     } else {
@@ -530,7 +751,6 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown obb cmd", false);
     }
 
-    vm->unlockActiveContainers();
     // MStar Android Patch End
 
     if (!rc) {
@@ -545,10 +765,10 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
 
 // MStar Android Patch Begin
 CommandListener::ISOCmd::ISOCmd() :
-                 VoldCommand("iso") {
+                 ContainerCmd("iso") {
 }
 
-int CommandListener::ISOCmd::runCommand(SocketClient *cli,
+int CommandListener::ISOCmd::runContainerCommand(SocketClient *cli,
                                                       int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
@@ -560,22 +780,20 @@ int CommandListener::ISOCmd::runCommand(SocketClient *cli,
 
     dumpArgs(argc, argv, -1);
 
-    vm->lockActiveContainers();
+    ContainerLocks::Autolock lock(argc > 2 && strcmp(argv[1], "list") ? argv[2] : NULL);
 
     if (!strcmp(argv[1], "list")) {
-        rc = vm->listMountedISOs(cli);
+        rc = vm->listMountedISOs(cli, argc > 2 && !strcmp(argv[2], "detail"));
     } else if (!strcmp(argv[1], "mount")) {
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError,
                         "Usage: iso mount <filename>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         rc = vm->mountISO(argv[2]);
     } else if (!strcmp(argv[1], "unmount")) {
         if (argc < 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: iso unmount <source file> [force]", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         bool force = false;
@@ -586,21 +804,18 @@ int CommandListener::ISOCmd::runCommand(SocketClient *cli,
     } else if (!strcmp(argv[1], "path")) {
         if (argc != 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: iso path <source file>", false);
-            vm->unlockActiveContainers();
             return 0;
         }
         char path[255];
 
         if (!(rc = vm->getISOMountPath(argv[2], path, sizeof(path)))) {
             cli->sendMsg(ResponseCode::AsecPathResult, path, false);
-            vm->unlockActiveContainers();
             return 0;
         }
     } else {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown iso cmd", false);
     }
 
-    vm->unlockActiveContainers();
 
     if (!rc) {
         cli->sendMsg(ResponseCode::CommandOkay, "iso operation succeeded", false);
@@ -828,6 +1043,10 @@ int CommandListener::FstrimCmd::runCommand(SocketClient *cli,
         }
         dumpArgs(argc, argv, -1);
         rc = fstrim_filesystems();
+        // MStar Android Patch Begin
+        // Containers ride along with the framework's daily trim
+        VolumeManager::Instance()->startContainerTrim();
+        // MStar Android Patch End
     } else {
         dumpArgs(argc, argv, -1);
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown fstrim cmd", false);
@@ -42,28 +42,48 @@ private:
         int runCommand(SocketClient *c, int argc, char ** argv);
     };
 
-    class AsecCmd : public VoldCommand {
+    // MStar Android Patch Begin
+    /*
+     * Container commands run on threads of their own so that slow ones
+     * (formatting, fsck, waiting on holders) don't hold up the rest.
+     */
+    class ContainerCmd : public VoldCommand {
+    public:
+        ContainerCmd(const char *cmd) : VoldCommand(cmd) {}
+        virtual ~ContainerCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+        virtual int runContainerCommand(SocketClient *c, int argc, char ** argv) = 0;
+    private:
+        struct Job;
+        static void *threadStart(void *arg);
+        static void *relayStart(void *arg);
+        static void closeReply(Job *job);
+        static void freeJob(Job *job);
+    };
+    // MStar Android Patch End
+
+    class AsecCmd : public ContainerCmd {
     public:
         AsecCmd();
         virtual ~AsecCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+        int runContainerCommand(SocketClient *c, int argc, char ** argv);
     private:
         void listAsecsInDirectory(SocketClient *c, const char *directory);
     };
 
-    class ObbCmd : public VoldCommand {
+    class ObbCmd : public ContainerCmd {
     public:
         ObbCmd();
         virtual ~ObbCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+        int runContainerCommand(SocketClient *c, int argc, char ** argv);
     };
 
     // MStar Android Patch Begin
-    class ISOCmd : public VoldCommand {
+    class ISOCmd : public ContainerCmd {
     public:
         ISOCmd();
         virtual ~ISOCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+        int runContainerCommand(SocketClient *c, int argc, char ** argv);
     };
 
     class SambaCmd : public VoldCommand {
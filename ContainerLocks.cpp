@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <utils/SortedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+#include "ContainerLocks.h"
+
+static android::Mutex sLock;
+/* Signalled whenever a container lock or an operation slot is released */
+static android::Condition sCond;
+static android::SortedVector<android::String8> sHeld;
+static int sActiveOps = 0;
+static int sMaxOps = 0;
+
+static nsecs_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (nsecs_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool ContainerLocks::acquire(const char *id, int timeoutMs) {
+    android::String8 key(id);
+    nsecs_t deadline = timeoutMs >= 0 ? nowNs() + (nsecs_t) timeoutMs * 1000000LL : 0;
+
+    android::Mutex::Autolock lock(sLock);
+    while (sHeld.indexOf(key) >= 0) {
+        if (timeoutMs < 0) {
+            sCond.wait(sLock);
+            continue;
+        }
+        nsecs_t left = deadline - nowNs();
+        if (left <= 0) {
+            SLOGW("Timed out waiting for operation on %s", id);
+            return false;
+        }
+        sCond.waitRelative(sLock, left);
+    }
+    sHeld.add(key);
+    return true;
+}
+
+void ContainerLocks::release(const char *id) {
+    android::Mutex::Autolock lock(sLock);
+    sHeld.remove(android::String8(id));
+    sCond.broadcast();
+}
+
+void ContainerLocks::beginOperation() {
+    android::Mutex::Autolock lock(sLock);
+
+    if (!sMaxOps) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.vold.container_ops", value, "");
+        sMaxOps = atoi(value);
+        if (sMaxOps <= 0) {
+            sMaxOps = DEFAULT_MAX_OPS;
+        } else if (sMaxOps > MAX_OPS) {
+            sMaxOps = MAX_OPS;
+        }
+    }
+
+    while (sActiveOps >= sMaxOps) {
+        sCond.wait(sLock);
+    }
+    sActiveOps++;
+}
+
+void ContainerLocks::endOperation() {
+    android::Mutex::Autolock lock(sLock);
+    sActiveOps--;
+    sCond.broadcast();
+}
+
+ContainerLocks::Autolock::Autolock(const char *id1, const char *id2) : mSlot(false) {
+    // Always lock a pair in the same order
+    if (id1 && id2 && strcmp(id1, id2) > 0) {
+        const char *tmp = id1;
+        id1 = id2;
+        id2 = tmp;
+    } else if (id1 && id2 && !strcmp(id1, id2)) {
+        id2 = NULL;
+    }
+    mIds[0] = id1;
+    mIds[1] = id2;
+
+    for (int i = 0; i < 2; i++) {
+        if (mIds[i]) {
+            acquire(mIds[i]);
+        }
+    }
+    // Waiting for the container first keeps queued work from hogging slots
+    if (mIds[0] || mIds[1]) {
+        beginOperation();
+        mSlot = true;
+    }
+}
+
+ContainerLocks::Autolock::~Autolock() {
+    if (mSlot) {
+        endOperation();
+    }
+    for (int i = 1; i >= 0; i--) {
+        if (mIds[i]) {
+            release(mIds[i]);
+        }
+    }
+}
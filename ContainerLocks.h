@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CONTAINERLOCKS_H
+#define _CONTAINERLOCKS_H
+
+#include <unistd.h>
+
+/*
+ * Serializes operations on one container (ASEC id, OBB or ISO file) while
+ * letting operations on different containers run side by side, at most
+ * ro.vold.container_ops of them at a time.
+ *
+ * Lock order: a container lock is taken before
+ * VolumeManager::mActiveContainersLock, never while holding it.
+ */
+class ContainerLocks {
+public:
+    static const int DEFAULT_MAX_OPS = 2;
+    static const int MAX_OPS = 8;
+
+    /* Takes the container lock; false if timeoutMs (>= 0) ran out first */
+    static bool acquire(const char *id, int timeoutMs = -1);
+    static void release(const char *id);
+
+    /*
+     * Holds the locks of up to two containers (NULL for none) and an
+     * operation slot. The id strings must outlive the Autolock.
+     */
+    class Autolock {
+    public:
+        Autolock(const char *id1, const char *id2 = NULL);
+        ~Autolock();
+    private:
+        const char *mIds[2];
+        bool mSlot;
+    };
+
+private:
+    static void beginOperation();
+    static void endOperation();
+};
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include <linux/kdev_t.h>
+#include <linux/loop.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+#include "ContainerRegistry.h"
+#include "Devmapper.h"
+
+typedef android::KeyedVector<android::String8, ContainerRegistry::Record *> RecordMap;
+typedef android::KeyedVector<android::String8, android::String8> DeviceMap;
+
+static android::Mutex sLock;
+static RecordMap sRecords;
+/* Loop device -> owning hash, for destroyByDevice() */
+static DeviceMap sLoopOwners;
+static bool sReady = false;
+
+static ContainerRegistry::Record *findRecordLocked(const char *hash) {
+    ssize_t idx = sRecords.indexOfKey(android::String8(hash));
+    return idx < 0 ? NULL : sRecords.valueAt(idx);
+}
+
+static ContainerRegistry::Record *editRecordLocked(const char *hash) {
+    ContainerRegistry::Record *record = findRecordLocked(hash);
+    if (!record) {
+        record = (ContainerRegistry::Record *) calloc(1, sizeof(*record));
+        if (!record) {
+            SLOGE("Failed to allocate registry record for %s", hash);
+            return NULL;
+        }
+        sRecords.add(android::String8(hash), record);
+    }
+    return record;
+}
+
+static void dropIfUnusedLocked(const char *hash) {
+    ssize_t idx = sRecords.indexOfKey(android::String8(hash));
+    if (idx < 0) {
+        return;
+    }
+    ContainerRegistry::Record *record = sRecords.valueAt(idx);
+    if (!record->loopDevice[0] && !record->dmDevice[0] && !record->mountPoint[0]) {
+        free(record);
+        sRecords.removeItemsAt(idx);
+    }
+}
+
+static void setLoopLocked(const char *hash, const char *loopDevice,
+        const char *backingFile, unsigned long long numSectors) {
+    ContainerRegistry::Record *record = editRecordLocked(hash);
+    if (!record) {
+        return;
+    }
+    strlcpy(record->loopDevice, loopDevice, sizeof(record->loopDevice));
+    strlcpy(record->backingFile, backingFile, sizeof(record->backingFile));
+    record->numSectors = numSectors;
+    sLoopOwners.add(android::String8(loopDevice), android::String8(hash));
+}
+
+static int readSysfsLine(const char *path, char *buffer, size_t len) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    if (!fgets(buffer, len, fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+/* Picks up the loop devices already bound by a previous vold instance */
+static void rebuildLoopsLocked(DeviceMap *devices) {
+    DIR *d = opendir("/sys/block");
+    if (!d) {
+        SLOGE("Unable to open /sys/block (%s)", strerror(errno));
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char path[PATH_MAX];
+        char backingFile[PATH_MAX];
+        char size[32];
+
+        if (strncmp(de->d_name, "loop", 4)) {
+            continue;
+        }
+
+        // Only bound loop devices have a backing_file
+        snprintf(path, sizeof(path), "/sys/block/%s/loop/backing_file", de->d_name);
+        if (readSysfsLine(path, backingFile, sizeof(backingFile))) {
+            continue;
+        }
+
+        char loopDevice[256];
+        snprintf(loopDevice, sizeof(loopDevice), "/dev/block/%s", de->d_name);
+
+        int fd = open(loopDevice, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            SLOGW("Unable to open %s (%s)", loopDevice, strerror(errno));
+            continue;
+        }
+        struct loop_info64 li;
+        int rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+        close(fd);
+        if (rc < 0) {
+            continue;
+        }
+
+        char hash[LO_NAME_SIZE + 1];
+        strlcpy(hash, (const char *) li.lo_crypt_name, sizeof(hash));
+        if (!hash[0]) {
+            // Not one of ours
+            continue;
+        }
+
+        unsigned long long numSectors = 0;
+        snprintf(path, sizeof(path), "/sys/block/%s/size", de->d_name);
+        if (!readSysfsLine(path, size, sizeof(size))) {
+            numSectors = strtoull(size, NULL, 10);
+        }
+
+        setLoopLocked(hash, loopDevice, backingFile, numSectors);
+        devices->add(android::String8(loopDevice), android::String8(hash));
+    }
+    closedir(d);
+}
+
+static void addDmDevice(const char *name, unsigned long long dev, void *data) {
+    DeviceMap *devices = (DeviceMap *) data;
+    ContainerRegistry::Record *record = editRecordLocked(name);
+    if (!record) {
+        return;
+    }
+    unsigned minor = (dev & 0xff) | ((dev >> 12) & 0xfff00);
+    snprintf(record->dmDevice, sizeof(record->dmDevice), "/dev/block/dm-%u", minor);
+    devices->add(android::String8(record->dmDevice), android::String8(name));
+}
+
+static void rebuildMountsLocked(const DeviceMap &devices) {
+    FILE *fp = fopen("/proc/mounts", "r");
+    if (!fp) {
+        SLOGE("Unable to open /proc/mounts (%s)", strerror(errno));
+        return;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *saveptr = NULL;
+        char *source = strtok_r(line, " ", &saveptr);
+        char *target = strtok_r(NULL, " ", &saveptr);
+        if (!source || !target) {
+            continue;
+        }
+        ssize_t idx = devices.indexOfKey(android::String8(source));
+        if (idx < 0) {
+            continue;
+        }
+        ContainerRegistry::Record *record = findRecordLocked(devices.valueAt(idx).string());
+        if (record) {
+            strlcpy(record->mountPoint, target, sizeof(record->mountPoint));
+        }
+    }
+    fclose(fp);
+}
+
+int ContainerRegistry::rebuild() {
+    android::Mutex::Autolock lock(sLock);
+    DeviceMap devices;
+
+    for (size_t i = 0; i < sRecords.size(); i++) {
+        free(sRecords.valueAt(i));
+    }
+    sRecords.clear();
+    sLoopOwners.clear();
+    sReady = false;
+
+    rebuildLoopsLocked(&devices);
+    if (Devmapper::listDevices(addDmDevice, &devices)) {
+        SLOGE("Unable to list devmapper devices; falling back to device scans");
+        return -1;
+    }
+    rebuildMountsLocked(devices);
+
+    SLOGI("Container registry rebuilt (%zu entries)", sRecords.size());
+    sReady = true;
+    return 0;
+}
+
+bool ContainerRegistry::isReady() {
+    android::Mutex::Autolock lock(sLock);
+    return sReady;
+}
+
+int ContainerRegistry::lookup(const char *hash, Record *record) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = findRecordLocked(hash);
+    if (!r) {
+        errno = ENOENT;
+        return -1;
+    }
+    *record = *r;
+    return 0;
+}
+
+void ContainerRegistry::forEach(RecordCallback callback, void *data) {
+    android::Mutex::Autolock lock(sLock);
+    for (size_t i = 0; i < sRecords.size(); i++) {
+        callback(sRecords.keyAt(i).string(), *sRecords.valueAt(i), data);
+    }
+}
+
+int ContainerRegistry::lookupLoop(const char *hash, char *buffer, size_t len) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = findRecordLocked(hash);
+
+    memset(buffer, 0, len);
+    if (!r || !r->loopDevice[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    strlcpy(buffer, r->loopDevice, len);
+    return 0;
+}
+
+int ContainerRegistry::lookupDm(const char *hash, char *buffer, size_t len) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = findRecordLocked(hash);
+
+    if (!r || !r->dmDevice[0]) {
+        errno = ENXIO;
+        return -1;
+    }
+    strlcpy(buffer, r->dmDevice, len);
+    return 0;
+}
+
+void ContainerRegistry::setLoop(const char *hash, const char *loopDevice,
+        const char *backingFile, unsigned long long numSectors) {
+    android::Mutex::Autolock lock(sLock);
+    setLoopLocked(hash, loopDevice, backingFile, numSectors);
+}
+
+void ContainerRegistry::clearLoop(const char *loopDevice) {
+    android::Mutex::Autolock lock(sLock);
+    ssize_t idx = sLoopOwners.indexOfKey(android::String8(loopDevice));
+    if (idx < 0) {
+        return;
+    }
+    android::String8 hash = sLoopOwners.valueAt(idx);
+    sLoopOwners.removeItemsAt(idx);
+
+    Record *r = findRecordLocked(hash.string());
+    if (r && !strcmp(r->loopDevice, loopDevice)) {
+        r->loopDevice[0] = '\0';
+        r->backingFile[0] = '\0';
+        r->numSectors = 0;
+        dropIfUnusedLocked(hash.string());
+    }
+}
+
+void ContainerRegistry::setDm(const char *hash, const char *dmDevice) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = editRecordLocked(hash);
+    if (r) {
+        strlcpy(r->dmDevice, dmDevice, sizeof(r->dmDevice));
+    }
+}
+
+void ContainerRegistry::clearDm(const char *hash) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = findRecordLocked(hash);
+    if (r) {
+        r->dmDevice[0] = '\0';
+        dropIfUnusedLocked(hash);
+    }
+}
+
+void ContainerRegistry::setMountPoint(const char *hash, const char *mountPoint) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = editRecordLocked(hash);
+    if (r) {
+        strlcpy(r->mountPoint, mountPoint, sizeof(r->mountPoint));
+    }
+}
+
+void ContainerRegistry::clearMountPoint(const char *hash) {
+    android::Mutex::Autolock lock(sLock);
+    Record *r = findRecordLocked(hash);
+    if (r) {
+        r->mountPoint[0] = '\0';
+        dropIfUnusedLocked(hash);
+    }
+}
+
+void ContainerRegistry::rename(const char *hash, const char *newHash,
+        const char *backingFile, const char *mountPoint) {
+    android::Mutex::Autolock lock(sLock);
+    ssize_t idx = sRecords.indexOfKey(android::String8(hash));
+    if (idx < 0) {
+        return;
+    }
+    Record *record = sRecords.valueAt(idx);
+    sRecords.removeItemsAt(idx);
+
+    // Anything still filed under the new name is stale
+    idx = sRecords.indexOfKey(android::String8(newHash));
+    if (idx >= 0) {
+        free(sRecords.valueAt(idx));
+        sRecords.removeItemsAt(idx);
+    }
+
+    if (record->loopDevice[0]) {
+        strlcpy(record->backingFile, backingFile, sizeof(record->backingFile));
+        sLoopOwners.replaceValueFor(android::String8(record->loopDevice),
+                android::String8(newHash));
+    }
+    if (record->mountPoint[0]) {
+        strlcpy(record->mountPoint, mountPoint, sizeof(record->mountPoint));
+    }
+    sRecords.add(android::String8(newHash), record);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CONTAINERREGISTRY_H
+#define _CONTAINERREGISTRY_H
+
+#include <unistd.h>
+#include <limits.h>
+
+/*
+ * What vold knows about the block devices behind each container, keyed by
+ * the container's id hash (the loop crypt name / dm name). Loop and
+ * Devmapper keep it up to date, so once it has been rebuilt from the kernel
+ * at startup, lookups no longer need to walk every loop node.
+ */
+class ContainerRegistry {
+public:
+    struct Record {
+        char loopDevice[256];
+        char dmDevice[256];
+        char backingFile[PATH_MAX];
+        char mountPoint[PATH_MAX];
+        /* Size of the backing file */
+        unsigned long long numSectors;
+    };
+
+    /* Called with the registry locked; must not call back into it */
+    typedef void (*RecordCallback)(const char *hash, const Record &record, void *data);
+
+public:
+    static int rebuild();
+    static bool isReady();
+
+    static int lookup(const char *hash, Record *record);
+    static int lookupLoop(const char *hash, char *buffer, size_t len);
+    static int lookupDm(const char *hash, char *buffer, size_t len);
+    static void forEach(RecordCallback callback, void *data);
+
+    static void setLoop(const char *hash, const char *loopDevice,
+                        const char *backingFile, unsigned long long numSectors);
+    static void clearLoop(const char *loopDevice);
+    static void setDm(const char *hash, const char *dmDevice);
+    static void clearDm(const char *hash);
+    static void setMountPoint(const char *hash, const char *mountPoint);
+    static void clearMountPoint(const char *hash);
+    /* Files the record under newHash after its container was renamed in place */
+    static void rename(const char *hash, const char *newHash,
+                       const char *backingFile, const char *mountPoint);
+};
+
+#endif
@@ -32,267 +32,693 @@
 
 #include <cutils/log.h>
 
+#include <openssl/sha.h>
+
 #include <sysutils/SocketClient.h>
 
 #include "Devmapper.h"
+#include "Asec.h"
+#include "ContainerRegistry.h"
+#include "dm_client.h"
+#include "BlockNode.h"
 
-#define DEVMAPPER_BUFFER_SIZE 4096
-
-int Devmapper::dumpState(SocketClient *c) {
+// MStar Android Patch Begin
+/*
+ * DM_DEV_STATUS only fills in the ioctl header, so dumps query it from a
+ * header-sized stack buffer instead of resetting the shared ioctl buffer
+ * once per device.
+ */
+static int deviceStatus(const char *name, struct dm_ioctl *io) {
+    memset(io, 0, sizeof(*io));
+    io->version[0] = 4;
+    io->data_size = sizeof(*io);
+    io->data_start = sizeof(*io);
+    strlcpy(io->name, name, sizeof(io->name));
 
-    char *buffer = (char *) malloc(1024 * 64);
-    if (!buffer) {
-        SLOGE("Error allocating memory (%s)", strerror(errno));
+    int fd = dm_client_fd();
+    if (fd < 0) {
         return -1;
     }
-    memset(buffer, 0, (1024 * 64));
+    return ioctl(fd, DM_DEV_STATUS, io);
+}
 
-    char *buffer2 = (char *) malloc(DEVMAPPER_BUFFER_SIZE);
-    if (!buffer2) {
-        SLOGE("Error allocating memory (%s)", strerror(errno));
-        free(buffer);
-        return -1;
+static void dumpDevice(const char *name, unsigned long long dev, void *data) {
+    SocketClient *c = (SocketClient *) data;
+    struct dm_ioctl io;
+    char tmp[256];
+
+    if (deviceStatus(name, &io)) {
+        if (errno != ENXIO) {
+            SLOGE("DM_DEV_STATUS ioctl failed (%s)", strerror(errno));
+        }
+        snprintf(tmp, sizeof(tmp), "%s %llu:%llu (no status available)",
+                name, MAJOR(dev), MINOR(dev));
+    } else {
+        snprintf(tmp, sizeof(tmp), "%s %llu:%llu %d %d 0x%.8x %llu:%llu", name, MAJOR(dev),
+                MINOR(dev), io.target_count, io.open_count, io.flags, MAJOR(io.dev),
+                        MINOR(io.dev));
     }
+    c->sendMsg(0, tmp, false);
+}
 
-    int fd;
-    if ((fd = open("/dev/device-mapper", O_RDWR)) < 0) {
-        SLOGE("Error opening devmapper (%s)", strerror(errno));
-        free(buffer);
-        free(buffer2);
+/*
+ * Dumps every mapping whose name starts with prefix (all of them when
+ * prefix is NULL). Lines are sent as the listing is walked, so the reply
+ * never has to be held in memory.
+ */
+int Devmapper::dumpState(SocketClient *c, const char *prefix) {
+    return listDevices(dumpDevice, c, prefix);
+}
+
+/*
+ * Calls callback for every mapped device whose name starts with prefix.
+ * The list is copied out of the shared ioctl buffer first, so callbacks
+ * may issue devmapper ioctls.
+ */
+int Devmapper::listDevices(DeviceCallback callback, void *data, const char *prefix) {
+    struct dm_ioctl *io = dm_client_init(NULL, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
 
-    struct dm_ioctl *io = (struct dm_ioctl *) buffer;
-    ioctlInit(io, (1024 * 64), NULL, 0);
-
-    if (ioctl(fd, DM_LIST_DEVICES, io)) {
+    if (dm_client_ioctl(DM_LIST_DEVICES, &io)) {
         SLOGE("DM_LIST_DEVICES ioctl failed (%s)", strerror(errno));
-        free(buffer);
-        free(buffer2);
-        close(fd);
         return -1;
     }
 
-    struct dm_name_list *n = (struct dm_name_list *) (((char *) buffer) + io->data_start);
+    struct dm_name_list *n = (struct dm_name_list *) (((char *) io) + io->data_start);
     if (!n->dev) {
-        free(buffer);
-        free(buffer2);
-        close(fd);
         return 0;
     }
 
+    size_t listSize = io->data_size - io->data_start;
+    char *list = (char *) malloc(listSize);
+    if (!list) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    memcpy(list, n, listSize);
+
+    size_t prefixLen = prefix ? strlen(prefix) : 0;
     unsigned nxt = 0;
+    n = (struct dm_name_list *) list;
     do {
         n = (struct dm_name_list *) (((char *) n) + nxt);
-
-        memset(buffer2, 0, DEVMAPPER_BUFFER_SIZE);
-        struct dm_ioctl *io2 = (struct dm_ioctl *) buffer2;
-        ioctlInit(io2, DEVMAPPER_BUFFER_SIZE, n->name, 0);
-        if (ioctl(fd, DM_DEV_STATUS, io2)) {
-            if (errno != ENXIO) {
-                SLOGE("DM_DEV_STATUS ioctl failed (%s)", strerror(errno));
-            }
-            io2 = NULL;
-        }
-
-        char *tmp;
-        if (!io2) {
-            asprintf(&tmp, "%s %llu:%llu (no status available)", n->name, MAJOR(n->dev), MINOR(n->dev));
-        } else {
-            asprintf(&tmp, "%s %llu:%llu %d %d 0x%.8x %llu:%llu", n->name, MAJOR(n->dev),
-                    MINOR(n->dev), io2->target_count, io2->open_count, io2->flags, MAJOR(io2->dev),
-                            MINOR(io2->dev));
+        if (!prefixLen || !strncmp(n->name, prefix, prefixLen)) {
+            callback(n->name, n->dev, data);
         }
-        c->sendMsg(0, tmp, false);
-        free(tmp);
         nxt = n->next;
     } while (nxt);
 
-    free(buffer);
-    free(buffer2);
-    close(fd);
+    free(list);
     return 0;
 }
+// MStar Android Patch End
+
+// MStar Android Patch Begin
+const char * const Devmapper::CIPHER_TWOFISH = "twofish";
+const char * const Devmapper::CIPHER_AES_XTS = "aes-xts-plain64";
+const char * const Devmapper::CIPHER_ADIANTUM = "xchacha12,aes-adiantum-plain64";
+
+/* True if the space-separated list has word in it */
+static bool hasWord(const char *list, const char *word) {
+    size_t len = strlen(word);
+    const char *p = list;
+    while ((p = strstr(p, word))) {
+        if ((p == list || p[-1] == ' ' || p[-1] == '\t') &&
+                (p[len] == '\0' || p[len] == ' ' || p[len] == '\n')) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
 
-void Devmapper::ioctlInit(struct dm_ioctl *io, size_t dataSize,
-                          const char *name, unsigned flags) {
-    memset(io, 0, dataSize);
-    io->data_size = dataSize;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = flags;
-    if (name) {
-        size_t ret = strlcpy(io->name, name, sizeof(io->name));
-	if (ret >= sizeof(io->name))
-		abort();
+/*
+ * The CPU's own AES instructions, as listed in the "Features" line on ARM
+ * or the "flags" line on x86. NEON-only drivers such as aes-neon and
+ * xts-aes-neonbs are faster than plain C but still well behind Adiantum.
+ */
+static bool cpuHasAes() {
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (!fp) {
+        SLOGW("Unable to open /proc/cpuinfo (%s)", strerror(errno));
+        return false;
+    }
+
+    char line[1024];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "Features", 8) && strncmp(line, "flags", 5)) {
+            continue;
+        }
+        char *value = strchr(line, ':');
+        found = value && hasWord(value + 1, "aes");
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Looks for an AES driver built on the ARMv8 Crypto Extensions, e.g. xts-aes-ce */
+static bool hasCeAesDriver() {
+    FILE *fp = fopen("/proc/crypto", "r");
+    if (!fp) {
+        SLOGW("Unable to open /proc/crypto (%s)", strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    char name[128] = "";
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        value++;
+        value += strspn(value, " \t");
+        value[strcspn(value, "\n")] = '\0';
+
+        if (!strncmp(line, "name", 4)) {
+            strlcpy(name, value, sizeof(name));
+        } else if (!strncmp(line, "driver", 6)) {
+            size_t len = strlen(value);
+            found = (!strcmp(name, "aes") || !strcmp(name, "xts(aes)")) &&
+                    len > 3 && !strcmp(value + len - 3, "-ce");
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static bool probeAesAcceleration() {
+    if (cpuHasAes()) {
+        SLOGI("CPU has AES instructions; using AES-XTS for container encryption");
+        return true;
+    }
+    if (hasCeAesDriver()) {
+        SLOGI("Found a Crypto Extensions AES driver; using AES-XTS for container encryption");
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Picks the cipher for a new container: AES-XTS where the CPU accelerates
+ * AES, Adiantum elsewhere. allowAdiantum is cleared by callers that found
+ * the kernel has no Adiantum support.
+ */
+void Devmapper::selectCipher(struct asec_superblock *sb, bool allowAdiantum) {
+    static int aesAccelerated = -1;
+
+    if (aesAccelerated < 0) {
+        aesAccelerated = probeAesAcceleration();
+    }
+
+    sb->ver = ASEC_SB_VER;
+    if (aesAccelerated || !allowAdiantum) {
+        sb->c_cipher = ASEC_SB_C_CIPHER_AES;
+        sb->c_chain = ASEC_SB_C_CHAIN_XTS;
+    } else {
+        sb->c_cipher = ASEC_SB_C_CIPHER_ADIANTUM;
+        sb->c_chain = ASEC_SB_C_CHAIN_NONE;
     }
+    sb->c_mode = ASEC_SB_C_MODE_PLAIN64;
 }
 
+/* dm-crypt cipher spec for an existing container, or NULL if unknown */
+const char *Devmapper::cipherSpec(const struct asec_superblock *sb) {
+    if (sb->ver == ASEC_SB_VER_1) {
+        return CIPHER_TWOFISH;
+    }
+
+    switch (sb->c_cipher) {
+    case ASEC_SB_C_CIPHER_TWOFISH:
+        if (sb->c_chain == ASEC_SB_C_CHAIN_NONE && sb->c_mode == ASEC_SB_C_MODE_NONE) {
+            return CIPHER_TWOFISH;
+        }
+        break;
+    case ASEC_SB_C_CIPHER_AES:
+        if (sb->c_chain == ASEC_SB_C_CHAIN_XTS && sb->c_mode == ASEC_SB_C_MODE_PLAIN64) {
+            return CIPHER_AES_XTS;
+        }
+        break;
+    case ASEC_SB_C_CIPHER_ADIANTUM:
+        if (sb->c_mode == ASEC_SB_C_MODE_PLAIN64) {
+            return CIPHER_ADIANTUM;
+        }
+        break;
+    }
+    SLOGE("Unsupported container cipher %d/%d/%d", sb->c_cipher, sb->c_chain, sb->c_mode);
+    return NULL;
+}
+
+/*
+ * Twofish takes the framework's key as is. XTS and Adiantum want 256 bits
+ * of key, which are derived from it with SHA-256 so that the same key
+ * always maps to the same volume key.
+ */
+static void cryptKey(const char *cipher, const char *key, char *buffer, size_t len) {
+    if (!strcmp(cipher, Devmapper::CIPHER_TWOFISH) || strlen(key) >= SHA256_DIGEST_LENGTH * 2) {
+        strlcpy(buffer, key, len);
+        return;
+    }
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) key, strlen(key), digest);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH && (size_t) (i * 2 + 2) < len; i++) {
+        snprintf(buffer + i * 2, len - i * 2, "%02x", digest[i]);
+    }
+    memset(digest, 0, sizeof(digest));
+}
+// MStar Android Patch End
+
 int Devmapper::lookupActive(const char *name, char *ubuffer, size_t len) {
-    char *buffer = (char *) malloc(DEVMAPPER_BUFFER_SIZE);
-    if (!buffer) {
-        SLOGE("Error allocating memory (%s)", strerror(errno));
-        return -1;
+    // MStar Android Patch Begin
+    if (ContainerRegistry::isReady()) {
+        return ContainerRegistry::lookupDm(name, ubuffer, len);
     }
 
-    int fd;
-    if ((fd = open("/dev/device-mapper", O_RDWR)) < 0) {
-        SLOGE("Error opening devmapper (%s)", strerror(errno));
-        free(buffer);
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
+    // MStar Android Patch End
 
-    struct dm_ioctl *io = (struct dm_ioctl *) buffer;
- 
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
-    if (ioctl(fd, DM_DEV_STATUS, io)) {
+    if (dm_client_ioctl(DM_DEV_STATUS, &io)) {
         if (errno != ENXIO) {
             SLOGE("DM_DEV_STATUS ioctl failed for lookup (%s)", strerror(errno));
         }
-        free(buffer);
-        close(fd);
         return -1;
     }
-    close(fd);
 
     unsigned minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
-    free(buffer);
     snprintf(ubuffer, len, "/dev/block/dm-%u", minor);
     return 0;
 }
 
-int Devmapper::create(const char *name, const char *loopFile, const char *key,
-                      unsigned int numSectors, char *ubuffer, size_t len) {
-    char *buffer = (char *) malloc(DEVMAPPER_BUFFER_SIZE);
-    if (!buffer) {
+// MStar Android Patch Begin
+/*
+ * allow_discards came with dm-crypt 1.11. Returns 1 if the loaded target
+ * takes it, 0 if not and -1 if the target isn't known to the kernel yet.
+ */
+static int probeCryptDiscards() {
+    unsigned int version[3];
+    if (Devmapper::targetVersion("crypt", version)) {
+        // A module that isn't loaded yet comes in with the first crypt table
+        return errno == ENOENT ? -1 : 0;
+    }
+    if (version[0] > 1 || (version[0] == 1 && version[1] >= 11)) {
+        return 1;
+    }
+    SLOGW("dm-crypt %u.%u.%u doesn't take allow_discards; containers won't be trimmed",
+          version[0], version[1], version[2]);
+    return 0;
+}
+
+/* 1 if dm-crypt takes allow_discards, 0 if not, -1 until known */
+static int sCryptDiscards = -1;
+
+/*
+ * Loads (but doesn't activate) a dm-crypt table over numSectors of loopFile.
+ * Discards are let through so that a trim inside the container reaches the
+ * loop device, which turns them into holes in the image.
+ */
+int Devmapper::loadCryptTable(const char *name, const char *loopFile, const char *key,
+                              unsigned int numSectors, const char *cipher) {
+    // Decided once from the target version, never from a failed load
+    if (sCryptDiscards < 0) {
+        sCryptDiscards = probeCryptDiscards();
+    }
+    return loadCryptTable(name, loopFile, key, numSectors, cipher, sCryptDiscards > 0);
+}
+
+int Devmapper::loadCryptTable(const char *name, const char *loopFile, const char *key,
+                              unsigned int numSectors, const char *cipher, bool allowDiscards) {
+    struct dm_ioctl *io = dm_client_init(name, DM_STATUS_TABLE_FLAG);
+    if (!io) {
         SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
+    char *buffer = (char *) io;
+
+    struct dm_target_spec *tgt;
+    tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
 
-    int fd;
-    if ((fd = open("/dev/device-mapper", O_RDWR)) < 0) {
-        SLOGE("Error opening devmapper (%s)", strerror(errno));
-        free(buffer);
+    io->target_count = 1;
+    tgt->status = 0;
+
+    tgt->sector_start = 0;
+    tgt->length = numSectors;
+
+    strlcpy(tgt->target_type, "crypt", sizeof(tgt->target_type));
+
+    char cryptKeyHex[SHA256_DIGEST_LENGTH * 2 + 1];
+    const char *tableKey = key;
+    if (strcmp(cipher, CIPHER_TWOFISH)) {
+        cryptKey(cipher, key, cryptKeyHex, sizeof(cryptKeyHex));
+        tableKey = cryptKeyHex;
+    }
+
+    char *cryptParams = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+    snprintf(cryptParams,
+            io->data_size - (sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec)),
+            "%s %s 0 %s 0%s", cipher, tableKey, loopFile, allowDiscards ? " 1 allow_discards" : "");
+    memset(cryptKeyHex, 0, sizeof(cryptKeyHex));
+    cryptParams += strlen(cryptParams) + 1;
+    cryptParams = (char *) _align(cryptParams, 8);
+    tgt->next = cryptParams - buffer;
+
+    int rc = dm_client_ioctl(DM_TABLE_LOAD, &io);
+    int savedErrno = errno;
+    // Don't leave the key behind in the shared ioctl buffer
+    dm_client_init(NULL, 0);
+    if (rc) {
+        SLOGE("Error loading %s mapping table (%s)", cipher, strerror(savedErrno));
+        errno = savedErrno;
         return -1;
     }
+    return 0;
+}
 
-    struct dm_ioctl *io = (struct dm_ioctl *) buffer;
- 
-    // Create the DM device
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
+/*
+ * Swaps in a table covering numSectors. The device is suspended (flushing
+ * outstanding I/O) while the new table is loaded, then resumed on it.
+ */
+int Devmapper::resize(const char *name, const char *loopFile, const char *key,
+                      unsigned int numSectors, const char *cipher) {
+    struct dm_ioctl *io = dm_client_init(name, DM_SUSPEND_FLAG);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    if (dm_client_ioctl(DM_DEV_SUSPEND, &io)) {
+        SLOGE("Error suspending %s (%s)", name, strerror(errno));
+        return -1;
+    }
+
+    int rc = loadCryptTable(name, loopFile, key, numSectors, cipher);
+    int savedErrno = errno;
 
-    if (ioctl(fd, DM_DEV_CREATE, io)) {
+    // Resumes on the new table if it loaded, else on the old one
+    io = dm_client_init(name, 0);
+    if (!io || dm_client_ioctl(DM_DEV_SUSPEND, &io)) {
+        SLOGE("Error resuming %s (%s)", name, strerror(errno));
+        return -1;
+    }
+
+    errno = savedErrno;
+    return rc;
+}
+// MStar Android Patch End
+
+int Devmapper::create(const char *name, const char *loopFile, const char *key,
+                      unsigned int numSectors, char *ubuffer, size_t len,
+                      const char *cipher) {
+    // MStar Android Patch Begin
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    // MStar Android Patch End
+
+    // Create the DM device
+    if (dm_client_ioctl(DM_DEV_CREATE, &io)) {
         SLOGE("Error creating device mapping (%s)", strerror(errno));
-        free(buffer);
-        close(fd);
         return -1;
     }
 
     // Set the legacy geometry
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
+    io = dm_client_init(name, 0);
 
+    char *buffer = (char *) io;
     char *geoParams = buffer + sizeof(struct dm_ioctl);
     // bps=512 spc=8 res=32 nft=2 sec=8190 mid=0xf0 spt=63 hds=64 hid=0 bspf=8 rdcl=2 infs=1 bkbs=2
     strcpy(geoParams, "0 64 63 0");
     geoParams += strlen(geoParams) + 1;
     geoParams = (char *) _align(geoParams, 8);
-    if (ioctl(fd, DM_DEV_SET_GEOMETRY, io)) {
+    if (dm_client_ioctl(DM_DEV_SET_GEOMETRY, &io)) {
         SLOGE("Error setting device geometry (%s)", strerror(errno));
-        free(buffer);
-        close(fd);
         return -1;
     }
 
     // Retrieve the device number we were allocated
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
-    if (ioctl(fd, DM_DEV_STATUS, io)) {
+    io = dm_client_init(name, 0);
+    if (dm_client_ioctl(DM_DEV_STATUS, &io)) {
         SLOGE("Error retrieving devmapper status (%s)", strerror(errno));
-        free(buffer);
-        close(fd);
         return -1;
     }
 
     unsigned minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
     snprintf(ubuffer, len, "/dev/block/dm-%u", minor);
 
+    // MStar Android Patch Begin
     // Load the table
-    struct dm_target_spec *tgt;
-    tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
+    if (loadCryptTable(name, loopFile, key, numSectors, cipher)) {
+        int savedErrno = errno;
+        // Don't leave a half-made device behind for the caller's retry
+        io = dm_client_init(name, 0);
+        if (io) {
+            dm_client_ioctl(DM_DEV_REMOVE, &io);
+        }
+        errno = savedErrno;
+        return -1;
+    }
+    // MStar Android Patch End
+
+    // Resume the new table
+    io = dm_client_init(name, 0);
+
+    if (dm_client_ioctl(DM_DEV_SUSPEND, &io)) {
+        SLOGE("Error Resuming (%s)", strerror(errno));
+        return -1;
+    }
+
+    // MStar Android Patch Begin
+    ContainerRegistry::setDm(name, ubuffer);
+
+    // Callers go straight on to format or mount the new node
+    BlockNode::waitFor(ubuffer, NODE_TIMEOUT_MS);
+    // MStar Android Patch End
+    return 0;
+}
 
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, DM_STATUS_TABLE_FLAG);
+int Devmapper::destroy(const char *name) {
+    // MStar Android Patch Begin
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    // MStar Android Patch End
+
+    if (dm_client_ioctl(DM_DEV_REMOVE, &io)) {
+        // MStar Android Patch Begin
+        if (errno == ENXIO) {
+            // Already gone; make sure we forget about it too
+            ContainerRegistry::clearDm(name);
+            errno = ENXIO;
+        } else {
+            SLOGE("Error destroying device mapping (%s)", strerror(errno));
+        }
+        // MStar Android Patch End
+        return -1;
+    }
+
+    // MStar Android Patch Begin
+    ContainerRegistry::clearDm(name);
+    // MStar Android Patch End
+    return 0;
+}
+
+// MStar Android Patch Begin
+int Devmapper::createTarget(const char *name, const char *target, const char *params,
+                            unsigned long long numSectors, char *ubuffer, size_t len) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    if (dm_client_ioctl(DM_DEV_CREATE, &io)) {
+        SLOGE("Error creating %s mapping %s (%s)", target, name, strerror(errno));
+        return -1;
+    }
+    unsigned minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
+    snprintf(ubuffer, len, "/dev/block/dm-%u", minor);
+
+    io = dm_client_init(name, DM_STATUS_TABLE_FLAG);
+    char *buffer = (char *) io;
+    struct dm_target_spec *tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
     io->target_count = 1;
     tgt->status = 0;
-
     tgt->sector_start = 0;
     tgt->length = numSectors;
+    strlcpy(tgt->target_type, target, sizeof(tgt->target_type));
+
+    char *tgtParams = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+    strlcpy(tgtParams, params,
+            io->data_size - (sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec)));
+    tgtParams += strlen(tgtParams) + 1;
+    tgtParams = (char *) _align(tgtParams, 8);
+    tgt->next = tgtParams - buffer;
+
+    if (dm_client_ioctl(DM_TABLE_LOAD, &io)) {
+        int savedErrno = errno;
+        SLOGE("Error loading %s mapping table (%s)", target, strerror(errno));
+        io = dm_client_init(name, 0);
+        if (io) {
+            dm_client_ioctl(DM_DEV_REMOVE, &io);
+        }
+        errno = savedErrno;
+        return -1;
+    }
 
-    strlcpy(tgt->target_type, "crypt", sizeof(tgt->target_type));
+    if (setSuspended(name, false)) {
+        return -1;
+    }
 
-    char *cryptParams = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
-    snprintf(cryptParams,
-            DEVMAPPER_BUFFER_SIZE - (sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec)),
-            "twofish %s 0 %s 0", key, loopFile);
-    cryptParams += strlen(cryptParams) + 1;
-    cryptParams = (char *) _align(cryptParams, 8);
-    tgt->next = cryptParams - buffer;
+    ContainerRegistry::setDm(name, ubuffer);
+    BlockNode::waitFor(ubuffer, NODE_TIMEOUT_MS);
+    return 0;
+}
 
-    if (ioctl(fd, DM_TABLE_LOAD, io)) {
-        SLOGE("Error loading mapping table (%s)", strerror(errno));
-        free(buffer);
-        close(fd);
+/* Sends msg to sector 0 of the device's target */
+int Devmapper::message(const char *name, const char *msg) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
 
-    // Resume the new table
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
-
-    if (ioctl(fd, DM_DEV_SUSPEND, io)) {
-        SLOGE("Error Resuming (%s)", strerror(errno));
-        free(buffer);
-        close(fd);
+    struct dm_target_msg *tmsg = (struct dm_target_msg *) ((char *) io + io->data_start);
+    size_t room = io->data_size - io->data_start - sizeof(struct dm_target_msg);
+    tmsg->sector = 0;
+    if (strlcpy(tmsg->message, msg, room) >= room) {
+        errno = E2BIG;
         return -1;
     }
 
-    free(buffer);
+    if (dm_client_ioctl(DM_TARGET_MSG, &io)) {
+        int savedErrno = errno;
+        SLOGE("Message \"%s\" to %s failed (%s)", msg, name, strerror(errno));
+        errno = savedErrno;
+        return -1;
+    }
+    return 0;
+}
 
-    close(fd);
+/* Suspending flushes outstanding I/O; resuming activates any loaded table */
+int Devmapper::setSuspended(const char *name, bool suspended) {
+    struct dm_ioctl *io = dm_client_init(name, suspended ? DM_SUSPEND_FLAG : 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    if (dm_client_ioctl(DM_DEV_SUSPEND, &io)) {
+        SLOGE("Error %s %s (%s)", suspended ? "suspending" : "resuming", name, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-int Devmapper::destroy(const char *name) {
-    char *buffer = (char *) malloc(DEVMAPPER_BUFFER_SIZE);
-    if (!buffer) {
+/* Fails with ENOENT if the kernel doesn't (yet) have the target */
+int Devmapper::targetVersion(const char *target, unsigned int version[3]) {
+    struct dm_ioctl *io = dm_client_init(NULL, 0);
+    if (!io || dm_client_ioctl(DM_LIST_VERSIONS, &io)) {
+        SLOGW("Unable to list devmapper targets (%s)", strerror(errno));
+        return -1;
+    }
+
+    if (io->data_size > io->data_start) {
+        struct dm_target_versions *tv =
+                (struct dm_target_versions *) ((char *) io + io->data_start);
+        while (true) {
+            if (!strcmp(tv->name, target)) {
+                memcpy(version, tv->version, sizeof(tv->version));
+                return 0;
+            }
+            if (!tv->next) {
+                break;
+            }
+            tv = (struct dm_target_versions *) ((char *) tv + tv->next);
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/* The status line of the device's (first) target, e.g. a thin pool's usage */
+int Devmapper::tableStatus(const char *name, char *buffer, size_t len) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
         SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
+    if (dm_client_ioctl(DM_TABLE_STATUS, &io)) {
+        SLOGE("Error getting status of %s (%s)", name, strerror(errno));
+        return -1;
+    }
+    if (!io->target_count) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    struct dm_target_spec *tgt = (struct dm_target_spec *) ((char *) io + io->data_start);
+    strlcpy(buffer, (char *) (tgt + 1), len);
+    return 0;
+}
 
-    int fd;
-    if ((fd = open("/dev/device-mapper", O_RDWR)) < 0) {
-        SLOGE("Error opening devmapper (%s)", strerror(errno));
-        free(buffer);
+/* How many events the device has raised, to start waitEvent() from */
+int Devmapper::eventCount(const char *name, unsigned int *eventNr) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    if (dm_client_ioctl(DM_DEV_STATUS, &io)) {
         return -1;
     }
+    *eventNr = io->event_nr;
+    return 0;
+}
 
-    struct dm_ioctl *io = (struct dm_ioctl *) buffer;
- 
-    // Create the DM device
-    ioctlInit(io, DEVMAPPER_BUFFER_SIZE, name, 0);
+/*
+ * Blocks until the device raises an event past *eventNr, such as a thin
+ * pool crossing its low water mark, and updates it to the new count.
+ */
+int Devmapper::waitEvent(const char *name, unsigned int *eventNr) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+    io->event_nr = *eventNr;
+    if (dm_client_ioctl(DM_DEV_WAIT, &io)) {
+        return -1;
+    }
+    // Read again so that no event slips in between two waits
+    return eventCount(name, eventNr);
+}
 
-    if (ioctl(fd, DM_DEV_REMOVE, io)) {
-        if (errno != ENXIO) {
-            SLOGE("Error destroying device mapping (%s)", strerror(errno));
-        }
-        free(buffer);
-        close(fd);
+/* Renames a live mapping; its dm-N node and open users are unaffected */
+int Devmapper::rename(const char *name, const char *newName) {
+    struct dm_ioctl *io = dm_client_init(name, 0);
+    if (!io) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
         return -1;
     }
+    strlcpy((char *) io + io->data_start, newName, DM_NAME_LEN);
 
-    free(buffer);
-    close(fd);
+    if (dm_client_ioctl(DM_DEV_RENAME, &io)) {
+        SLOGE("Error renaming %s to %s (%s)", name, newName, strerror(errno));
+        return -1;
+    }
     return 0;
 }
+// MStar Android Patch End
 
 void *Devmapper::_align(void *ptr, unsigned int a)
 {
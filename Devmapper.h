@@ -21,19 +21,57 @@
 #include <linux/dm-ioctl.h>
 
 class SocketClient;
+struct asec_superblock;
 
 class Devmapper {
 public:
+    // MStar Android Patch Begin
+    typedef void (*DeviceCallback)(const char *name, unsigned long long dev, void *data);
+
+    /* How long create() waits for ueventd to make the new device node */
+    static const int NODE_TIMEOUT_MS = 1000;
+
+    /* dm-crypt cipher specs */
+    static const char * const CIPHER_TWOFISH;
+    static const char * const CIPHER_AES_XTS;
+    static const char * const CIPHER_ADIANTUM;
+    // MStar Android Patch End
+
+public:
+    // MStar Android Patch Begin
     static int create(const char *name, const char *loopFile, const char *key,
-                      unsigned int numSectors, char *buffer, size_t len);
+                      unsigned int numSectors, char *buffer, size_t len,
+                      const char *cipher = CIPHER_TWOFISH);
+    static int resize(const char *name, const char *loopFile, const char *key,
+                      unsigned int numSectors, const char *cipher = CIPHER_TWOFISH);
+    static int rename(const char *name, const char *newName);
+    /* A device with a single target other than crypt, e.g. thin-pool */
+    static int createTarget(const char *name, const char *target, const char *params,
+                            unsigned long long numSectors, char *buffer, size_t len);
+    static int message(const char *name, const char *msg);
+    static int setSuspended(const char *name, bool suspended);
+    static int targetVersion(const char *target, unsigned int version[3]);
+    static int tableStatus(const char *name, char *buffer, size_t len);
+    static int eventCount(const char *name, unsigned int *eventNr);
+    static int waitEvent(const char *name, unsigned int *eventNr);
+    static void selectCipher(struct asec_superblock *sb, bool allowAdiantum = true);
+    static const char *cipherSpec(const struct asec_superblock *sb);
+    // MStar Android Patch End
     static int destroy(const char *name);
     static int lookupActive(const char *name, char *buffer, size_t len);
-    static int dumpState(SocketClient *c);
+    // MStar Android Patch Begin
+    static int dumpState(SocketClient *c, const char *prefix = NULL);
+    static int listDevices(DeviceCallback callback, void *data, const char *prefix = NULL);
+    // MStar Android Patch End
 
 private:
     static void *_align(void *ptr, unsigned int a);
-    static void ioctlInit(struct dm_ioctl *io, size_t data_size,
-                          const char *name, unsigned flags);
+    // MStar Android Patch Begin
+    static int loadCryptTable(const char *name, const char *loopFile, const char *key,
+                              unsigned int numSectors, const char *cipher);
+    static int loadCryptTable(const char *name, const char *loopFile, const char *key,
+                              unsigned int numSectors, const char *cipher, bool allowDiscards);
+    // MStar Android Patch End
 };
 
 #endif
@@ -367,8 +367,12 @@ void DirectVolume::handlePartitionRemoved(const char *devpath, NetlinkEvent *evt
      */
     state = getState();
     // MStar Android Patch Begin
+    /*
+     * A mount in progress fails quickly once the media is gone; poll
+     * finely so we pick up the final state without stalling uevents.
+     */
     while (state == State_Checking) {
-        usleep(500*1000);
+        usleep(20*1000);
         state = getState();
     }
 
@@ -384,10 +388,11 @@ void DirectVolume::handlePartitionRemoved(const char *devpath, NetlinkEvent *evt
         
     if ((dev_t) MKDEV(major, minor) == mCurrentlyMountedKdev) {
         /*
-         * Yikes, our mounted partition is going away!
+         * Yikes, our mounted partition is going away! Detach it lazily so
+         * the uevent thread never blocks on holders or container teardown.
          */
-        if (Volume::unmountVol(true, false)) {
-            SLOGE("Failed to unmount volume on bad removal (%s)",
+        if (Volume::detachVol()) {
+            SLOGE("Failed to detach volume on bad removal (%s)",
                  strerror(errno));
             // XXX: At this point we're screwed for now
         } else {
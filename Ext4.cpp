@@ -30,6 +30,8 @@
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
 
 #include <linux/kdev_t.h>
 
@@ -44,6 +46,14 @@
 #include "VoldUtil.h"
 
 #define MKEXT4FS_PATH "/system/bin/make_ext4fs";
+// MStar Android Patch Begin
+#define RESIZE2FS_PATH "/system/bin/resize2fs"
+#define E2FSCK_PATH "/system/bin/e2fsck"
+
+#ifndef EXT4_IOC_RESIZE_FS
+#define EXT4_IOC_RESIZE_FS _IOW('f', 16, __u64)
+#endif
+// MStar Android Patch End
 
 int Ext4::doMount(const char *fsPath, const char *mountPoint, bool ro, bool remount,
         bool executable) {
@@ -104,3 +114,105 @@ int Ext4::format(const char *fsPath, const char *mountpoint) {
     }
     return 0;
 }
+
+// MStar Android Patch Begin
+/*
+ * Forces a full check of an unmounted filesystem, fixing what can be fixed
+ * without asking. resize2fs refuses a filesystem that wasn't checked since
+ * it was last mounted, and growing a damaged one would only spread it.
+ */
+static int checkForResize(const char *fsPath) {
+    const char *args[4];
+    int status;
+
+    args[0] = E2FSCK_PATH;
+    args[1] = "-f";
+    args[2] = "-p";
+    args[3] = fsPath;
+    if (android_fork_execvp(ARRAY_SIZE(args), (char **)args, &status, false, true)) {
+        SLOGE("Filesystem (ext4) check failed due to logwrap error");
+        errno = EIO;
+        return -1;
+    }
+    if (!WIFEXITED(status)) {
+        SLOGE("Filesystem (ext4) check did not exit properly");
+        errno = EIO;
+        return -1;
+    }
+
+    // 1 and 2 mean errors were corrected; the filesystem isn't mounted
+    status = WEXITSTATUS(status);
+    if (status & ~3) {
+        SLOGE("Filesystem (ext4) check failed (exit code %d)", status);
+        errno = EIO;
+        return -1;
+    }
+    SLOGI("Filesystem (ext4) check completed OK");
+    return 0;
+}
+
+/*
+ * Grows the filesystem on fsPath to numSectors. A mounted filesystem
+ * (mountPoint != NULL) is grown online by the kernel; otherwise it is
+ * checked with e2fsck and then resize2fs does it.
+ */
+int Ext4::resize(const char *fsPath, const char *mountPoint, unsigned int numSectors) {
+    if (mountPoint) {
+        struct statfs sfs;
+        int fd = open(mountPoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstatfs(fd, &sfs)) {
+            SLOGE("Unable to open %s for resize (%s)", mountPoint, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+
+        __u64 numBlocks = (__u64) numSectors * 512 / sfs.f_bsize;
+        int rc = ioctl(fd, EXT4_IOC_RESIZE_FS, &numBlocks);
+        close(fd);
+        if (rc) {
+            SLOGE("Online resize (ext4) of %s failed (%s)", mountPoint, strerror(errno));
+            return -1;
+        }
+        SLOGI("Filesystem (ext4) on %s resized online to %llu blocks", mountPoint, numBlocks);
+        return 0;
+    }
+
+    if (checkForResize(fsPath)) {
+        return -1;
+    }
+
+    const char *args[3];
+    char sizeStr[32];
+    int rc;
+    int status;
+
+    snprintf(sizeStr, sizeof(sizeStr), "%us", numSectors);
+    args[0] = RESIZE2FS_PATH;
+    args[1] = fsPath;
+    args[2] = sizeStr;
+    rc = android_fork_execvp(ARRAY_SIZE(args), (char **)args, &status, false,
+            true);
+    if (rc != 0) {
+        SLOGE("Filesystem (ext4) resize failed due to logwrap error");
+        errno = EIO;
+        return -1;
+    }
+
+    if (!WIFEXITED(status)) {
+        SLOGE("Filesystem (ext4) resize did not exit properly");
+        errno = EIO;
+        return -1;
+    }
+
+    status = WEXITSTATUS(status);
+    if (status) {
+        SLOGE("Resize (ext4) failed (unknown exit code %d)", status);
+        errno = EIO;
+        return -1;
+    }
+    SLOGI("Filesystem (ext4) resized OK");
+    return 0;
+}
+// MStar Android Patch End
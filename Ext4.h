@@ -24,6 +24,9 @@ public:
     static int doMount(const char *fsPath, const char *mountPoint, bool ro, bool remount,
             bool executable);
     static int format(const char *fsPath, const char *mountpoint);
+    // MStar Android Patch Begin
+    static int resize(const char *fsPath, const char *mountPoint, unsigned int numSectors);
+    // MStar Android Patch End
 };
 
 #endif
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
+
+#include <utils/String8.h>
+#include <utils/Vector.h>
+#include <utils/threads.h>
+
+#include "IsoCache.h"
+#include "ContainerLocks.h"
+#include "Loop.h"
+#include "Process.h"
+#include "Volume.h"
+
+const char *IsoCache::PARK_DIR = ".parked";
+
+namespace {
+
+struct Entry {
+    unsigned int seq;
+    char img[PATH_MAX];
+    char idHash[33];
+    char loopDevice[255];
+    /* Where the mount is parked, empty if only the loop device was kept */
+    char parked[255];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off64_t size;
+    time_t expires;
+};
+
+}
+
+static android::Mutex sLock;
+/* Signalled when an entry is added, to reschedule the reaper */
+static android::Condition sCond;
+/* Oldest first */
+static android::Vector<Entry> sEntries;
+static unsigned int sSeq = 0;
+static int sMaxEntries = 0;
+static int sGraceSec = IsoCache::DEFAULT_GRACE_SEC;
+
+static time_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool sameFile(const Entry &entry, const struct stat *st) {
+    return entry.dev == st->st_dev && entry.ino == st->st_ino &&
+            entry.mtime == st->st_mtime && entry.size == st->st_size;
+}
+
+static ssize_t findLocked(const char *img) {
+    for (size_t i = 0; i < sEntries.size(); i++) {
+        if (!strcmp(sEntries[i].img, img)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static ssize_t findSeqLocked(unsigned int seq) {
+    for (size_t i = 0; i < sEntries.size(); i++) {
+        if (sEntries[i].seq == seq) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void teardown(const Entry &entry) {
+    if (entry.parked[0]) {
+        /*
+         * Only root can get past the parking directory, and the image had
+         * no users when it was parked, so detaching it is safe
+         */
+        if (umount(entry.parked) && umount2(entry.parked, MNT_DETACH) && errno != EINVAL) {
+            SLOGW("Failed to unmount parked %s (%s)", entry.parked, strerror(errno));
+        }
+        rmdir(entry.parked);
+    }
+    if (entry.loopDevice[0] && Loop::destroyByDevice(entry.loopDevice)) {
+        SLOGW("Failed to release %s for %s (%s)", entry.loopDevice, entry.img, strerror(errno));
+    }
+}
+
+/*
+ * Removes the entry and tears it down under its image's container lock, so
+ * that a concurrent mount of the image can't pick up its loop device half
+ * way through. With force it goes ahead even if the lock can't be had.
+ */
+static bool drop(unsigned int seq, int timeoutMs, bool force) {
+    android::String8 img;
+    {
+        android::Mutex::Autolock lock(sLock);
+        ssize_t idx = findSeqLocked(seq);
+        if (idx < 0) {
+            return true;
+        }
+        img = sEntries[idx].img;
+    }
+
+    bool locked = ContainerLocks::acquire(img.string(), timeoutMs);
+    if (!locked && !force) {
+        return false;
+    }
+
+    Entry entry;
+    bool found = false;
+    {
+        android::Mutex::Autolock lock(sLock);
+        ssize_t idx = findSeqLocked(seq);
+        if (idx >= 0) {
+            entry = sEntries[idx];
+            sEntries.removeAt(idx);
+            found = true;
+        }
+    }
+    if (found) {
+        teardown(entry);
+    }
+
+    if (locked) {
+        ContainerLocks::release(img.string());
+    }
+    return true;
+}
+
+static void parkDir(char *buffer, size_t len) {
+    snprintf(buffer, len, "%s/%s", Volume::IOSDIR, IsoCache::PARK_DIR);
+}
+
+/*
+ * The mode of a parked mount point is hidden by the image's own root, so
+ * it is the parent that keeps everyone but root out.
+ */
+static int makeParkDir() {
+    char dir[255];
+    parkDir(dir, sizeof(dir));
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        return -1;
+    }
+    return chown(dir, AID_ROOT, AID_ROOT) || chmod(dir, 0700) ? -1 : 0;
+}
+
+static void sweepParked() {
+    char dir[255];
+    parkDir(dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        char path[255];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        SLOGI("Dropping %s parked by a previous instance", path);
+        umount2(path, MNT_DETACH);
+        rmdir(path);
+    }
+    closedir(d);
+}
+
+void *IsoCache::threadStart(void *arg) {
+    while (true) {
+        unsigned int seq;
+        {
+            android::Mutex::Autolock lock(sLock);
+            while (true) {
+                if (sEntries.isEmpty()) {
+                    sCond.wait(sLock);
+                    continue;
+                }
+                // Entries are added with the same grace period, oldest first
+                time_t left = sEntries[0].expires - now();
+                if (left <= 0) {
+                    break;
+                }
+                sCond.waitRelative(sLock, (nsecs_t) left * 1000000000LL);
+            }
+            seq = sEntries[0].seq;
+        }
+        drop(seq, -1, false);
+    }
+    return NULL;
+}
+
+int IsoCache::start() {
+    char value[PROPERTY_VALUE_MAX];
+
+    sweepParked();
+
+    property_get("ro.vold.iso_cache", value, "");
+    sMaxEntries = value[0] ? atoi(value) : DEFAULT_ENTRIES;
+    if (sMaxEntries < 0) {
+        sMaxEntries = 0;
+    } else if (sMaxEntries > MAX_ENTRIES) {
+        sMaxEntries = MAX_ENTRIES;
+    }
+    property_get("ro.vold.iso_cache_sec", value, "");
+    if (value[0] && atoi(value) > 0) {
+        sGraceSec = atoi(value);
+    }
+    if (!sMaxEntries) {
+        return 0;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, threadStart, NULL)) {
+        SLOGE("Unable to start ISO cache reaper (%s)", strerror(errno));
+        pthread_attr_destroy(&attr);
+        sMaxEntries = 0;
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+bool IsoCache::isEnabled() {
+    return sMaxEntries > 0;
+}
+
+int IsoCache::park(const char *img, const char *idHash, const char *mountPoint) {
+    if (!isEnabled()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+
+    struct stat st;
+    if (stat(img, &st) || strlen(img) >= sizeof(entry.img) ||
+            Loop::lookupActive(idHash, entry.loopDevice, sizeof(entry.loopDevice))) {
+        return -1;
+    }
+
+    // Open files would keep their access to a parked image
+    if (Process::findHolders(mountPoint, true, NULL, NULL)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Make room first, unless the oldest is busy being mounted again
+    unsigned int oldest = 0;
+    {
+        android::Mutex::Autolock lock(sLock);
+        if (sEntries.size() >= (size_t) sMaxEntries) {
+            oldest = sEntries[0].seq;
+        }
+    }
+    if (oldest && !drop(oldest, LOCK_WAIT_MS, false)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    strcpy(entry.img, img);
+    strlcpy(entry.idHash, idHash, sizeof(entry.idHash));
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.mtime = st.st_mtime;
+    entry.size = st.st_size;
+
+    snprintf(entry.parked, sizeof(entry.parked), "%s/%s/%s",
+             Volume::IOSDIR, PARK_DIR, idHash);
+    if (makeParkDir() || (mkdir(entry.parked, 0700) && errno != EEXIST) ||
+            mount(mountPoint, entry.parked, NULL, MS_MOVE, NULL)) {
+        // Likely a shared mount; keep just the loop device then
+        SLOGW("Unable to park %s (%s); keeping its loop device only", img, strerror(errno));
+        rmdir(entry.parked);
+        entry.parked[0] = '\0';
+        if (umount(mountPoint)) {
+            return -1;
+        }
+    }
+    rmdir(mountPoint);
+
+    android::Mutex::Autolock lock(sLock);
+    entry.seq = ++sSeq;
+    entry.expires = now() + sGraceSec;
+    sEntries.push(entry);
+    sCond.signal();
+    return 0;
+}
+
+int IsoCache::restore(const char *img, char *idHash, size_t len) {
+    Entry entry;
+    {
+        android::Mutex::Autolock lock(sLock);
+        ssize_t idx = findLocked(img);
+        if (idx < 0) {
+            return -1;
+        }
+        entry = sEntries[idx];
+        sEntries.removeAt(idx);
+    }
+
+    struct stat st;
+    char loopDevice[255];
+    if (stat(img, &st) || !sameFile(entry, &st)) {
+        SLOGI("%s changed since it was cached", img);
+        teardown(entry);
+        return -1;
+    }
+    if (Loop::lookupActive(entry.idHash, loopDevice, sizeof(loopDevice)) ||
+            strcmp(loopDevice, entry.loopDevice)) {
+        SLOGW("Cached loop device of %s went away", img);
+        // Whatever owns that device now, it isn't this entry
+        entry.loopDevice[0] = '\0';
+        teardown(entry);
+        return -1;
+    }
+
+    strlcpy(idHash, entry.idHash, len);
+    if (!entry.parked[0]) {
+        return 0;
+    }
+
+    char mountPoint[255];
+    snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::IOSDIR, entry.idHash);
+    if ((mkdir(mountPoint, 0755) && errno != EEXIST) ||
+            mount(entry.parked, mountPoint, NULL, MS_MOVE, NULL)) {
+        SLOGW("Unable to unpark %s (%s)", img, strerror(errno));
+        teardown(entry);
+        return -1;
+    }
+    rmdir(entry.parked);
+    return 1;
+}
+
+void IsoCache::flush(const char *prefix) {
+    android::Vector<unsigned int> entries;
+    collect(prefix, &entries);
+    flush(entries);
+}
+
+void IsoCache::collect(const char *prefix, android::Vector<unsigned int> *entries) {
+    android::Mutex::Autolock lock(sLock);
+    size_t len = strlen(prefix);
+    for (size_t i = 0; i < sEntries.size(); i++) {
+        if (!strncmp(sEntries[i].img, prefix, len)) {
+            entries->push(sEntries[i].seq);
+        }
+    }
+}
+
+void IsoCache::flush(const android::Vector<unsigned int> &entries) {
+    for (size_t i = 0; i < entries.size(); i++) {
+        drop(entries[i], LOCK_WAIT_MS, true);
+    }
+}
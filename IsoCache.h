@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ISOCACHE_H
+#define _ISOCACHE_H
+
+#include <unistd.h>
+
+#include <utils/Vector.h>
+
+/*
+ * Keeps recently unmounted ISO images warm for a grace period so that
+ * mounting them again is close to free. An entry holds on to the image's
+ * loop device and, where the mount can be moved, the mount itself, parked
+ * in a root-only directory under Volume::IOSDIR.
+ *
+ * Entries are keyed by image path and checked against the file's inode
+ * and mtime before reuse. Up to ro.vold.iso_cache of them (0 disables the
+ * cache) are kept, for ro.vold.iso_cache_sec seconds each.
+ */
+class IsoCache {
+public:
+    static const int DEFAULT_ENTRIES = 4;
+    static const int MAX_ENTRIES = 16;
+    static const int DEFAULT_GRACE_SEC = 60;
+    /* How long eviction waits for an operation on the evicted image */
+    static const int LOCK_WAIT_MS = 2000;
+    /* Under Volume::IOSDIR, mode 0700 */
+    static const char *PARK_DIR;
+
+    /* Clears what a previous instance parked and starts the reaper */
+    static int start();
+    static bool isEnabled();
+
+    /*
+     * Takes over the mounted image instead of tearing it down; the caller
+     * holds its container lock. Fails, leaving the mount as it was, when
+     * the image is still in use or can't be cached.
+     */
+    static int park(const char *img, const char *idHash, const char *mountPoint);
+
+    /*
+     * Looks img up for a mount under its container lock and fills in its
+     * id hash on a hit. Returns 1 if the mount was moved back into place,
+     * 0 if only the loop device was kept and -1 on a miss.
+     */
+    static int restore(const char *img, char *idHash, size_t len);
+
+    /* Tears down the entries of images under prefix, e.g. a departing volume */
+    static void flush(const char *prefix);
+
+    /*
+     * The same in two steps, for a volume that is gone but whose mount
+     * point may be reused before the cleanup gets to run.
+     */
+    static void collect(const char *prefix, android::Vector<unsigned int> *entries);
+    static void flush(const android::Vector<unsigned int> &entries);
+
+private:
+    static void *threadStart(void *arg);
+};
+
+#endif
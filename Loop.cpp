@@ -20,21 +20,33 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 
 #include <linux/kdev_t.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
 
 #include <sysutils/SocketClient.h>
 #include "Loop.h"
 #include "Asec.h"
+#include "ContainerRegistry.h"
 
 int Loop::dumpState(SocketClient *c) {
     int i;
@@ -83,6 +95,12 @@ int Loop::lookupActive(const char *id, char *buffer, size_t len) {
     int fd;
     char filename[256];
 
+    // MStar Android Patch Begin
+    if (ContainerRegistry::isReady()) {
+        return ContainerRegistry::lookupLoop(id, buffer, len);
+    }
+    // MStar Android Patch End
+
     memset(buffer, 0, len);
 
     for (i = 0; i < LOOP_MAX; i++) {
@@ -124,38 +142,322 @@ int Loop::lookupActive(const char *id, char *buffer, size_t len) {
     return 0;
 }
 
-int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
+// MStar Android Patch Begin
+/*
+ * Batch version of lookupActive(): resolves the loop devices of count ids
+ * from the registry, or with a single pass over the loop nodes. buffers[i] is left empty when
+ * ids[i] has no active loop device. Returns the number of ids resolved.
+ */
+int Loop::lookupActiveMany(const char **ids, char **buffers, size_t len, int count) {
+    android::KeyedVector<android::String8, int> wanted;
     int i;
     int fd;
+    int found = 0;
     char filename[256];
 
-    for (i = 0; i < LOOP_MAX; i++) {
+    if (ContainerRegistry::isReady()) {
+        for (i = 0; i < count; i++) {
+            if (!ContainerRegistry::lookupLoop(ids[i], buffers[i], len)) {
+                found++;
+            }
+        }
+        return found;
+    }
+
+    for (i = 0; i < count; i++) {
+        memset(buffers[i], 0, len);
+        wanted.add(android::String8(ids[i], strnlen(ids[i], LO_NAME_SIZE)), i);
+    }
+
+    for (i = 0; i < LOOP_MAX && found < count; i++) {
         struct loop_info64 li;
         int rc;
 
         sprintf(filename, "/dev/block/loop%d", i);
 
-        /*
-         * The kernel starts us off with 8 loop nodes, but more
-         * are created on-demand if needed.
-         */
-        mode_t mode = 0660 | S_IFBLK;
-        unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
-        if (mknod(filename, mode, dev) < 0) {
-            if (errno != EEXIST) {
-                SLOGE("Error creating loop device node (%s)", strerror(errno));
-                return -1;
+        if ((fd = open(filename, O_RDWR)) < 0) {
+            if (errno != ENOENT) {
+                SLOGE("Unable to open %s (%s)", filename, strerror(errno));
             }
+            continue;
         }
 
-        if ((fd = open(filename, O_RDWR)) < 0) {
+        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+        close(fd);
+        if (rc < 0) {
+            if (errno != ENXIO) {
+                SLOGE("Unable to get loop status for %s (%s)", filename,
+                     strerror(errno));
+            }
+            continue;
+        }
+
+        ssize_t idx = wanted.indexOfKey(android::String8((const char *) li.lo_crypt_name,
+                strnlen((const char *) li.lo_crypt_name, LO_NAME_SIZE)));
+        if (idx < 0) {
+            continue;
+        }
+        int which = wanted.valueAt(idx);
+        if (!buffers[which][0]) {
+            strncpy(buffers[which], filename, len - 1);
+            found++;
+        }
+    }
+
+    return found;
+}
+// MStar Android Patch End
+
+// MStar Android Patch Begin
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+    __u32 fd;
+    __u32 block_size;
+    struct loop_info64 info;
+    __u64 __reserved[8];
+};
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+
+#ifndef LOOP_CTL_ADD
+#define LOOP_CTL_ADD 0x4C80
+#endif
+
+#define LOOP_CONTROL_DEVICE "/dev/loop-control"
+#define LOOP_GET_FREE_RETRIES 8
+
+/* Cleared once the kernel turns out not to know about LOOP_CONFIGURE */
+static bool sLoopConfigureSupported = true;
+
+/*
+ * The kernel starts us off with 8 loop nodes, but more are created
+ * on-demand if needed, and ueventd may not have caught up with them yet.
+ */
+static int makeLoopNode(int i, char *filename, size_t len) {
+    snprintf(filename, len, "/dev/block/loop%d", i);
+
+    mode_t mode = 0660 | S_IFBLK;
+    unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
+    if (mknod(filename, mode, dev) < 0) {
+        if (errno != EEXIST) {
+            SLOGE("Error creating loop device node (%s)", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static android::Mutex sLoopControlLock;
+static int sLoopControlFd = -1;
+
+/* Kept open for good once opened; -1 without /dev/loop-control */
+static int loopControlFd() {
+    android::Mutex::Autolock lock(sLoopControlLock);
+    if (sLoopControlFd < 0) {
+        sLoopControlFd = open(LOOP_CONTROL_DEVICE, O_RDWR | O_CLOEXEC);
+    }
+    return sLoopControlFd;
+}
+
+/*
+ * Asks the kernel for a free loop device instead of probing every node.
+ * Returns an open fd on the device, or -1 with errno ENOSYS when
+ * /dev/loop-control is not there.
+ */
+static int getFreeLoopDevice(char *filename, size_t len) {
+    int ctl_fd = loopControlFd();
+    if (ctl_fd < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int i = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+    int saved_errno = errno;
+    if (i < 0) {
+        SLOGE("Unable to get a free loop device (%s)", strerror(saved_errno));
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (makeLoopNode(i, filename, len)) {
+        return -1;
+    }
+
+    int fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Unable to open %s (%s)", filename, strerror(errno));
+    }
+    return fd;
+}
+
+static android::Mutex sPoolLock;
+static android::Condition sPoolCond;
+/* Unbound loop devices to keep ready; 0 when the pool is off */
+static int sPoolLowWater = 0;
+static bool sPoolTopUp = false;
+
+/*
+ * Counts the loop devices nothing is bound to (only bound ones have a
+ * "loop" directory in sysfs) and makes sure their nodes exist, so that
+ * LOOP_CTL_GET_FREE hands out a device that is ready to open.
+ */
+static int countFreeLoopDevices(int *highest) {
+    DIR *d = opendir("/sys/block");
+    if (!d) {
+        return -1;
+    }
+
+    int numFree = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        int i;
+        char path[64];
+        char filename[256];
+        if (sscanf(de->d_name, "loop%d", &i) != 1) {
+            continue;
+        }
+        if (i > *highest) {
+            *highest = i;
+        }
+        snprintf(path, sizeof(path), "/sys/block/%s/loop", de->d_name);
+        if (!access(path, F_OK) || makeLoopNode(i, filename, sizeof(filename))) {
+            continue;
+        }
+        numFree++;
+    }
+    closedir(d);
+    return numFree;
+}
+
+/*
+ * Brings the number of free loop devices back up to the low water mark,
+ * creating devices with LOOP_CTL_ADD ahead of any mount that needs one.
+ * They stay unbound, which is what makes LOOP_CTL_GET_FREE pick them.
+ */
+static void topUpPool() {
+    int ctl_fd = loopControlFd();
+    int highest = -1;
+    int numFree = countFreeLoopDevices(&highest);
+    if (ctl_fd < 0 || numFree < 0) {
+        return;
+    }
+
+    int lowWater;
+    {
+        android::Mutex::Autolock lock(sPoolLock);
+        // A burst of mounts emptied the pool; keep more ready next time
+        if (!numFree && sPoolLowWater < Loop::POOL_MAX) {
+            sPoolLowWater = sPoolLowWater * 2 < Loop::POOL_MAX ?
+                    sPoolLowWater * 2 : Loop::POOL_MAX;
+            SLOGI("Loop device pool ran dry; keeping %d ready", sPoolLowWater);
+        }
+        lowWater = sPoolLowWater;
+    }
+
+    int next = highest + 1;
+    while (numFree < lowWater && next < Loop::LOOP_MAX) {
+        int i = ioctl(ctl_fd, LOOP_CTL_ADD, next++);
+        if (i < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            SLOGW("Unable to add a loop device (%s)", strerror(errno));
+            return;
+        }
+        char filename[256];
+        if (makeLoopNode(i, filename, sizeof(filename))) {
+            return;
+        }
+        numFree++;
+    }
+}
+
+void *Loop::poolThread(void *arg) {
+    while (true) {
+        {
+            android::Mutex::Autolock lock(sPoolLock);
+            while (!sPoolTopUp) {
+                sPoolCond.wait(sPoolLock);
+            }
+            sPoolTopUp = false;
+        }
+        topUpPool();
+    }
+    return NULL;
+}
+
+/* Asks the pool thread to replace a device a mount just took */
+static void kickPool() {
+    android::Mutex::Autolock lock(sPoolLock);
+    if (sPoolLowWater) {
+        sPoolTopUp = true;
+        sPoolCond.signal();
+    }
+}
+
+int Loop::startPool() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("ro.vold.loop_pool", value, "4");
+    int lowWater = atoi(value);
+    if (lowWater <= 0) {
+        return 0;
+    }
+
+    {
+        android::Mutex::Autolock lock(sPoolLock);
+        sPoolLowWater = lowWater < POOL_MAX ? lowWater : POOL_MAX;
+        sPoolTopUp = true;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, poolThread, NULL)) {
+        SLOGE("Unable to start loop device pool (%s)", strerror(errno));
+        pthread_attr_destroy(&attr);
+        android::Mutex::Autolock lock(sPoolLock);
+        sPoolLowWater = 0;
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/* Legacy allocation for kernels without /dev/loop-control */
+static int scanFreeLoopDevice(char *filename, size_t len) {
+    int i;
+    int fd;
+
+    for (i = 0; i < Loop::LOOP_MAX; i++) {
+        struct loop_info64 li;
+        int rc;
+
+        if (makeLoopNode(i, filename, len)) {
+            return -1;
+        }
+
+        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
             SLOGE("Unable to open %s (%s)", filename, strerror(errno));
             return -1;
         }
 
         rc = ioctl(fd, LOOP_GET_STATUS64, &li);
         if (rc < 0 && errno == ENXIO)
-            break;
+            return fd;
 
         close(fd);
 
@@ -166,47 +468,179 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
         }
     }
 
-    if (i == LOOP_MAX) {
-        SLOGE("Exhausted all loop devices");
-        errno = ENOSPC;
+    SLOGE("Exhausted all loop devices");
+    errno = ENOSPC;
+    return -1;
+}
+
+/*
+ * Binds file_fd to the loop device and labels it in one ioctl when the
+ * kernel has LOOP_CONFIGURE, else with LOOP_SET_FD + LOOP_SET_STATUS64.
+ * Fails with EBUSY if someone else grabbed the device first.
+ */
+static int configureLoopDevice(int fd, int file_fd, const char *id, const char *loopFile) {
+    struct loop_info64 li;
+
+    memset(&li, 0, sizeof(li));
+    strlcpy((char*) li.lo_crypt_name, id, LO_NAME_SIZE);
+    strlcpy((char*) li.lo_file_name, loopFile, LO_NAME_SIZE);
+
+    if (sLoopConfigureSupported) {
+        struct loop_config config;
+
+        memset(&config, 0, sizeof(config));
+        config.fd = file_fd;
+        config.info = li;
+        if (!ioctl(fd, LOOP_CONFIGURE, &config)) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOTTY) {
+            return -1;
+        }
+        SLOGI("LOOP_CONFIGURE not supported, using LOOP_SET_FD");
+        sLoopConfigureSupported = false;
+    }
+
+    if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
         return -1;
     }
 
-    strncpy(loopDeviceBuffer, filename, len -1);
+    if (ioctl(fd, LOOP_SET_STATUS64, &li) < 0) {
+        int saved_errno = errno;
+        SLOGE("Error setting loopback status (%s)", strerror(errno));
+        ioctl(fd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/* Logical block size of the device holding the file, or 0 if unknown */
+static unsigned int backingLogicalBlockSize(int file_fd) {
+    struct stat st;
+    char path[PATH_MAX];
+
+    if (fstat(file_fd, &st)) {
+        return 0;
+    }
+
+    // Partitions have no queue/ of their own; it lives on the parent disk
+    const char *queues[] = { "queue", "../queue" };
+    for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/logical_block_size",
+                major(st.st_dev), minor(st.st_dev), queues[i]);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        unsigned int size = 0;
+        if (fscanf(fp, "%u", &size) != 1) {
+            size = 0;
+        }
+        fclose(fp);
+        return size;
+    }
+    return 0;
+}
+
+/*
+ * Switches the loop device to direct I/O so container data is not cached
+ * both in the loop device and in the backing file. Direct I/O needs the
+ * loop block size to be at least the backing device's, which is only
+ * raised as far as the image's filesystem allows (maxBlockSize). Anything
+ * the kernel or the backing filesystem (e.g. FUSE) refuses just leaves the
+ * device on buffered I/O.
+ */
+static void tuneLoopDevice(int fd, int file_fd, const char *loopDevice,
+        unsigned int maxBlockSize) {
+    unsigned int blockSize = backingLogicalBlockSize(file_fd);
+
+    if (blockSize > 512) {
+        if (blockSize > maxBlockSize) {
+            SLOGW("%s: backing block size %u too large for image, using buffered I/O",
+                    loopDevice, blockSize);
+            return;
+        }
+        if (ioctl(fd, LOOP_SET_BLOCK_SIZE, (unsigned long) blockSize)) {
+            SLOGW("%s: failed to set block size %u (%s), using buffered I/O",
+                    loopDevice, blockSize, strerror(errno));
+            return;
+        }
+    }
+
+    if (ioctl(fd, LOOP_SET_DIRECT_IO, 1UL)) {
+        SLOGI("%s: direct I/O not available (%s), using buffered I/O",
+                loopDevice, strerror(errno));
+    }
+}
+// MStar Android Patch End
+
+int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len,
+                 unsigned int maxBlockSize) {
+    int fd;
+    char filename[256];
 
     int file_fd;
 
-    if ((file_fd = open(loopFile, O_RDWR)) < 0) {
+    if ((file_fd = open(loopFile, O_RDWR | O_CLOEXEC)) < 0) {
         SLOGE("Unable to open %s (%s)", loopFile, strerror(errno));
         // MStar Android Patch Begin
-        if ((file_fd = open(loopFile, O_RDONLY)) < 0) {
+        if ((file_fd = open(loopFile, O_RDONLY | O_CLOEXEC)) < 0) {
             SLOGE("Unable to open %s (%s)", loopFile, strerror(errno));
-            close(fd);
             return -1;
         }
         SLOGW("Open %s by Read-only",loopFile);
         // MStar Android Patch End
     }
 
-    if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
-        SLOGE("Error setting up loopback interface (%s)", strerror(errno));
-        close(file_fd);
+    // MStar Android Patch Begin
+    int attempt;
+    for (attempt = 0; attempt < LOOP_GET_FREE_RETRIES; attempt++) {
+        fd = getFreeLoopDevice(filename, sizeof(filename));
+        if (fd < 0 && errno == ENOSYS) {
+            fd = scanFreeLoopDevice(filename, sizeof(filename));
+        }
+        if (fd < 0) {
+            close(file_fd);
+            return -1;
+        }
+
+        if (!configureLoopDevice(fd, file_fd, id, loopFile)) {
+            break;
+        }
+        int saved_errno = errno;
         close(fd);
+        if (saved_errno != EBUSY) {
+            SLOGE("Error setting up loopback interface (%s)", strerror(saved_errno));
+            close(file_fd);
+            errno = saved_errno;
+            return -1;
+        }
+        // Lost a race for the free device with another loop user
+        SLOGW("%s was taken before we could set it up, retrying", filename);
+    }
+
+    if (attempt == LOOP_GET_FREE_RETRIES) {
+        SLOGE("Gave up looking for a free loop device");
+        close(file_fd);
+        errno = EBUSY;
         return -1;
     }
 
-    struct loop_info64 li;
+    tuneLoopDevice(fd, file_fd, filename, maxBlockSize);
+    kickPool();
+    // MStar Android Patch End
 
-    memset(&li, 0, sizeof(li));
-    strlcpy((char*) li.lo_crypt_name, id, LO_NAME_SIZE);
-    strlcpy((char*) li.lo_file_name, loopFile, LO_NAME_SIZE);
+    strncpy(loopDeviceBuffer, filename, len -1);
 
-    if (ioctl(fd, LOOP_SET_STATUS64, &li) < 0) {
-        SLOGE("Error setting loopback status (%s)", strerror(errno));
-        close(file_fd);
-        close(fd);
-        return -1;
+    // MStar Android Patch Begin
+    struct stat st;
+    unsigned long long numSectors = 0;
+    if (!fstat(file_fd, &st)) {
+        numSectors = st.st_size / 512;
     }
+    ContainerRegistry::setLoop(id, filename, loopFile, numSectors);
+    // MStar Android Patch End
 
     close(fd);
     close(file_fd);
@@ -230,6 +664,9 @@ int Loop::destroyByDevice(const char *loopDevice) {
     }
 
     close(device_fd);
+    // MStar Android Patch Begin
+    ContainerRegistry::clearLoop(loopDevice);
+    // MStar Android Patch End
     return 0;
 }
 
@@ -238,61 +675,274 @@ int Loop::destroyByFile(const char *loopFile) {
     return -1;
 }
 
-int Loop::createImageFile(const char *file, unsigned int numSectors) {
+// MStar Android Patch Begin
+#define IMAGE_ZERO_CHUNK (64 * 1024)
+#define IMAGE_FIEMAP_BATCH 64
+
+static int fallocateFile(int fd, off64_t offset, off64_t len) {
+#if defined(__LP64__)
+    return syscall(__NR_fallocate, fd, 0, offset, len);
+#else
+    // 64-bit offsets are passed as register pairs on 32-bit ABIs
+    return syscall(__NR_fallocate, fd, 0,
+            (unsigned long) offset, (unsigned long) (offset >> 32),
+            (unsigned long) len, (unsigned long) (len >> 32));
+#endif
+}
+
+/* For filesystems without fallocate (e.g. vfat on older kernels) */
+static int zeroFill(int fd, off64_t offset, off64_t len) {
+    char *zeroes = (char *) calloc(1, IMAGE_ZERO_CHUNK);
+    if (!zeroes) {
+        return -1;
+    }
+
+    off64_t done = 0;
+    while (done < len) {
+        size_t chunk = (len - done) < IMAGE_ZERO_CHUNK ? (size_t) (len - done) : IMAGE_ZERO_CHUNK;
+        ssize_t rc = pwrite64(fd, zeroes, chunk, offset + done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(zeroes);
+            return -1;
+        }
+        done += rc;
+    }
+    free(zeroes);
+    return fsync(fd);
+}
+
+/*
+ * Counts the extents backing fd and how many times they are not
+ * physically adjacent to the previous one.
+ */
+static int countExtents(int fd, unsigned int *numExtents, unsigned int *numBreaks) {
+    size_t size = sizeof(struct fiemap) + IMAGE_FIEMAP_BATCH * sizeof(struct fiemap_extent);
+    struct fiemap *fm = (struct fiemap *) malloc(size);
+    if (!fm) {
+        return -1;
+    }
+
+    unsigned long long start = 0;
+    unsigned long long nextPhysical = 0;
+    bool last = false;
+
+    *numExtents = 0;
+    *numBreaks = 0;
+    while (!last) {
+        memset(fm, 0, size);
+        fm->fm_start = start;
+        fm->fm_length = ~0ULL;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = IMAGE_FIEMAP_BATCH;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+            free(fm);
+            return -1;
+        }
+        if (!fm->fm_mapped_extents) {
+            break;
+        }
+
+        for (unsigned int i = 0; i < fm->fm_mapped_extents; i++) {
+            struct fiemap_extent *fe = &fm->fm_extents[i];
+            if (*numExtents && fe->fe_physical != nextPhysical) {
+                (*numBreaks)++;
+            }
+            (*numExtents)++;
+            nextPhysical = fe->fe_physical + fe->fe_length;
+            start = fe->fe_logical + fe->fe_length;
+            if (fe->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = true;
+            }
+        }
+    }
+    free(fm);
+    return 0;
+}
+// MStar Android Patch End
+
+int Loop::createImageFile(const char *file, unsigned int numSectors, int flags) {
     int fd;
+    off64_t size = (off64_t) numSectors * 512;
 
     if ((fd = creat(file, 0600)) < 0) {
         SLOGE("Error creating imagefile (%s)", strerror(errno));
         return -1;
     }
 
-    if (ftruncate(fd, numSectors * 512) < 0) {
-        SLOGE("Error truncating imagefile (%s)", strerror(errno));
+    // MStar Android Patch Begin
+    if (flags & IMAGE_SPARSE) {
+        if (ftruncate64(fd, size) < 0) {
+            SLOGE("Error truncating imagefile (%s)", strerror(errno));
+            close(fd);
+            return -1;
+        }
         close(fd);
-        return -1;
+        return 0;
+    }
+
+    /*
+     * Reserve every block now so the image neither fragments as it fills
+     * nor runs into ENOSPC long after it was created. Where supported
+     * this only allocates unwritten extents, which costs no I/O.
+     */
+    if (fallocateFile(fd, 0, size) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            SLOGE("Error preallocating imagefile (%s)", strerror(errno));
+            close(fd);
+            unlink(file);
+            return -1;
+        }
+        SLOGI("fallocate not supported for %s, writing zeroes", file);
+        if (zeroFill(fd, 0, size) < 0) {
+            SLOGE("Error zero-filling imagefile (%s)", strerror(errno));
+            close(fd);
+            unlink(file);
+            return -1;
+        }
     }
+
+    if (flags & IMAGE_REPORT_EXTENTS) {
+        unsigned int numExtents, numBreaks;
+        if (countExtents(fd, &numExtents, &numBreaks)) {
+            SLOGW("Unable to map extents of %s (%s)", file, strerror(errno));
+        } else if (numBreaks) {
+            SLOGW("Imagefile %s is fragmented: %u extents, %u discontiguous",
+                    file, numExtents, numBreaks);
+        } else {
+            SLOGI("Imagefile %s is contiguous (%u extents)", file, numExtents);
+        }
+    }
+    // MStar Android Patch End
+
     close(fd);
     return 0;
 }
 
+// MStar Android Patch Begin
+/* Grows an image to numSectors, reserving the new tail like createImageFile() */
+int Loop::resizeImageFile(const char *file, unsigned int numSectors, int flags) {
+    off64_t size = (off64_t) numSectors * 512;
+    struct stat st;
+
+    int fd = open(file, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Error opening imagefile (%s)", strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        SLOGE("Error sizing imagefile (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (size < st.st_size) {
+        SLOGE("Imagefile %s can't shrink (%lld -> %lld bytes)", file,
+                (long long) st.st_size, (long long) size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    off64_t oldSize = st.st_size;
+    int rc = 0;
+    if (flags & IMAGE_SPARSE) {
+        rc = ftruncate64(fd, size);
+    } else if (fallocateFile(fd, oldSize, size - oldSize) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            rc = -1;
+        } else {
+            rc = zeroFill(fd, oldSize, size - oldSize);
+        }
+    }
+    if (!rc) {
+        rc = fsync(fd);
+    }
+    if (rc) {
+        SLOGE("Error growing imagefile (%s)", strerror(errno));
+        // Leave the image as the container still describes it
+        ftruncate64(fd, oldSize);
+    }
+    close(fd);
+    return rc ? -1 : 0;
+}
+
+/* Makes a bound loop device pick up a new backing file size */
+int Loop::refreshSize(const char *loopDevice) {
+    int fd = open(loopDevice, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Unable to open %s (%s)", loopDevice, strerror(errno));
+        return -1;
+    }
+    int rc = ioctl(fd, LOOP_SET_CAPACITY, 0);
+    if (rc < 0) {
+        SLOGE("Unable to refresh size of %s (%s)", loopDevice, strerror(errno));
+    }
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
+
+/* Points a bound loop device's id and file name at a renamed image */
+int Loop::relabel(const char *loopDevice, const char *id, const char *loopFile) {
+    struct loop_info64 li;
+
+    int fd = open(loopDevice, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Unable to open %s (%s)", loopDevice, strerror(errno));
+        return -1;
+    }
+
+    int rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+    if (!rc) {
+        memset(li.lo_crypt_name, 0, sizeof(li.lo_crypt_name));
+        memset(li.lo_file_name, 0, sizeof(li.lo_file_name));
+        strlcpy((char*) li.lo_crypt_name, id, LO_NAME_SIZE);
+        strlcpy((char*) li.lo_file_name, loopFile, LO_NAME_SIZE);
+        rc = ioctl(fd, LOOP_SET_STATUS64, &li);
+    }
+    if (rc < 0) {
+        SLOGE("Unable to relabel %s (%s)", loopDevice, strerror(errno));
+    }
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
+// MStar Android Patch End
+
 int Loop::lookupInfo(const char *loopDevice, struct asec_superblock *sb, unsigned int *nr_sec) {
+    // MStar Android Patch Begin
+    if (readInfo(loopDevice, sb, nr_sec)) {
+        destroyByDevice(loopDevice);
+        return -1;
+    }
+    return 0;
+}
+
+/* Like lookupInfo(), but leaves the loop device alone on failure */
+int Loop::readInfo(const char *loopDevice, struct asec_superblock *sb, unsigned int *nr_sec) {
     int fd;
     struct asec_superblock buffer;
 
-    if ((fd = open(loopDevice, O_RDONLY)) < 0) {
+    if ((fd = open(loopDevice, O_RDONLY | O_CLOEXEC)) < 0) {
         SLOGE("Failed to open loopdevice (%s)", strerror(errno));
-        destroyByDevice(loopDevice);
         return -1;
     }
 
     if (ioctl(fd, BLKGETSIZE, nr_sec)) {
         SLOGE("Failed to get loop size (%s)", strerror(errno));
-        destroyByDevice(loopDevice);
         close(fd);
         return -1;
     }
 
-    /*
-     * Try to read superblock.
-     */
     memset(&buffer, 0, sizeof(struct asec_superblock));
-    if (lseek(fd, ((*nr_sec - 1) * 512), SEEK_SET) < 0) {
-        SLOGE("lseek failed (%s)", strerror(errno));
-        close(fd);
-        destroyByDevice(loopDevice);
-        return -1;
-    }
-    if (read(fd, &buffer, sizeof(struct asec_superblock)) != sizeof(struct asec_superblock)) {
+    if (pread64(fd, &buffer, sizeof(buffer), (off64_t) (*nr_sec - 1) * 512) != sizeof(buffer)) {
         SLOGE("superblock read failed (%s)", strerror(errno));
         close(fd);
-        destroyByDevice(loopDevice);
         return -1;
     }
     close(fd);
 
-    /*
-     * Superblock successfully read. Copy to caller's struct.
-     */
     memcpy(sb, &buffer, sizeof(struct asec_superblock));
     return 0;
+    // MStar Android Patch End
 }
@@ -25,15 +25,52 @@ class SocketClient;
 class Loop {
 public:
     static const int LOOP_MAX = 4096;
+
+    // MStar Android Patch Begin
+    /* createImageFile() flags */
+    static const int IMAGE_SPARSE         = 0x1; // don't reserve blocks up front
+    static const int IMAGE_REPORT_EXTENTS = 0x2; // log the extent count / contiguity
+
+    /* Most free loop devices the pool keeps ready, however busy mounts get */
+    static const int POOL_MAX = 32;
+    // MStar Android Patch End
 public:
+    // MStar Android Patch Begin
+    /*
+     * Keeps ro.vold.loop_pool (default 4, 0 disables) unbound loop devices
+     * created and their nodes made, so a mount doesn't wait for either.
+     */
+    static int startPool();
+    // MStar Android Patch End
     static int lookupActive(const char *id, char *buffer, size_t len);
+    // MStar Android Patch Begin
+    static int lookupActiveMany(const char **ids, char **buffers, size_t len, int count);
+    // MStar Android Patch End
     static int lookupInfo(const char *loopDevice, struct asec_superblock *sb, unsigned int *nr_sec);
-    static int create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len);
+    // MStar Android Patch Begin
+    static int readInfo(const char *loopDevice, struct asec_superblock *sb, unsigned int *nr_sec);
+    // MStar Android Patch End
+    /*
+     * maxBlockSize is the largest logical block size the image's
+     * filesystem can live with; it bounds the direct I/O tuning.
+     */
+    static int create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len,
+                      unsigned int maxBlockSize = 512);
     static int destroyByDevice(const char *loopDevice);
     static int destroyByFile(const char *loopFile);
-    static int createImageFile(const char *file, unsigned int numSectors);
+    static int createImageFile(const char *file, unsigned int numSectors, int flags = 0);
+    // MStar Android Patch Begin
+    static int resizeImageFile(const char *file, unsigned int numSectors, int flags = 0);
+    static int refreshSize(const char *loopDevice);
+    static int relabel(const char *loopDevice, const char *id, const char *loopFile);
+    // MStar Android Patch End
 
     static int dumpState(SocketClient *c);
+
+// MStar Android Patch Begin
+private:
+    static void *poolThread(void *arg);
+// MStar Android Patch End
 };
 
 #endif
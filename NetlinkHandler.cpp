@@ -26,6 +26,7 @@
 #include <sysutils/NetlinkEvent.h>
 #include "NetlinkHandler.h"
 #include "VolumeManager.h"
+#include "BlockNode.h"
 
 NetlinkHandler::NetlinkHandler(int listenerSocket) :
                 NetlinkListener(listenerSocket) {
@@ -52,6 +53,9 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
     }
 
     if (!strcmp(subsys, "block")) {
+        // MStar Android Patch Begin
+        BlockNode::handleUevent(evt);
+        // MStar Android Patch End
         vm->handleBlockEvent(evt);
     }
 }
@@ -24,14 +24,26 @@
 #include <pwd.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <signal.h>
+#include <pthread.h>
 
 #define LOG_TAG "ProcessKiller"
 #include <cutils/log.h>
 
 #include "Process.h"
 
+/* Same number on every architecture we ship; old kernel headers lack them */
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
 int Process::readSymLink(const char *path, char *link, size_t max) {
     struct stat s;
     int length;
@@ -161,6 +173,255 @@ int Process::checkSymLink(int pid, const char *mountPoint, const char *name) {
     return 0;
 }
 
+/* Undoes the octal escapes (\040 etc.) /proc/self/mountinfo uses in paths */
+static void unescapeMountPath(char *path) {
+    char *out = path;
+    for (char *in = path; *in; out++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' &&
+                in[3] >= '0' && in[3] <= '7') {
+            *out = ((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0');
+            in += 4;
+        } else {
+            *out = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * True if the mount on top of mountPoint shows only a subtree of its
+ * filesystem, as a bind mount of a directory does (e.g. the secure ASEC
+ * directory bound from the sdcard's .android_secure).
+ */
+bool Process::isSubtreeMount(const char *mountPoint) {
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp)
+        return false;
+
+    char line[1024];
+    bool subtree = false;
+    while (fgets(line, sizeof(line), fp)) {
+        char root[PATH_MAX];
+        char target[PATH_MAX];
+
+        // <id> <parent> <major:minor> <root> <mount point> ...
+        if (sscanf(line, "%*d %*d %*s %4095s %4095s", root, target) != 2)
+            continue;
+        unescapeMountPath(target);
+        if (strcmp(target, mountPoint))
+            continue;
+        // Later lines are mounted on top of earlier ones
+        unescapeMountPath(root);
+        subtree = strcmp(root, "/") != 0;
+    }
+    fclose(fp);
+    return subtree;
+}
+
+int Process::getMountDevice(const char *mountPoint, dev_t *dev) {
+    struct stat s;
+    struct stat parent;
+    char path[PATH_MAX];
+
+    if (stat(mountPoint, &s) < 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/..", mountPoint);
+    if (stat(path, &parent) < 0)
+        return -1;
+
+    /*
+     * st_dev only identifies the mounted filesystem when mountPoint is
+     * the root of a mount. Otherwise it names whatever filesystem the
+     * path happens to live on, which would match far too much.
+     */
+    if (s.st_dev == parent.st_dev && s.st_ino != parent.st_ino) {
+        errno = EINVAL;
+        return -1;
+    }
+    /*
+     * A bind mount of a directory shares st_dev with everything else on
+     * its filesystem; only its paths tell its files apart.
+     */
+    if (isSubtreeMount(mountPoint)) {
+        errno = EINVAL;
+        return -1;
+    }
+    *dev = s.st_dev;
+    return 0;
+}
+
+int Process::checkFileDescriptorDevice(int pid, dev_t dev, char *openFilename, size_t max) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        struct stat s;
+
+        if (de->d_name[0] == '.')
+            continue;
+        // stat() follows the link to the open file, deleted or not
+        if (fstatat(dirfd(dir), de->d_name, &s, 0) < 0 || s.st_dev != dev)
+            continue;
+
+        if (openFilename) {
+            char link[PATH_MAX];
+            snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, de->d_name);
+            memset(openFilename, 0, max);
+            if (readSymLink(path, link, sizeof(link))) {
+                strncpy(openFilename, link, max-1);
+            }
+        }
+        closedir(dir);
+        return 1;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+int Process::checkFileMapsDevice(int pid, dev_t dev, char *openFilename, size_t max) {
+    FILE *file;
+    char buffer[PATH_MAX + 100];
+    bool lineStart = true;
+
+    sprintf(buffer, "/proc/%d/maps", pid);
+    file = fopen(buffer, "r");
+    if (!file)
+        return 0;
+
+    while (fgets(buffer, sizeof(buffer), file)) {
+        // skip the tail of lines longer than our buffer
+        bool wasLineStart = lineStart;
+        size_t len = strlen(buffer);
+        lineStart = (len > 0 && buffer[len - 1] == '\n');
+        if (!wasLineStart)
+            continue;
+
+        // 00008000-0000a000 r-xp 00000000 b3:0d 1234 /path
+        unsigned int maj, min;
+        unsigned long inode;
+        if (sscanf(buffer, "%*s %*s %*s %x:%x %lu", &maj, &min, &inode) != 3 || !inode)
+            continue;
+        if (maj != major(dev) || min != minor(dev))
+            continue;
+
+        if (openFilename) {
+            const char* path = strchr(buffer, '/');
+            memset(openFilename, 0, max);
+            if (path) {
+                strncpy(openFilename, path, max-1);
+                openFilename[strcspn(openFilename, "\n")] = 0;
+            }
+        }
+        fclose(file);
+        return 1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int Process::checkSymLinkDevice(int pid, dev_t dev, const char *name,
+                                char *openFilename, size_t max) {
+    char path[PATH_MAX];
+    struct stat s;
+
+    sprintf(path, "/proc/%d/%s", pid, name);
+    if (stat(path, &s) < 0 || s.st_dev != dev)
+        return 0;
+
+    if (openFilename) {
+        char link[PATH_MAX];
+        memset(openFilename, 0, max);
+        if (readSymLink(path, link, sizeof(link))) {
+            strncpy(openFilename, link, max-1);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Returns the reason pid keeps the filesystem identified by dev busy,
+ * or HOLDER_NONE. Only the holder types in typeMask are checked.
+ */
+int Process::checkHolder(int pid, dev_t dev, char *openFilename, size_t max, int typeMask) {
+    if ((typeMask & (1 << HOLDER_FD)) &&
+            checkFileDescriptorDevice(pid, dev, openFilename, max))
+        return HOLDER_FD;
+    if ((typeMask & (1 << HOLDER_MMAP)) &&
+            checkFileMapsDevice(pid, dev, openFilename, max))
+        return HOLDER_MMAP;
+    if ((typeMask & (1 << HOLDER_CWD)) &&
+            checkSymLinkDevice(pid, dev, "cwd", openFilename, max))
+        return HOLDER_CWD;
+    if ((typeMask & (1 << HOLDER_ROOT)) &&
+            checkSymLinkDevice(pid, dev, "root", openFilename, max))
+        return HOLDER_ROOT;
+    if ((typeMask & (1 << HOLDER_EXE)) &&
+            checkSymLinkDevice(pid, dev, "exe", openFilename, max))
+        return HOLDER_EXE;
+    return HOLDER_NONE;
+}
+
+/*
+ * Path based variant, used when mountPoint is not the root of a mount and
+ * therefore has no st_dev of its own.
+ */
+int Process::checkHolder(int pid, const char *mountPoint, char *openFilename, size_t max,
+                         int typeMask) {
+    int type = HOLDER_NONE;
+
+    if ((typeMask & (1 << HOLDER_FD)) &&
+            checkFileDescriptorSymLinks(pid, mountPoint, openFilename, max))
+        return HOLDER_FD;
+    if ((typeMask & (1 << HOLDER_MMAP)) &&
+            checkFileMaps(pid, mountPoint, openFilename, max))
+        return HOLDER_MMAP;
+
+    if ((typeMask & (1 << HOLDER_CWD)) && checkSymLink(pid, mountPoint, "cwd"))
+        type = HOLDER_CWD;
+    else if ((typeMask & (1 << HOLDER_ROOT)) && checkSymLink(pid, mountPoint, "root"))
+        type = HOLDER_ROOT;
+    else if ((typeMask & (1 << HOLDER_EXE)) && checkSymLink(pid, mountPoint, "exe"))
+        type = HOLDER_EXE;
+
+    if (type != HOLDER_NONE && openFilename) {
+        memset(openFilename, 0, max);
+        strncpy(openFilename, mountPoint, max-1);
+    }
+    return type;
+}
+
+const char *Process::holderTypeToStr(int type) {
+    switch (type) {
+    case HOLDER_FD:
+        return "fd";
+    case HOLDER_MMAP:
+        return "mmap";
+    case HOLDER_CWD:
+        return "cwd";
+    case HOLDER_ROOT:
+        return "root";
+    case HOLDER_EXE:
+        return "exe";
+    default:
+        return "none";
+    }
+}
+
+int Process::holderTypeFromStr(const char *str) {
+    for (int type = HOLDER_FD; type <= HOLDER_EXE; type++) {
+        if (!strcmp(str, holderTypeToStr(type)))
+            return type;
+    }
+    return HOLDER_NONE;
+}
+
 int Process::getPid(const char *s) {
     int result = 0;
     while (*s) {
@@ -170,6 +431,225 @@ int Process::getPid(const char *s) {
     return result;
 }
 
+struct HolderScan {
+    const char *mountPoint;
+    dev_t dev;
+    bool byDevice;
+    bool firstOnly;
+
+    int *pids;
+    int numPids;
+    int next;
+
+    uid_t uid;
+    const char *package;
+    int typeMask;
+
+    pthread_mutex_t lock;
+    volatile int found;
+    Process::HolderCallback callback;
+    void *data;
+};
+
+static bool packageMatches(int pid, const char *package) {
+    char name[PATH_MAX];
+    size_t len = strlen(package);
+
+    Process::getProcessName(pid, name, sizeof(name));
+    return !strncmp(name, package, len) && (name[len] == 0 || name[len] == ':');
+}
+
+static void *holderScanThread(void *arg) {
+    HolderScan *scan = (HolderScan *) arg;
+    Process::Holder holder;
+
+    while (!(scan->firstOnly && scan->found)) {
+        int i = __sync_fetch_and_add(&scan->next, 1);
+        if (i >= scan->numPids)
+            break;
+
+        holder.pid = scan->pids[i];
+
+        // Cheap filters first, before touching fds and maps
+        char path[32];
+        struct stat s;
+        snprintf(path, sizeof(path), "/proc/%d", holder.pid);
+        if (stat(path, &s) < 0)
+            continue;
+        holder.uid = s.st_uid;
+        if (scan->uid != (uid_t) -1 && holder.uid != scan->uid)
+            continue;
+        if (scan->package && !packageMatches(holder.pid, scan->package))
+            continue;
+
+        if (scan->byDevice) {
+            holder.type = Process::checkHolder(holder.pid, scan->dev,
+                    holder.path, sizeof(holder.path), scan->typeMask);
+        } else {
+            holder.type = Process::checkHolder(holder.pid, scan->mountPoint,
+                    holder.path, sizeof(holder.path), scan->typeMask);
+        }
+        if (holder.type == Process::HOLDER_NONE)
+            continue;
+
+        pthread_mutex_lock(&scan->lock);
+        if (!(scan->firstOnly && scan->found)) {
+            scan->found++;
+            if (scan->callback)
+                scan->callback(&holder, scan->data);
+        }
+        pthread_mutex_unlock(&scan->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Finds processes keeping mountPoint busy. Holders are matched by the
+ * device number of the mounted filesystem, which also catches deleted
+ * files, bind mounts and paths longer than PATH_MAX. The /proc walk is
+ * spread over up to SCAN_THREADS_MAX threads; with firstOnly the scan
+ * stops at the first holder. An optional filter restricts the processes
+ * and holder types considered.
+ *
+ * Returns the number of holders reported, or -1 on error.
+ */
+int Process::findHolders(const char *mountPoint, bool firstOnly,
+                         HolderCallback callback, void *data,
+                         const HolderFilter *filter) {
+    dev_t dev;
+
+    if (getMountDevice(mountPoint, &dev)) {
+        SLOGW("%s is not a mount root; matching holders by path", mountPoint);
+        return scanHolders(mountPoint, NULL, firstOnly, callback, data, filter);
+    }
+    return scanHolders(mountPoint, &dev, firstOnly, callback, data, filter);
+}
+
+/*
+ * Same, for a filesystem that may no longer be reachable by path, e.g.
+ * after a lazy unmount.
+ */
+int Process::findHolders(dev_t dev, bool firstOnly,
+                         HolderCallback callback, void *data,
+                         const HolderFilter *filter) {
+    return scanHolders(NULL, &dev, firstOnly, callback, data, filter);
+}
+
+int Process::scanHolders(const char *mountPoint, const dev_t *dev, bool firstOnly,
+                         HolderCallback callback, void *data,
+                         const HolderFilter *filter) {
+    DIR *dir;
+    struct dirent *de;
+    HolderScan scan;
+    HolderFilter all;
+
+    if (!filter)
+        filter = &all;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.mountPoint = mountPoint;
+    scan.firstOnly = firstOnly;
+    scan.callback = callback;
+    scan.data = data;
+    scan.uid = filter->uid;
+    scan.package = filter->package;
+    scan.typeMask = filter->typeMask;
+    scan.byDevice = (dev != NULL);
+    if (dev)
+        scan.dev = *dev;
+
+    if (!(dir = opendir("/proc"))) {
+        SLOGE("opendir failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    int capacity = 0;
+    while ((de = readdir(dir))) {
+        int pid = getPid(de->d_name);
+        if (pid == -1 || (filter->pid != -1 && pid != filter->pid))
+            continue;
+        if (scan.numPids == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            int *pids = (int *) realloc(scan.pids, capacity * sizeof(int));
+            if (!pids) {
+                SLOGE("Failed to allocate pid list");
+                free(scan.pids);
+                closedir(dir);
+                return -1;
+            }
+            scan.pids = pids;
+        }
+        scan.pids[scan.numPids++] = pid;
+    }
+    closedir(dir);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = (cpus > 0 && cpus < SCAN_THREADS_MAX) ? cpus : SCAN_THREADS_MAX;
+    if (numThreads > (scan.numPids / 32) + 1)
+        numThreads = (scan.numPids / 32) + 1;
+
+    pthread_mutex_init(&scan.lock, NULL);
+
+    pthread_t threads[SCAN_THREADS_MAX];
+    int started = 0;
+    for (int i = 1; i < numThreads; i++) {
+        if (pthread_create(&threads[started], NULL, holderScanThread, &scan)) {
+            SLOGW("Failed to start holder scan thread (%s)", strerror(errno));
+            break;
+        }
+        started++;
+    }
+
+    // The calling thread takes its share of the work too
+    holderScanThread(&scan);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&scan.lock);
+    free(scan.pids);
+    return scan.found;
+}
+
+static void logHolder(const Process::Holder *holder) {
+    char name[PATH_MAX];
+
+    Process::getProcessName(holder->pid, name, sizeof(name));
+
+    switch (holder->type) {
+    case Process::HOLDER_FD:
+        SLOGE("Process %s (%d) has open file %s", name, holder->pid, holder->path);
+        break;
+    case Process::HOLDER_MMAP:
+        SLOGE("Process %s (%d) has open filemap for %s", name, holder->pid, holder->path);
+        break;
+    case Process::HOLDER_CWD:
+        SLOGE("Process %s (%d) has cwd within %s", name, holder->pid, holder->path);
+        break;
+    case Process::HOLDER_ROOT:
+        SLOGE("Process %s (%d) has chroot within %s", name, holder->pid, holder->path);
+        break;
+    case Process::HOLDER_EXE:
+        SLOGE("Process %s (%d) has executable path within %s", name, holder->pid, holder->path);
+        break;
+    }
+}
+
+static void killHolder(const Process::Holder *holder, void *data) {
+    int action = *(int *) data;
+
+    logHolder(holder);
+
+    if (action == 1) {
+        SLOGW("Sending SIGHUP to process %d", holder->pid);
+        kill(holder->pid, SIGTERM);
+    } else if (action == 2) {
+        SLOGE("Sending SIGKILL to process %d", holder->pid);
+        kill(holder->pid, SIGKILL);
+    }
+}
+
 /*
  * Hunt down processes that have files open at the given mount point.
  * action = 0 to just warn,
@@ -178,45 +658,287 @@ int Process::getPid(const char *s) {
  */
 // hunt down and kill processes that have files open on the given mount point
 void Process::killProcessesWithOpenFiles(const char *path, int action) {
-    DIR*    dir;
-    struct dirent* de;
+    findHolders(path, false, killHolder, &action);
+}
 
-    if (!(dir = opendir("/proc"))) {
-        SLOGE("opendir failed (%s)", strerror(errno));
-        return;
+/*
+ * Fallback exit check for kernels without pidfds. Zombies have already
+ * dropped their files, so they count as gone.
+ */
+bool Process::isProcessGone(int pid) {
+    char path[64];
+    char buffer[256];
+    int fd;
+
+    if (kill(pid, 0) < 0 && errno == ESRCH)
+        return true;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return true;
+    int length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+        return true;
+    buffer[length] = 0;
+
+    // pid (comm) S ...; comm may itself contain ')'
+    const char *state = strrchr(buffer, ')');
+    return state && state[1] == ' ' && state[2] == 'Z';
+}
+
+struct HolderSet {
+    int *pids;
+    struct pollfd *fds;
+    int count;
+    int capacity;
+};
+
+static void collectHolder(const Process::Holder *holder, void *data) {
+    HolderSet *set = (HolderSet *) data;
+
+    logHolder(holder);
+
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 16;
+        int *pids = (int *) realloc(set->pids, capacity * sizeof(int));
+        if (!pids) {
+            SLOGE("Failed to allocate holder list");
+            return;
+        }
+        set->pids = pids;
+        set->capacity = capacity;
     }
+    set->pids[set->count++] = holder->pid;
+}
 
-    while ((de = readdir(dir))) {
-        int killed = 0;
-        int pid = getPid(de->d_name);
-        char name[PATH_MAX];
+static long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        if (pid == -1)
-            continue;
-        getProcessName(pid, name, sizeof(name));
-
-        char openfile[PATH_MAX];
-
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name, pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name, pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name, pid, path);
+static void signalHolders(HolderSet *set, int sig) {
+    for (int i = 0; i < set->count; i++) {
+        int pid = set->pids[i];
+        int fd = set->fds[i].fd;
+
+        if (sig == SIGKILL) {
+            SLOGE("Sending SIGKILL to process %d", pid);
         } else {
-            continue;
+            SLOGW("Sending signal %d to process %d", sig, pid);
         }
-        if (action == 1) {
-            SLOGW("Sending SIGHUP to process %d", pid);
-            kill(pid, SIGTERM);
-        } else if (action == 2) {
-            SLOGE("Sending SIGKILL to process %d", pid);
-            kill(pid, SIGKILL);
+        // A pidfd cannot hit a recycled pid; only fall back to kill() without one
+        if (fd < 0 || syscall(__NR_pidfd_send_signal, fd, sig, NULL, 0) < 0) {
+            kill(pid, sig);
         }
     }
-    closedir(dir);
+}
+
+/*
+ * Waits until every process in the set has exited or timeoutMs has passed,
+ * dropping the ones that exited. Returns the number still alive.
+ */
+static int waitForHolders(HolderSet *set, int timeoutMs) {
+    long long deadline = monotonicMs() + timeoutMs;
+    bool pollPids = false;
+
+    for (int i = 0; i < set->count; i++) {
+        if (set->fds[i].fd < 0)
+            pollPids = true;
+    }
+
+    while (set->count) {
+        long long remaining = deadline - monotonicMs();
+        if (remaining < 0)
+            remaining = 0;
+        int wait = remaining;
+        if (pollPids && wait > Process::EXIT_POLL_MS)
+            wait = Process::EXIT_POLL_MS;
+
+        // A pidfd turns readable when its process exits; negative fds are ignored
+        if (poll(set->fds, set->count, wait) < 0 && errno != EINTR) {
+            SLOGE("poll failed (%s)", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < set->count;) {
+            bool gone;
+            if (set->fds[i].fd >= 0) {
+                gone = set->fds[i].revents & (POLLIN | POLLHUP | POLLERR);
+            } else {
+                gone = Process::isProcessGone(set->pids[i]);
+            }
+            if (!gone) {
+                i++;
+                continue;
+            }
+            if (set->fds[i].fd >= 0)
+                close(set->fds[i].fd);
+            set->count--;
+            set->pids[i] = set->pids[set->count];
+            set->fds[i] = set->fds[set->count];
+        }
+
+        if (!remaining)
+            break;
+    }
+    return set->count;
+}
+
+/*
+ * Sends sig to every process holding path, then waits up to timeoutMs for
+ * them to exit, returning as soon as the last one is gone. With escalate,
+ * the survivors (and only those) get SIGKILL and another timeoutMs.
+ * sig = 0 just waits for the holders to let go on their own.
+ *
+ * Returns the number of holders still alive, or -1 on error. The number
+ * of holders found is stored in numHolders if given.
+ */
+int Process::signalHoldersAndWait(const char *path, int sig, int timeoutMs,
+                                  bool escalate, int *numHolders) {
+    dev_t dev;
+
+    if (getMountDevice(path, &dev))
+        return signalAndWait(path, NULL, sig, timeoutMs, escalate, numHolders);
+    return signalAndWait(path, &dev, sig, timeoutMs, escalate, numHolders);
+}
+
+int Process::signalHoldersAndWait(dev_t dev, int sig, int timeoutMs,
+                                  bool escalate, int *numHolders) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "%u:%u", major(dev), minor(dev));
+    return signalAndWait(name, &dev, sig, timeoutMs, escalate, numHolders);
+}
+
+/* Pins every process in the set with a pidfd, where the kernel has them */
+static int pinHolderSet(HolderSet *set) {
+    set->fds = (struct pollfd *) calloc(set->count ? set->count : 1, sizeof(struct pollfd));
+    if (!set->fds) {
+        SLOGE("Failed to allocate pidfd list");
+        return -1;
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        set->fds[i].fd = syscall(__NR_pidfd_open, set->pids[i], 0);
+        set->fds[i].events = POLLIN;
+    }
+    return 0;
+}
+
+static void freeHolderSet(HolderSet *set) {
+    for (int i = 0; set->fds && i < set->count; i++) {
+        if (set->fds[i].fd >= 0)
+            close(set->fds[i].fd);
+    }
+    free(set->fds);
+    free(set->pids);
+}
+
+static int signalSetAndWait(HolderSet *set, const char *path, int sig, int timeoutMs,
+                            bool escalate) {
+    if (sig)
+        signalHolders(set, sig);
+    int alive = waitForHolders(set, timeoutMs);
+
+    if (alive && escalate && sig != SIGKILL) {
+        SLOGW("%d process(es) still holding %s; escalating", alive, path);
+        signalHolders(set, SIGKILL);
+        alive = waitForHolders(set, timeoutMs);
+    }
+
+    if (alive) {
+        SLOGW("%d process(es) still holding %s after %d ms", alive, path, timeoutMs);
+    }
+    return alive;
+}
+
+int Process::signalAndWait(const char *path, const dev_t *dev, int sig, int timeoutMs,
+                           bool escalate, int *numHolders) {
+    HolderSet set;
+
+    memset(&set, 0, sizeof(set));
+    if (numHolders)
+        *numHolders = 0;
+
+    if (scanHolders(dev ? NULL : path, dev, false, collectHolder, &set, NULL) < 0) {
+        free(set.pids);
+        return -1;
+    }
+    if (numHolders)
+        *numHolders = set.count;
+    if (!set.count) {
+        free(set.pids);
+        return 0;
+    }
+
+    if (pinHolderSet(&set)) {
+        free(set.pids);
+        return -1;
+    }
+    int alive = signalSetAndWait(&set, path, sig, timeoutMs, escalate);
+    freeHolderSet(&set);
+    return alive;
+}
+
+struct Process::HolderSnapshot {
+    HolderSet set;
+    char name[32];
+};
+
+/*
+ * Records who holds the filesystem rootFd is open on right now, for
+ * signalling later without touching processes that only start using a
+ * filesystem with the same device number (e.g. the same media inserted
+ * again) in between. The open rootFd keeps the superblock, and so its
+ * device number, from being handed to another mount while scanning;
+ * our own hold on it is left out.
+ */
+Process::HolderSnapshot *Process::snapshotHolders(int rootFd) {
+    struct stat s;
+    if (fstat(rootFd, &s)) {
+        SLOGE("Failed to stat detached filesystem (%s)", strerror(errno));
+        return NULL;
+    }
+
+    HolderSnapshot *snapshot = (HolderSnapshot *) calloc(1, sizeof(HolderSnapshot));
+    if (!snapshot) {
+        SLOGE("Failed to allocate holder snapshot");
+        return NULL;
+    }
+    snprintf(snapshot->name, sizeof(snapshot->name), "%u:%u",
+             major(s.st_dev), minor(s.st_dev));
+
+    if (scanHolders(NULL, &s.st_dev, false, collectHolder, &snapshot->set, NULL) < 0) {
+        free(snapshot->set.pids);
+        free(snapshot);
+        return NULL;
+    }
+    int self = getpid();
+    for (int i = 0; i < snapshot->set.count; i++) {
+        if (snapshot->set.pids[i] == self) {
+            snapshot->set.pids[i--] = snapshot->set.pids[--snapshot->set.count];
+        }
+    }
+    if (pinHolderSet(&snapshot->set)) {
+        free(snapshot->set.pids);
+        free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+int Process::signalSnapshotAndWait(HolderSnapshot *snapshot, int sig, int timeoutMs,
+                                   bool escalate) {
+    if (!snapshot->set.count)
+        return 0;
+    return signalSetAndWait(&snapshot->set, snapshot->name, sig, timeoutMs, escalate);
+}
+
+void Process::freeSnapshot(HolderSnapshot *snapshot) {
+    if (!snapshot)
+        return;
+    freeHolderSet(&snapshot->set);
+    free(snapshot);
 }
@@ -17,9 +17,76 @@
 #ifndef _PROCESS_H
 #define _PROCESS_H
 
+#include <sys/types.h>
+#include <limits.h>
+
 class Process {
+public:
+    /* Why a process keeps a filesystem busy */
+    static const int HOLDER_NONE = 0;
+    static const int HOLDER_FD   = 1;
+    static const int HOLDER_MMAP = 2;
+    static const int HOLDER_CWD  = 3;
+    static const int HOLDER_ROOT = 4;
+    static const int HOLDER_EXE  = 5;
+
+    static const int HOLDER_ALL  = (1 << HOLDER_FD) | (1 << HOLDER_MMAP) |
+            (1 << HOLDER_CWD) | (1 << HOLDER_ROOT) | (1 << HOLDER_EXE);
+
+    struct Holder {
+        int pid;
+        uid_t uid;
+        int type;
+        char path[PATH_MAX];
+    };
+
+    /* Restricts findHolders() to matching processes and holder types */
+    struct HolderFilter {
+        HolderFilter() : pid(-1), uid((uid_t) -1), package(NULL), typeMask(HOLDER_ALL) {}
+
+        int pid;
+        uid_t uid;
+        /* Process name, with or without a ":subprocess" suffix */
+        const char *package;
+        /* Bitmask of (1 << HOLDER_xxx) */
+        int typeMask;
+    };
+
+    /*
+     * Called once for every holder found by findHolders(). Calls are
+     * serialized, but may come from any of the scanner threads.
+     */
+    typedef void (*HolderCallback)(const Holder *holder, void *data);
+
+    static const int SCAN_THREADS_MAX = 4;
+
+    /* Poll interval when pidfds are not available */
+    static const int EXIT_POLL_MS = 20;
+
 public:
     static void killProcessesWithOpenFiles(const char *path, int action);
+    static int signalHoldersAndWait(const char *path, int sig, int timeoutMs,
+                                    bool escalate = false, int *numHolders = NULL);
+    static int signalHoldersAndWait(dev_t dev, int sig, int timeoutMs,
+                                    bool escalate = false, int *numHolders = NULL);
+    static int findHolders(const char *mountPoint, bool firstOnly,
+                           HolderCallback callback, void *data,
+                           const HolderFilter *filter = NULL);
+    static int findHolders(dev_t dev, bool firstOnly,
+                           HolderCallback callback, void *data,
+                           const HolderFilter *filter = NULL);
+    /* Holders found at one point in time, pinned with pidfds where possible */
+    struct HolderSnapshot;
+    static HolderSnapshot *snapshotHolders(int rootFd);
+    static int signalSnapshotAndWait(HolderSnapshot *snapshot, int sig, int timeoutMs,
+                                     bool escalate = false);
+    static void freeSnapshot(HolderSnapshot *snapshot);
+    static int checkHolder(int pid, dev_t dev, char *openFilename, size_t max,
+                           int typeMask = HOLDER_ALL);
+    static int checkHolder(int pid, const char *mountPoint, char *openFilename, size_t max,
+                           int typeMask = HOLDER_ALL);
+    static const char *holderTypeToStr(int type);
+    static int holderTypeFromStr(const char *str);
     static int getPid(const char *s);
     static int checkSymLink(int pid, const char *path, const char *name);
     static int checkFileMaps(int pid, const char *path);
@@ -27,9 +94,21 @@ public:
     static int checkFileDescriptorSymLinks(int pid, const char *mountPoint);
     static int checkFileDescriptorSymLinks(int pid, const char *mountPoint, char *openFilename, size_t max);
     static void getProcessName(int pid, char *buffer, size_t max);
+    static int getMountDevice(const char *mountPoint, dev_t *dev);
+    static bool isProcessGone(int pid);
 private:
+    static int scanHolders(const char *mountPoint, const dev_t *dev, bool firstOnly,
+                           HolderCallback callback, void *data,
+                           const HolderFilter *filter);
+    static int signalAndWait(const char *path, const dev_t *dev, int sig, int timeoutMs,
+                             bool escalate, int *numHolders);
     static int readSymLink(const char *path, char *link, size_t max);
+    static bool isSubtreeMount(const char *mountPoint);
     static int pathMatchesMountPoint(const char *path, const char *mountPoint);
+    static int checkFileDescriptorDevice(int pid, dev_t dev, char *openFilename, size_t max);
+    static int checkFileMapsDevice(int pid, dev_t dev, char *openFilename, size_t max);
+    static int checkSymLinkDevice(int pid, dev_t dev, const char *name,
+                                  char *openFilename, size_t max);
 };
 
 #endif
@@ -27,6 +27,12 @@ public:
     static const int AsecListResult           = 111;
     static const int StorageUsersListResult   = 112;
     static const int CryptfsGetfieldResult    = 113;
+    // MStar Android Patch Begin
+    static const int ContainerTrimResult      = 114;
+    static const int AsecInfoResult           = 115;
+    static const int ContainerListResult      = 116;
+    static const int AsecSpaceResult          = 117;
+    // MStar Android Patch End
 
     // 200 series - Requested action has been successfully completed
     static const int CommandOkay              = 200;
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+#include "SpaceReclaimer.h"
+#include "Volume.h"
+
+/* From linux/ioprio.h, which the NDK headers don't carry */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+const char *SpaceReclaimer::TRASH_DIR = ".vold-trash";
+
+namespace {
+
+struct Pending {
+    /* Bytes the file still holds */
+    off64_t bytes;
+    /* Its volume isn't mounted; picked up again by queueDir() */
+    bool absent;
+
+    Pending() : bytes(0), absent(false) {}
+    Pending(off64_t b) : bytes(b), absent(false) {}
+};
+
+}
+
+static android::Mutex sLock;
+static android::Condition sCond;
+/* Trash file path -> what is left of it */
+static android::KeyedVector<android::String8, Pending> sPending;
+static unsigned sSeq = 0;
+
+static off64_t allocatedBytes(const struct stat *st) {
+    return (off64_t) st->st_blocks * 512;
+}
+
+static void queueTrashDirLocked(const char *dir) {
+    char trash[255];
+    snprintf(trash, sizeof(trash), "%s/%s", dir, SpaceReclaimer::TRASH_DIR);
+
+    DIR *d = opendir(trash);
+    if (!d) {
+        return;
+    }
+
+    size_t queued = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        struct stat st;
+        if (de->d_name[0] == '.' ||
+                fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        android::String8 path(trash);
+        path.appendFormat("/%s", de->d_name);
+        sPending.replaceValueFor(path, Pending(allocatedBytes(&st)));
+        queued++;
+    }
+    closedir(d);
+
+    if (queued) {
+        SLOGI("Reclaiming %zu images left in %s", queued, trash);
+        sCond.signal();
+    }
+}
+
+/* True if the trash directory holding path is gone, e.g. its card is out */
+static bool trashDirAbsent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[255];
+    struct stat st;
+
+    if (!slash || (size_t) (slash - path) >= sizeof(dir)) {
+        return false;
+    }
+    strlcpy(dir, path, slash - path + 1);
+    return stat(dir, &st) && errno == ENOENT;
+}
+
+/*
+ * Shrinks path by one chunk; returns the bytes it still holds, 0 once gone
+ * and -1 if its volume isn't there to shrink it on.
+ */
+static off64_t reclaimChunk(const char *path) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        if (errno == ENOENT && trashDirAbsent(path)) {
+            return -1;
+        } else if (errno != ENOENT) {
+            SLOGW("Unable to open %s (%s); unlinking it", path, strerror(errno));
+            unlink(path);
+        }
+        return 0;
+    }
+
+    struct stat st;
+    off64_t remaining = 0;
+    if (!fstat(fd, &st)) {
+        off64_t size = st.st_size > SpaceReclaimer::CHUNK_BYTES ?
+                st.st_size - SpaceReclaimer::CHUNK_BYTES : 0;
+        if (size && !ftruncate64(fd, size) && !fstat(fd, &st)) {
+            remaining = allocatedBytes(&st);
+        }
+    }
+    // Closed between chunks so an unmount of the volume isn't held up
+    close(fd);
+
+    if (!remaining && unlink(path) && errno != ENOENT) {
+        SLOGE("Failed to unlink %s (%s)", path, strerror(errno));
+    }
+    return remaining;
+}
+
+static bool inDir(const android::String8 &path, const char *dir) {
+    size_t len = strlen(dir);
+    return !strncmp(path.string(), dir, len) && path.string()[len] == '/';
+}
+
+static void updateLocked(const android::String8 &path, off64_t remaining) {
+    ssize_t idx = sPending.indexOfKey(path);
+    if (idx < 0) {
+        return;
+    }
+    if (remaining < 0) {
+        sPending.editValueAt(idx).absent = true;
+    } else if (remaining) {
+        sPending.replaceValueAt(idx, Pending(remaining));
+    } else {
+        sPending.removeItemsAt(idx);
+    }
+}
+
+/* The first entry that can be worked on, or -1 */
+static ssize_t nextLocked(const char *dir) {
+    for (size_t i = 0; i < sPending.size(); i++) {
+        if (!sPending.valueAt(i).absent && (!dir || inDir(sPending.keyAt(i), dir))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void *SpaceReclaimer::threadStart(void *arg) {
+    // Let the command path and apps win any contention for the disk
+    setpriority(PRIO_PROCESS, 0, 19);
+    syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    while (true) {
+        android::String8 path;
+        {
+            android::Mutex::Autolock lock(sLock);
+            ssize_t idx;
+            while ((idx = nextLocked(NULL)) < 0) {
+                sCond.wait(sLock);
+            }
+            path = sPending.keyAt(idx);
+        }
+
+        off64_t remaining = reclaimChunk(path.string());
+        {
+            android::Mutex::Autolock lock(sLock);
+            updateLocked(path, remaining);
+        }
+        usleep(CHUNK_PAUSE_MS * 1000);
+    }
+    return NULL;
+}
+
+int SpaceReclaimer::start() {
+    // The external secure area isn't bound yet; queueDir() picks it up then
+    queueDir(Volume::SEC_ASECDIR_INT);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, threadStart, NULL)) {
+        SLOGE("Unable to start space reclaimer (%s)", strerror(errno));
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+int SpaceReclaimer::discard(const char *path) {
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+    char trash[255];
+    char target[255];
+
+    if (!slash || lstat(path, &st)) {
+        return unlink(path);
+    }
+
+    int written = snprintf(trash, sizeof(trash), "%.*s/%s", (int) (slash - path), path, TRASH_DIR);
+    if (written < 0 || size_t(written) >= sizeof(trash) ||
+            (mkdir(trash, 0700) && errno != EEXIST)) {
+        return unlink(path);
+    }
+
+    android::Mutex::Autolock lock(sLock);
+    written = snprintf(target, sizeof(target), "%s/%ld-%u", trash, (long) time(NULL), sSeq++);
+    if (written < 0 || size_t(written) >= sizeof(target) || rename(path, target)) {
+        SLOGW("Unable to move %s to %s (%s); unlinking in place", path, trash, strerror(errno));
+        return unlink(path);
+    }
+
+    sPending.add(android::String8(target), Pending(allocatedBytes(&st)));
+    sCond.signal();
+    return 0;
+}
+
+void SpaceReclaimer::queueDir(const char *dir) {
+    android::Mutex::Autolock lock(sLock);
+    for (size_t i = 0; i < sPending.size(); i++) {
+        if (inDir(sPending.keyAt(i), dir)) {
+            sPending.editValueAt(i).absent = false;
+        }
+    }
+    queueTrashDirLocked(dir);
+    sCond.signal();
+}
+
+off64_t SpaceReclaimer::pendingBytes(const char *dir) {
+    android::Mutex::Autolock lock(sLock);
+
+    off64_t total = 0;
+    for (size_t i = 0; i < sPending.size(); i++) {
+        if (inDir(sPending.keyAt(i), dir)) {
+            total += sPending.valueAt(i).bytes;
+        }
+    }
+    return total;
+}
+
+void SpaceReclaimer::makeRoom(const char *dir, off64_t bytes) {
+    while (true) {
+        struct statfs sfs;
+        if (statfs(dir, &sfs) || (off64_t) sfs.f_bavail * sfs.f_bsize >= bytes) {
+            return;
+        }
+
+        android::String8 path;
+        {
+            android::Mutex::Autolock lock(sLock);
+            ssize_t idx = nextLocked(dir);
+            if (idx >= 0) {
+                path = sPending.keyAt(idx);
+            }
+        }
+        if (path.isEmpty()) {
+            return;
+        }
+
+        SLOGI("Freeing %s ahead of the reclaimer", path.string());
+        off64_t remaining;
+        do {
+            remaining = reclaimChunk(path.string());
+        } while (remaining > 0);
+
+        android::Mutex::Autolock lock(sLock);
+        updateLocked(path, remaining);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPACERECLAIMER_H
+#define _SPACERECLAIMER_H
+
+#include <sys/types.h>
+
+/*
+ * Frees the space of large deleted images off the command path. discard()
+ * renames the image into a trash directory next to it (so on the same
+ * filesystem) and a background thread truncates it away a chunk at a time
+ * at idle I/O priority, then unlinks it. Images on a volume that is
+ * unmounted wait there until it comes back.
+ */
+class SpaceReclaimer {
+public:
+    static const char *TRASH_DIR;
+    static const off64_t CHUNK_BYTES = 64LL * 1024 * 1024;
+    static const int CHUNK_PAUSE_MS = 100;
+
+    /* Starts the thread and queues whatever a previous instance left behind */
+    static int start();
+
+    /*
+     * Queues the trash of a secure area that just became available, and
+     * resumes images whose volume went away part way through.
+     */
+    static void queueDir(const char *dir);
+
+    /* Like unlink(path), but returns before the blocks are freed */
+    static int discard(const char *path);
+
+    /* Bytes still to be freed from images discarded out of dir */
+    static off64_t pendingBytes(const char *dir);
+
+    /*
+     * Frees pending images in dir right away, without throttling, until
+     * it has bytes available or nothing is left to free.
+     */
+    static void makeRoom(const char *dir, off64_t bytes);
+
+private:
+    static void *threadStart(void *arg);
+};
+
+#endif
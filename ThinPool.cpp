@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <utils/threads.h>
+
+#include "ThinPool.h"
+#include "ContainerRegistry.h"
+#include "Devmapper.h"
+#include "Loop.h"
+#include "Volume.h"
+#include "Asec.h"
+
+#define POOL_DIR_NAME ".thinpool"
+/* dm-thin device ids are 24 bits */
+#define THIN_ID_MAX 0xffffff
+#define THIN_ALLOC_TRIES 64
+/* What /data is before the real one is mounted, e.g. while FDE asks for the password */
+#define TMPFS_MAGIC 0x01021994
+#define RAMFS_MAGIC 0x858458f6
+
+const char *ThinPool::POOL_NAME = "vold-thinpool";
+
+static android::Mutex sLock;
+/* ro.vold.asec_thin asks for the pool but it hasn't been set up yet */
+static bool sWanted = false;
+static bool sEnabled = false;
+static unsigned int sPoolMb = ThinPool::DEFAULT_POOL_MB;
+static char sPoolDevice[255];
+static unsigned int sNextId = 0;
+
+static void thinName(const char *name, char *buffer, size_t len) {
+    snprintf(buffer, len, "%s-thin", name);
+}
+
+/*
+ * Creates the pool file if needed and binds a loop device to it. The file
+ * is allocated in full up front: were /data to fill under a sparse one,
+ * the pool would see write errors and fail every thin ASEC at once.
+ */
+static int attachPoolFile(const char *file, unsigned int mb, char *path, size_t pathLen,
+                          char *loopDevice, size_t len) {
+    char id[64];
+
+    snprintf(path, pathLen, "%s/%s/%s", Volume::SEC_ASECDIR_INT, POOL_DIR_NAME, file);
+    snprintf(id, sizeof(id), "%s-%s", ThinPool::POOL_NAME, file);
+
+    if (!Loop::lookupActive(id, loopDevice, len)) {
+        return 0;
+    }
+    // A zeroed metadata device is formatted by the pool on first use
+    if (access(path, F_OK) && Loop::createImageFile(path, mb * 2048)) {
+        return -1;
+    }
+    return Loop::create(id, path, loopDevice, len);
+}
+
+static int writeRef(const char *asecFile, unsigned int devId, unsigned long long numSectors) {
+    char sector[512];
+    memset(sector, 0, sizeof(sector));
+
+    struct asec_thin_ref *ref = (struct asec_thin_ref *) sector;
+    ref->magic = ASEC_THIN_MAGIC;
+    ref->dev_id = devId;
+    ref->num_sectors = numSectors;
+
+    int fd = open(asecFile, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        SLOGE("Unable to create %s (%s)", asecFile, strerror(errno));
+        return -1;
+    }
+    if (write(fd, sector, sizeof(sector)) != sizeof(sector) || fsync(fd)) {
+        int savedErrno = errno;
+        SLOGE("Unable to write %s (%s)", asecFile, strerror(errno));
+        close(fd);
+        unlink(asecFile);
+        errno = savedErrno;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Takes the next free device id for a new volume, or a snapshot of origin */
+static int allocateLocked(bool snapshot, unsigned int origin, unsigned int *devId) {
+    for (int i = 0; i < THIN_ALLOC_TRIES; i++) {
+        unsigned int id = sNextId;
+        sNextId = (sNextId + 1) & THIN_ID_MAX;
+
+        char msg[64];
+        if (snapshot) {
+            snprintf(msg, sizeof(msg), "create_snap %u %u", id, origin);
+        } else {
+            snprintf(msg, sizeof(msg), "create_thin %u", id);
+        }
+        if (!Devmapper::message(ThinPool::POOL_NAME, msg)) {
+            *devId = id;
+            return 0;
+        }
+        // Ids whose references were lost are still taken; skip them
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+static int deleteLocked(unsigned int devId) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "delete %u", devId);
+    return Devmapper::message(ThinPool::POOL_NAME, msg);
+}
+
+/* Continues id allocation after the highest id in use */
+static void scanNextIdLocked() {
+    DIR *d = opendir(Volume::SEC_ASECDIR_INT);
+    if (!d) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char path[PATH_MAX];
+        unsigned int devId;
+        size_t len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || len <= 5 || strcmp(de->d_name + len - 5, ".asec")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", Volume::SEC_ASECDIR_INT, de->d_name);
+        if (ThinPool::isThinImage(path, &devId) && devId >= sNextId) {
+            sNextId = (devId + 1) & THIN_ID_MAX;
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * The pool's files live on /data. Until the real /data is mounted they
+ * would land on the tmpfs FDE puts there while it waits for the password,
+ * and their loop devices would keep cryptfs_restart from unmounting it.
+ */
+static bool dataIsReady() {
+    struct statfs sfs;
+    return !statfs("/data", &sfs) && sfs.f_type != TMPFS_MAGIC && sfs.f_type != RAMFS_MAGIC;
+}
+
+/* Reads used/total data blocks off the pool's status line */
+static int poolUsageLocked(unsigned long long *used, unsigned long long *total) {
+    char status[256];
+    if (Devmapper::tableStatus(ThinPool::POOL_NAME, status, sizeof(status))) {
+        return -1;
+    }
+    // <transaction id> <used>/<total metadata blocks> <used>/<total data blocks> ...
+    if (sscanf(status, "%*u %*u/%*u %llu/%llu", used, total) != 2) {
+        SLOGE("Unexpected thin pool status \"%s\"", status);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned long long lowWaterBlocks(unsigned long long totalBlocks) {
+    return totalBlocks * ThinPool::LOW_WATER_PERCENT / 100;
+}
+
+/*
+ * dm-thin raises an event when free space drops below the low water mark
+ * (and when it runs out). Nothing can grow the pool's file behind the
+ * admin's back, so the event is reported; createImage() already sends new
+ * containers to image files from that point on.
+ */
+static void *watchPool(void *arg) {
+    unsigned int eventNr;
+    if (Devmapper::eventCount(ThinPool::POOL_NAME, &eventNr)) {
+        SLOGE("Unable to watch thin pool (%s)", strerror(errno));
+        return NULL;
+    }
+
+    while (!Devmapper::waitEvent(ThinPool::POOL_NAME, &eventNr)) {
+        unsigned long long used, total;
+        {
+            android::Mutex::Autolock lock(sLock);
+            if (poolUsageLocked(&used, &total)) {
+                continue;
+            }
+        }
+        if (used >= total) {
+            SLOGE("Thin ASEC pool is out of space; writes to thin containers fail");
+        } else if (total - used <= lowWaterBlocks(total)) {
+            SLOGW("Thin ASEC pool is low on space (%llu of %llu blocks free); "
+                  "new containers use image files", total - used, total);
+        }
+    }
+    SLOGW("Stopped watching thin pool (%s)", strerror(errno));
+    return NULL;
+}
+
+static int startPoolLocked() {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s", Volume::SEC_ASECDIR_INT, POOL_DIR_NAME);
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        SLOGE("Unable to create %s (%s); using image files", dir, strerror(errno));
+        return -1;
+    }
+
+    if (Devmapper::lookupActive(ThinPool::POOL_NAME, sPoolDevice, sizeof(sPoolDevice))) {
+        char metaPath[PATH_MAX];
+        char dataPath[PATH_MAX];
+        char metaLoop[255];
+        char dataLoop[255];
+        struct stat st;
+
+        if (attachPoolFile("metadata", ThinPool::METADATA_MB, metaPath, sizeof(metaPath),
+                           metaLoop, sizeof(metaLoop))) {
+            SLOGE("Unable to attach thin pool metadata (%s); using image files", strerror(errno));
+            return -1;
+        }
+        if (attachPoolFile("data", sPoolMb, dataPath, sizeof(dataPath),
+                           dataLoop, sizeof(dataLoop)) || stat(dataPath, &st)) {
+            SLOGE("Unable to attach thin pool data (%s); using image files", strerror(errno));
+            Loop::destroyByDevice(metaLoop);
+            return -1;
+        }
+
+        // The data file keeps the size it was created with
+        unsigned long long dataSectors =
+                (st.st_size / 512) / ThinPool::BLOCK_SECTORS * ThinPool::BLOCK_SECTORS;
+        unsigned long long lowWater = lowWaterBlocks(dataSectors / ThinPool::BLOCK_SECTORS);
+
+        // Without error_if_no_space, writes to a full pool hang instead of failing
+        unsigned int version[3];
+        bool errorIfNoSpace = !Devmapper::targetVersion("thin-pool", version) &&
+                (version[0] > 1 || (version[0] == 1 && version[1] >= 10));
+        if (!errorIfNoSpace) {
+            SLOGW("dm-thin-pool lacks error_if_no_space; a full pool blocks its writers");
+        }
+
+        /*
+         * Discards from the containers free blocks in the pool. Passed on,
+         * they would punch holes in the data file and undo its allocation.
+         */
+        char params[600];
+        snprintf(params, sizeof(params), "%s %s %u %llu %s", metaLoop, dataLoop,
+                 ThinPool::BLOCK_SECTORS, lowWater,
+                 errorIfNoSpace ? "2 error_if_no_space no_discard_passdown"
+                                : "1 no_discard_passdown");
+        if (Devmapper::createTarget(ThinPool::POOL_NAME, "thin-pool", params, dataSectors,
+                                    sPoolDevice, sizeof(sPoolDevice))) {
+            SLOGE("Unable to start thin pool (%s); using image files", strerror(errno));
+            Loop::destroyByDevice(dataLoop);
+            Loop::destroyByDevice(metaLoop);
+            return -1;
+        }
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, watchPool, NULL)) {
+        SLOGW("Unable to start thin pool watcher (%s)", strerror(errno));
+    }
+    pthread_attr_destroy(&attr);
+
+    scanNextIdLocked();
+    SLOGI("Thin ASEC pool ready on %s", sPoolDevice);
+    return 0;
+}
+
+/* Sets the pool up on first use once /data allows it; true if it is up */
+static bool ensureStartedLocked() {
+    if (sWanted && dataIsReady()) {
+        sWanted = false;
+        sEnabled = !startPoolLocked();
+    }
+    return sEnabled;
+}
+
+int ThinPool::start() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("ro.vold.asec_thin", value, "0");
+    if (strcmp(value, "1")) {
+        return 0;
+    }
+    property_get("ro.vold.asec_thin_mb", value, "");
+
+    android::Mutex::Autolock lock(sLock);
+    sPoolMb = atoi(value) > 0 ? atoi(value) : DEFAULT_POOL_MB;
+    sWanted = true;
+    return 0;
+}
+
+int ThinPool::usage(unsigned long long *usedBytes, unsigned long long *totalBytes) {
+    android::Mutex::Autolock lock(sLock);
+    unsigned long long used, total;
+    if (!sEnabled) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (poolUsageLocked(&used, &total)) {
+        return -1;
+    }
+    *usedBytes = used * BLOCK_SECTORS * 512;
+    *totalBytes = total * BLOCK_SECTORS * 512;
+    return 0;
+}
+
+bool ThinPool::isEnabled() {
+    android::Mutex::Autolock lock(sLock);
+    return ensureStartedLocked();
+}
+
+bool ThinPool::isThinImage(const char *asecFile, unsigned int *devId,
+                           unsigned long long *numSectors) {
+    struct asec_thin_ref ref;
+    struct stat st;
+
+    int fd = open(asecFile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    // Real images are at least 1MB plus their superblock
+    bool thin = !fstat(fd, &st) && st.st_size == 512 &&
+            read(fd, &ref, sizeof(ref)) == sizeof(ref) && ref.magic == ASEC_THIN_MAGIC;
+    close(fd);
+
+    if (thin) {
+        if (devId) {
+            *devId = ref.dev_id;
+        }
+        if (numSectors) {
+            *numSectors = ref.num_sectors;
+        }
+    }
+    return thin;
+}
+
+int ThinPool::createImage(const char *asecFile, unsigned long long numSectors) {
+    android::Mutex::Autolock lock(sLock);
+
+    if (!ensureStartedLocked()) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    // Room for all of the new volume, on top of the low water reserve
+    unsigned long long used, total;
+    if (poolUsageLocked(&used, &total)) {
+        return -1;
+    }
+    unsigned long long needed = (numSectors + BLOCK_SECTORS - 1) / BLOCK_SECTORS;
+    if (used + needed + lowWaterBlocks(total) > total) {
+        SLOGW("Thin pool has %llu of %llu blocks free; %llu wanted", total - used, total, needed);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    unsigned int devId;
+    if (allocateLocked(false, 0, &devId)) {
+        SLOGE("Unable to allocate thin volume (%s)", strerror(errno));
+        return -1;
+    }
+    if (writeRef(asecFile, devId, numSectors)) {
+        int savedErrno = errno;
+        deleteLocked(devId);
+        errno = savedErrno;
+        return -1;
+    }
+    return 0;
+}
+
+int ThinPool::activate(const char *asecFile, const char *name, char *buffer, size_t len) {
+    unsigned int devId;
+    unsigned long long numSectors;
+    char thin[64];
+
+    if (!isThinImage(asecFile, &devId, &numSectors)) {
+        errno = EINVAL;
+        return -1;
+    }
+    thinName(name, thin, sizeof(thin));
+    if (!Devmapper::lookupActive(thin, buffer, len)) {
+        return 0;
+    }
+
+    android::Mutex::Autolock lock(sLock);
+    if (!ensureStartedLocked()) {
+        SLOGE("%s is thin-provisioned but the pool is unavailable", asecFile);
+        errno = ENODEV;
+        return -1;
+    }
+
+    char params[300];
+    snprintf(params, sizeof(params), "%s %u", sPoolDevice, devId);
+    return Devmapper::createTarget(thin, "thin", params, numSectors, buffer, len);
+}
+
+int ThinPool::deactivate(const char *name) {
+    char thin[64];
+    char device[255];
+
+    thinName(name, thin, sizeof(thin));
+    if (Devmapper::lookupActive(thin, device, sizeof(device))) {
+        return 0;
+    }
+    return Devmapper::destroy(thin);
+}
+
+int ThinPool::destroyImage(const char *asecFile, const char *name) {
+    unsigned int devId;
+
+    if (!isThinImage(asecFile, &devId)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (name && deactivate(name)) {
+        return -1;
+    }
+
+    android::Mutex::Autolock lock(sLock);
+    if (!ensureStartedLocked()) {
+        SLOGE("Can't free %s without the thin pool", asecFile);
+        errno = ENODEV;
+        return -1;
+    }
+    // A dangling reference could alias a reused id; leaking blocks can't
+    if (unlink(asecFile)) {
+        return -1;
+    }
+    if (deleteLocked(devId)) {
+        SLOGW("Thin volume %u of %s is leaked", devId, asecFile);
+    }
+    return 0;
+}
+
+int ThinPool::snapshotImage(const char *asecFile, const char *name, const char *snapFile) {
+    unsigned int origin;
+    unsigned long long numSectors;
+    char thin[64];
+    char device[255];
+
+    if (!isThinImage(asecFile, &origin, &numSectors)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    android::Mutex::Autolock lock(sLock);
+    if (!ensureStartedLocked()) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    // A snapshot starts out sharing everything, but shouldn't eat the reserve
+    unsigned long long used, total;
+    if (poolUsageLocked(&used, &total)) {
+        return -1;
+    }
+    if (used + lowWaterBlocks(total) >= total) {
+        SLOGW("Thin pool is low on space; not taking a snapshot");
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // The pool wants the origin quiesced while the snapshot is taken
+    thinName(name, thin, sizeof(thin));
+    bool active = !Devmapper::lookupActive(thin, device, sizeof(device));
+    if (active && Devmapper::setSuspended(thin, true)) {
+        return -1;
+    }
+
+    unsigned int devId;
+    int rc = allocateLocked(true, origin, &devId);
+    int savedErrno = errno;
+
+    if (active) {
+        Devmapper::setSuspended(thin, false);
+    }
+    if (rc) {
+        errno = savedErrno;
+        return -1;
+    }
+
+    if (writeRef(snapFile, devId, numSectors)) {
+        savedErrno = errno;
+        deleteLocked(devId);
+        errno = savedErrno;
+        return -1;
+    }
+    return 0;
+}
+
+int ThinPool::rename(const char *name, const char *newName) {
+    char thin[64];
+    char newThin[64];
+    char device[255];
+
+    thinName(name, thin, sizeof(thin));
+    thinName(newName, newThin, sizeof(newThin));
+    if (Devmapper::lookupActive(thin, device, sizeof(device))) {
+        return 0;
+    }
+    if (Devmapper::rename(thin, newThin)) {
+        return -1;
+    }
+    ContainerRegistry::rename(thin, newThin, "", "");
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _THINPOOL_H
+#define _THINPOOL_H
+
+#include <unistd.h>
+
+/*
+ * Optional backend that carves internal ASECs out of one dm-thin pool
+ * instead of giving each a fully sized image file. Enabled with
+ * ro.vold.asec_thin=1; the pool's metadata and data live in files under
+ * the internal ASEC directory, ro.vold.asec_thin_mb big (data), allocated
+ * in full when the pool is first set up.
+ * The pool is set up on first use once the real /data is mounted.
+ *
+ * New containers need their full size free in the pool, above a low
+ * water reserve; otherwise they fall back to image files. A full pool
+ * fails writes rather than blocking them where the kernel allows it.
+ *
+ * A thin ASEC's loop device is bound to its thin volume rather than to an
+ * image file, and carries the superblock as usual. dm-crypt and the
+ * filesystem sit on the thin volume directly, so that trims free blocks
+ * in the pool.
+ */
+class ThinPool {
+public:
+    static const char *POOL_NAME;
+    static const unsigned int DEFAULT_POOL_MB = 2048;
+    static const unsigned int METADATA_MB = 16;
+    /* Allocation unit, in sectors */
+    static const unsigned int BLOCK_SECTORS = 128;
+    /* Share of the pool kept free for the volumes already in it */
+    static const unsigned int LOW_WATER_PERCENT = 10;
+
+    /*
+     * Reads the configuration. The pool is set up, or reattached to one a
+     * previous instance left, by the first call that needs it.
+     */
+    static int start();
+    static bool isEnabled();
+    /* Bytes of the pool's data in use, and its size */
+    static int usage(unsigned long long *usedBytes, unsigned long long *totalBytes);
+
+    /* True if asecFile is a thin ASEC's reference rather than an image */
+    static bool isThinImage(const char *asecFile, unsigned int *devId = NULL,
+                            unsigned long long *numSectors = NULL);
+
+    /* Allocates a thin volume of numSectors and writes its reference */
+    static int createImage(const char *asecFile, unsigned long long numSectors);
+
+    /*
+     * Makes asecFile's volume available as a block device for the
+     * container whose id hash is name; it stays active until deactivate().
+     */
+    static int activate(const char *asecFile, const char *name, char *buffer, size_t len);
+    static int deactivate(const char *name);
+
+    /* Frees the volume and removes the reference */
+    static int destroyImage(const char *asecFile, const char *name);
+
+    /*
+     * Shares asecFile's blocks copy-on-write with a new container at
+     * snapFile. Taken while the origin is in use, the snapshot is
+     * crash-consistent.
+     */
+    static int snapshotImage(const char *asecFile, const char *name, const char *snapFile);
+
+    /* Follows a container's id hash from name to newName */
+    static int rename(const char *name, const char *newName);
+};
+
+#endif
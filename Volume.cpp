@@ -19,6 +19,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -52,8 +53,21 @@
 #include "Exfat.h"
 // MStar Android Patch End
 #include "Process.h"
+#include "SpaceReclaimer.h"
 #include "cryptfs.h"
 
+// MStar Android Patch Begin
+/*
+ * How long doUnmount() waits for holders to exit: on their own before the
+ * first retry, then per SIGTERM and per SIGKILL round when forced.
+ */
+#define UNMOUNT_GRACE_MS        5000
+#define UNMOUNT_KILL_WAIT_MS    2000
+#define UNMOUNT_KILL_RETRIES    5
+/* Pause between retries when nobody visibly holds the mount */
+#define UNMOUNT_IDLE_SLEEP_MS   250
+// MStar Android Patch End
+
 extern "C" void dos_partition_dec(void const *pp, struct dos_partition *d);
 extern "C" void dos_partition_enc(void *pp, struct dos_partition *d);
 
@@ -678,6 +692,9 @@ int Volume::mountAsecExternal() {
                 SEC_ASECDIR_EXT, strerror(errno));
         return -1;
     }
+
+    // Images deleted off this card before it last went away
+    SpaceReclaimer::queueDir(SEC_ASECDIR_EXT);
     // MStar Android Patch End
 
     return 0;
@@ -685,7 +702,8 @@ int Volume::mountAsecExternal() {
 
 int Volume::doUnmount(const char *path, bool force) {
     // MStar Android Patch Begin
-    int retries = 1;
+    int retries;
+    int holders = 0;
 
     if (mDebug) {
         SLOGD("Unmounting {%s}, force = %d", path, force);
@@ -696,23 +714,28 @@ int Volume::doUnmount(const char *path, bool force) {
         return 0;
     }
 
-    while (retries--) {
-        SLOGW("Failed to unmount %s (%s, retries %d)",
-                path, strerror(errno), retries);
-        usleep(5000*1000);
-        if (!umount(path) || errno == EINVAL || errno == ENOENT) {
-            SLOGI("%s sucessfully unmounted", path);
-            return 0;
-        }
+    /*
+     * Give the holders a chance to let go on their own, and retry the
+     * moment the last of them has exited.
+     */
+    SLOGW("Failed to unmount %s (%s), waiting for holders", path, strerror(errno));
+    Process::signalHoldersAndWait(path, 0, UNMOUNT_GRACE_MS, false, &holders);
+    if (!holders) {
+        usleep(UNMOUNT_IDLE_SLEEP_MS * 1000);
+    }
+    if (!umount(path) || errno == EINVAL || errno == ENOENT) {
+        SLOGI("%s sucessfully unmounted", path);
+        return 0;
     }
 
     if (force) {
-        retries = 20;
+        retries = UNMOUNT_KILL_RETRIES;
         while (retries--) {
             SLOGW("Kill all processes that have opened the file on the disk %s, retries %i", path, retries);
-            Process::killProcessesWithOpenFiles(path, 1);
-            Process::killProcessesWithOpenFiles(path, 2);
-            usleep(2000*1000);
+            Process::signalHoldersAndWait(path, SIGTERM, UNMOUNT_KILL_WAIT_MS, true, &holders);
+            if (!holders) {
+                usleep(UNMOUNT_IDLE_SLEEP_MS * 1000);
+            }
 
             if (!umount(path) || errno == EINVAL || errno == ENOENT) {
                 SLOGI("%s sucessfully unmounted", path);
@@ -812,6 +835,61 @@ out_nomedia:
     // MStar Android Patch End
 }
 
+// MStar Android Patch Begin
+/*
+ * Surprise removal: the media is already gone, so there is nothing to
+ * flush and no point in waiting for holders. Detach the mount tree right
+ * away and leave container teardown and holder cleanup to the
+ * VolumeManager's background worker.
+ */
+int Volume::detachVol() {
+    bool providesAsec = (getFlags() & VOL_PROVIDES_ASEC) != 0;
+    dev_t dev;
+    int rootFd = -1;
+
+    if (getState() != Volume::State_Mounted) {
+        SLOGE("Volume %s detach request when not mounted", getLabel());
+        errno = EINVAL;
+        return UNMOUNT_NOT_MOUNTED_ERR;
+    }
+
+    // Needed to find holders once the mountpoint no longer resolves
+    if (Process::getMountDevice(getMountpoint(), &dev)) {
+        SLOGW("Failed to get device of %s (%s)", getMountpoint(), strerror(errno));
+    } else if ((rootFd = open(getMountpoint(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        SLOGW("Failed to open %s (%s)", getMountpoint(), strerror(errno));
+    }
+
+    setState(Volume::State_Unmounting);
+
+    char service[64];
+    snprintf(service, 64, "fuse_%s", getLabel());
+    property_set("ctl.stop", service);
+
+    if (providesAsec && umount2(Volume::SEC_ASECDIR_EXT, MNT_DETACH) &&
+            errno != EINVAL && errno != ENOENT) {
+        SLOGW("Failed to detach %s (%s)", Volume::SEC_ASECDIR_EXT, strerror(errno));
+    }
+
+    if (umount2(getMountpoint(), MNT_DETACH) && errno != EINVAL && errno != ENOENT) {
+        SLOGE("Failed to detach %s (%s)", getMountpoint(), strerror(errno));
+        if (rootFd >= 0) {
+            close(rootFd);
+        }
+        setState(Volume::State_Mounted);
+        return -1;
+    }
+    SLOGI("%s detached", getMountpoint());
+
+    // Once idle the mountpoint can take new media; pin down what was ours first
+    mVm->queueDetachedCleanup(getMountpoint(), getFuseMountpoint(), rootFd);
+
+    mCurrentlyMountedKdev = -1;
+    setState(Volume::State_Idle);
+    return 0;
+}
+// MStar Android Patch End
+
 int Volume::initializeMbr(const char *deviceNode) {
     struct disk_info dinfo;
 
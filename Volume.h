@@ -78,6 +78,9 @@ public:
 
     int mountVol();
     int unmountVol(bool force, bool revert);
+    // MStar Android Patch Begin
+    int detachVol();
+    // MStar Android Patch End
     int formatVol(bool wipe);
 
     const char* getLabel() { return mLabel; }
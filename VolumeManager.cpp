@@ -19,13 +19,18 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fts.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mount.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <limits.h>
 #include <dirent.h>
 
+#include <linux/fs.h>
 #include <linux/kdev_t.h>
 
 #define LOG_TAG "Vold"
@@ -34,6 +39,12 @@
 
 #include <cutils/fs.h>
 #include <cutils/log.h>
+#include <hardware_legacy/power.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/SortedVector.h>
+#include <utils/String8.h>
+#include <utils/Vector.h>
 
 #include <sysutils/NetlinkEvent.h>
 
@@ -50,6 +61,13 @@
 #include "DirectVolume.h"
 #include "ResponseCode.h"
 #include "Loop.h"
+#include "ContainerRegistry.h"
+#include "BlockNode.h"
+#include "AsecIndex.h"
+#include "ContainerLocks.h"
+#include "SpaceReclaimer.h"
+#include "ThinPool.h"
+#include "IsoCache.h"
 #include "Ext4.h"
 #include "Fat.h"
 // MStar Android Patch Begin
@@ -81,6 +99,9 @@ VolumeManager::VolumeManager() {
     // set dirty ratio to 0 when UMS is active
     mUmsDirtyRatio = 0;
     mVolManagerDisabled = 0;
+    // MStar Android Patch Begin
+    mDetachedThreadStarted = false;
+    // MStar Android Patch End
 }
 
 VolumeManager::~VolumeManager() {
@@ -133,6 +154,16 @@ void VolumeManager::setDebug(bool enable) {
 }
 
 int VolumeManager::start() {
+    // MStar Android Patch Begin
+    // Pick up loop/dm devices left behind by a previous instance
+    ContainerRegistry::rebuild();
+    Loop::startPool();
+    AsecIndex::start();
+    SpaceReclaimer::start();
+    ThinPool::start();
+    IsoCache::start();
+    adoptActiveContainers();
+    // MStar Android Patch End
     return 0;
 }
 
@@ -1056,13 +1087,66 @@ int VolumeManager::getAsecFilesystemPath(const char *id, char *buffer, int maxle
     return 0;
 }
 
+// MStar Android Patch Begin
+/* What an ASEC's loop device binds to: its image, or its thin volume */
+static int asecBackingFile(const char *asecFileName, const char *idHash,
+                           char *buffer, size_t len) {
+    if (!ThinPool::isThinImage(asecFileName)) {
+        strlcpy(buffer, asecFileName, len);
+        return 0;
+    }
+    return ThinPool::activate(asecFileName, idHash, buffer, len);
+}
+
+/*
+ * What dm-crypt, or the filesystem of a container without a key, goes
+ * on. For a thin ASEC that is the thin volume itself rather than the loop
+ * device bound to it, which is only kept for the superblock and the
+ * bookkeeping: older kernels' loop driver drops discards on a block device
+ * backing, and a trim has to reach the pool to give blocks back.
+ */
+static int asecBlockDevice(const char *asecFileName, const char *idHash,
+                           const char *loopDevice, char *buffer, size_t len) {
+    if (!ThinPool::isThinImage(asecFileName)) {
+        strlcpy(buffer, loopDevice, len);
+        return 0;
+    }
+    return ThinPool::activate(asecFileName, idHash, buffer, len);
+}
+
+static void destroyAsecLoop(const char *loopDevice, const char *idHash) {
+    Loop::destroyByDevice(loopDevice);
+    ThinPool::deactivate(idHash);
+}
+
+/* Undoes a new ASEC's image; idHash is NULL if nothing was activated */
+static void removeAsecImage(const char *asecFileName, const char *idHash) {
+    if (ThinPool::isThinImage(asecFileName)) {
+        ThinPool::destroyImage(asecFileName, idHash);
+    } else {
+        unlink(asecFileName);
+    }
+}
+
+/* Image size, superblock excluded, that holds numSectors of container */
+static unsigned int asecImageSectors(unsigned int numSectors) {
+    /*
+     * Add some headroom
+     */
+    unsigned fatSize = (((numSectors * 4) / 512) + 1) * 2;
+    unsigned numImgSectors = numSectors + fatSize + 2;
+
+    if (numImgSectors % 63) {
+        numImgSectors += (63 - (numImgSectors % 63));
+    }
+    return numImgSectors;
+}
+// MStar Android Patch End
+
 int VolumeManager::createAsec(const char *id, unsigned int numSectors, const char *fstype,
-        const char *key, const int ownerUid, bool isExternal) {
+        const char *key, const int ownerUid, bool isExternal, int imageFlags) {
     struct asec_superblock sb;
     memset(&sb, 0, sizeof(sb));
-    // MStar Android Patch Begin
-    Mutex::Autolock lock(mVolumesLock);
-    // MStar Android Patch End
 
     if (!isLegalAsecId(id)) {
         SLOGE("createAsec: Invalid asec id \"%s\"", id);
@@ -1084,7 +1168,10 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
     }
 
     sb.magic = ASEC_SB_MAGIC;
-    sb.ver = ASEC_SB_VER;
+    // MStar Android Patch Begin
+    // Unencrypted containers keep the v1 layout; see Devmapper::selectCipher()
+    sb.ver = ASEC_SB_VER_1;
+    // MStar Android Patch End
 
     if (numSectors < ((1024*1024)/512)) {
         SLOGE("Invalid container size specified (%d sectors)", numSectors);
@@ -1092,7 +1179,15 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
         return -1;
     }
 
-    if (lookupVolume(id)) {
+    // MStar Android Patch Begin
+    // Only the lookup needs the volumes; formatting below must not hold them
+    bool isVolume;
+    {
+        Mutex::Autolock lock(mVolumesLock);
+        isVolume = lookupVolume(id) != NULL;
+    }
+    if (isVolume) {
+    // MStar Android Patch End
         SLOGE("ASEC id '%s' currently exists", id);
         errno = EADDRINUSE;
         return -1;
@@ -1122,18 +1217,26 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
         return -1;
     }
 
-    /*
-     * Add some headroom
-     */
-    unsigned fatSize = (((numSectors * 4) / 512) + 1) * 2;
-    unsigned numImgSectors = numSectors + fatSize + 2;
-
-    if (numImgSectors % 63) {
-        numImgSectors += (63 - (numImgSectors % 63));
-    }
+    // MStar Android Patch Begin
+    unsigned numImgSectors = asecImageSectors(numSectors);
+    // Space still held by destroyed images counts as free here
+    SpaceReclaimer::makeRoom(asecDir, ((off64_t) numImgSectors + 1) * 512);
+    // MStar Android Patch End
 
     // Add +1 for our superblock which is at the end
-    if (Loop::createImageFile(asecFileName, numImgSectors + 1)) {
+    // MStar Android Patch Begin
+    // Internal containers come out of the thin pool when it has room
+    bool thin = !isExternal && ThinPool::isEnabled();
+    if (thin && ThinPool::createImage(asecFileName, numImgSectors + 1)) {
+        if (errno != ENOSPC) {
+            SLOGE("ASEC thin volume creation failed (%s)", strerror(errno));
+            return -1;
+        }
+        SLOGI("Thin pool can't hold %s; using an image file", id);
+        thin = false;
+    }
+    if (!thin && Loop::createImageFile(asecFileName, numImgSectors + 1, imageFlags)) {
+    // MStar Android Patch End
         SLOGE("ASEC image file creation failed (%s)", strerror(errno));
         return -1;
     }
@@ -1141,34 +1244,63 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
     char idHash[33];
     if (!asecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
-        unlink(asecFileName);
+        // MStar Android Patch Begin
+        removeAsecImage(asecFileName, NULL);
+        // MStar Android Patch End
         return -1;
     }
 
     char loopDevice[255];
-    if (Loop::create(idHash, asecFileName, loopDevice, sizeof(loopDevice))) {
+    // MStar Android Patch Begin
+    char backingFile[255];
+    if (asecBackingFile(asecFileName, idHash, backingFile, sizeof(backingFile)) ||
+            Loop::create(idHash, backingFile, loopDevice, sizeof(loopDevice))) {
+    // MStar Android Patch End
         SLOGE("ASEC loop device creation failed (%s)", strerror(errno));
-        unlink(asecFileName);
+        // MStar Android Patch Begin
+        removeAsecImage(asecFileName, idHash);
+        // MStar Android Patch End
         return -1;
     }
 
     char dmDevice[255];
     bool cleanupDm = false;
+    // MStar Android Patch Begin
+    char blockDevice[255];
+    if (asecBlockDevice(asecFileName, idHash, loopDevice, blockDevice, sizeof(blockDevice))) {
+        SLOGE("ASEC thin volume lookup failed (%s)", strerror(errno));
+        Loop::destroyByDevice(loopDevice);
+        removeAsecImage(asecFileName, idHash);
+        return -1;
+    }
+    // MStar Android Patch End
 
     if (strcmp(key, "none")) {
-        // XXX: This is all we support for now
-        sb.c_cipher = ASEC_SB_C_CIPHER_TWOFISH;
-        if (Devmapper::create(idHash, loopDevice, key, numImgSectors, dmDevice,
-                             sizeof(dmDevice))) {
+        // MStar Android Patch Begin
+        Devmapper::selectCipher(&sb);
+        int rc = Devmapper::create(idHash, blockDevice, key, numImgSectors, dmDevice,
+                                   sizeof(dmDevice), Devmapper::cipherSpec(&sb));
+        if (rc && sb.c_cipher == ASEC_SB_C_CIPHER_ADIANTUM) {
+            SLOGW("Adiantum unavailable, falling back to AES-XTS");
+            Devmapper::selectCipher(&sb, false);
+            rc = Devmapper::create(idHash, blockDevice, key, numImgSectors, dmDevice,
+                                   sizeof(dmDevice), Devmapper::cipherSpec(&sb));
+        }
+        if (rc) {
+        // MStar Android Patch End
             SLOGE("ASEC device mapping failed (%s)", strerror(errno));
             Loop::destroyByDevice(loopDevice);
-            unlink(asecFileName);
+            // MStar Android Patch Begin
+            removeAsecImage(asecFileName, idHash);
+            // MStar Android Patch End
             return -1;
         }
         cleanupDm = true;
     } else {
         sb.c_cipher = ASEC_SB_C_CIPHER_NONE;
-        strcpy(dmDevice, loopDevice);
+        // MStar Android Patch Begin
+        strcpy(dmDevice, blockDevice);
+        // MStar Android Patch End
     }
 
     /*
@@ -1182,7 +1314,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
             Devmapper::destroy(idHash);
         }
         Loop::destroyByDevice(loopDevice);
-        unlink(asecFileName);
+        // MStar Android Patch Begin
+        removeAsecImage(asecFileName, idHash);
+        // MStar Android Patch End
         return -1;
     }
 
@@ -1193,7 +1327,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
             Devmapper::destroy(idHash);
         }
         Loop::destroyByDevice(loopDevice);
-        unlink(asecFileName);
+        // MStar Android Patch Begin
+        removeAsecImage(asecFileName, idHash);
+        // MStar Android Patch End
         return -1;
     }
 
@@ -1204,7 +1340,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
             Devmapper::destroy(idHash);
         }
         Loop::destroyByDevice(loopDevice);
-        unlink(asecFileName);
+        // MStar Android Patch Begin
+        removeAsecImage(asecFileName, idHash);
+        // MStar Android Patch End
         return -1;
     }
     close(sbfd);
@@ -1220,7 +1358,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
                 Devmapper::destroy(idHash);
             }
             Loop::destroyByDevice(loopDevice);
-            unlink(asecFileName);
+            // MStar Android Patch Begin
+            removeAsecImage(asecFileName, idHash);
+            // MStar Android Patch End
             return -1;
         }
 
@@ -1236,7 +1376,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
                 Devmapper::destroy(idHash);
             }
             Loop::destroyByDevice(loopDevice);
-            unlink(asecFileName);
+            // MStar Android Patch Begin
+            removeAsecImage(asecFileName, idHash);
+            // MStar Android Patch End
             return -1;
         }
 
@@ -1247,7 +1389,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
                     Devmapper::destroy(idHash);
                 }
                 Loop::destroyByDevice(loopDevice);
-                unlink(asecFileName);
+                // MStar Android Patch Begin
+                removeAsecImage(asecFileName, idHash);
+                // MStar Android Patch End
                 return -1;
             }
         }
@@ -1266,9 +1410,14 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
                 Devmapper::destroy(idHash);
             }
             Loop::destroyByDevice(loopDevice);
-            unlink(asecFileName);
+            // MStar Android Patch Begin
+            removeAsecImage(asecFileName, idHash);
+            // MStar Android Patch End
             return -1;
         }
+        // MStar Android Patch Begin
+        ContainerRegistry::setMountPoint(idHash, mountPoint);
+        // MStar Android Patch End
 
         if (usingExt4) {
             int dirfd = open(mountPoint, O_DIRECTORY);
@@ -1284,7 +1433,13 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
         SLOGI("Created raw secure container %s (no filesystem)", id);
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
+    // MStar Android Patch Begin
+    // Don't wait for inotify; finalize usually follows right away
+    AsecIndex::update(asecFileName);
+    char mountPoint[255];
+    snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
+    addActiveContainer(id, ASEC, wantFilesystem ? mountPoint : NULL, loopDevice, ownerUid);
+    // MStar Android Patch End
     return 0;
 }
 
@@ -1346,6 +1501,179 @@ int VolumeManager::finalizeAsec(const char *id) {
     return 0;
 }
 
+// MStar Android Patch Begin
+#define FIXUP_THREADS_MAX 4
+/* Beyond this many queued directories, workers walk subtrees themselves */
+#define FIXUP_QUEUE_MAX 64
+
+struct FixupWalk {
+    gid_t gid;
+    const char *privateName;
+    dev_t dev;
+    /* Open directory fds waiting for a worker */
+    int queue[FIXUP_QUEUE_MAX];
+    int queued;
+    int busy;
+    int changed;
+    int unchanged;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * Gives one entry the ownership and mode fixupAsecPermissions() wants,
+ * touching it only when it differs. Returns 1 if changed, 0 if it was
+ * already right, -1 on error.
+ */
+static int fixupEntry(int dirfd, const char *name, const struct stat *st,
+        uid_t uid, gid_t gid, mode_t mode) {
+    bool wrongOwner = st->st_uid != uid || st->st_gid != gid;
+    bool wrongMode = !S_ISLNK(st->st_mode) && (st->st_mode & 07777) != mode;
+
+    if (!wrongOwner && !wrongMode) {
+        return 0;
+    }
+
+    if (S_ISLNK(st->st_mode)) {
+        if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW)) {
+            SLOGE("Couldn't chown link %s: %s", name, strerror(errno));
+            return -1;
+        }
+        return 1;
+    }
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Couldn't open file %s: %s", name, strerror(errno));
+        return -1;
+    }
+    int rc = 0;
+    if (wrongOwner && fchown(fd, uid, gid)) {
+        rc = -1;
+    }
+    if (wrongMode && fchmod(fd, mode)) {
+        rc = -1;
+    }
+    if (rc) {
+        SLOGE("Couldn't fix permissions of %s: %s", name, strerror(errno));
+    }
+    close(fd);
+    return rc ? -1 : 1;
+}
+
+static void fixupCount(FixupWalk *walk, int rc) {
+    pthread_mutex_lock(&walk->lock);
+    if (rc < 0) {
+        walk->failed++;
+    } else if (rc) {
+        walk->changed++;
+    } else {
+        walk->unchanged++;
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/* Fixes up everything below dirfd, which it closes */
+static void fixupDirectory(FixupWalk *walk, int dirfd) {
+    DIR *d = fdopendir(dirfd);
+    if (!d) {
+        SLOGE("Couldn't read directory: %s", strerror(errno));
+        close(dirfd);
+        fixupCount(walk, -1);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            SLOGE("Couldn't stat %s: %s", de->d_name, strerror(errno));
+            fixupCount(walk, -1);
+            continue;
+        }
+
+        // We don't care about the lost+found directory itself.
+        if (strcmp(de->d_name, "lost+found")) {
+            /*
+             * There can only be one file marked as private right now.
+             * This should be more robust, but it satisfies the requirements
+             * we have for right now.
+             */
+            const bool privateFile = !strcmp(de->d_name, walk->privateName);
+            mode_t mode = S_ISDIR(st.st_mode) ? 0755 : (privateFile ? 0640 : 0644);
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                // Only the owner of anything else is ours to fix
+                mode = st.st_mode & 07777;
+            }
+            fixupCount(walk, fixupEntry(dirfd, de->d_name, &st, AID_SYSTEM,
+                    privateFile ? walk->gid : AID_SYSTEM, mode));
+        }
+
+        if (!S_ISDIR(st.st_mode) || st.st_dev != walk->dev) {
+            continue;
+        }
+        int subfd = openat(dirfd, de->d_name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subfd < 0) {
+            SLOGE("Couldn't open directory %s: %s", de->d_name, strerror(errno));
+            fixupCount(walk, -1);
+            continue;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        if (walk->queued < FIXUP_QUEUE_MAX) {
+            walk->queue[walk->queued++] = subfd;
+            pthread_cond_signal(&walk->cond);
+            subfd = -1;
+        }
+        pthread_mutex_unlock(&walk->lock);
+        if (subfd >= 0) {
+            fixupDirectory(walk, subfd);
+        }
+    }
+    closedir(d);
+}
+
+static void *fixupWorker(void *arg) {
+    FixupWalk *walk = (FixupWalk *) arg;
+
+    pthread_mutex_lock(&walk->lock);
+    while (true) {
+        while (!walk->queued && walk->busy) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        if (!walk->queued) {
+            break;
+        }
+
+        int dirfd = walk->queue[--walk->queued];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        fixupDirectory(walk, dirfd);
+
+        pthread_mutex_lock(&walk->lock);
+        if (!--walk->busy) {
+            // Nothing left to produce more work; wake the idle workers
+            pthread_cond_broadcast(&walk->cond);
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+static long long elapsedMs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+// MStar Android Patch End
+
 int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* filename) {
     char asecFileName[255];
     char loopDevice[255];
@@ -1405,52 +1733,64 @@ int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* f
         return -1;
     }
 
-    char *paths[] = { mountPoint, NULL };
-
-    FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, NULL);
-    if (fts) {
-        // Traverse the entire hierarchy and chown to system UID.
-        for (FTSENT *ftsent = fts_read(fts); ftsent != NULL; ftsent = fts_read(fts)) {
-            // We don't care about the lost+found directory.
-            if (!strcmp(ftsent->fts_name, "lost+found")) {
-                continue;
-            }
-
-            /*
-             * There can only be one file marked as private right now.
-             * This should be more robust, but it satisfies the requirements
-             * we have for right now.
-             */
-            const bool privateFile = !strcmp(ftsent->fts_name, filename);
+    // MStar Android Patch Begin
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int rootfd = open(mountPoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat rootSt;
+    if (rootfd < 0 || fstat(rootfd, &rootSt)) {
+        SLOGE("Couldn't open %s: %s", mountPoint, strerror(errno));
+        if (rootfd >= 0) {
+            close(rootfd);
+        }
+        result |= -1;
+    } else {
+        FixupWalk walk;
+        memset(&walk, 0, sizeof(walk));
+        walk.gid = gid;
+        walk.privateName = filename;
+        walk.dev = rootSt.st_dev;
+        pthread_mutex_init(&walk.lock, NULL);
+        pthread_cond_init(&walk.cond, NULL);
 
-            int fd = open(ftsent->fts_accpath, O_NOFOLLOW);
-            if (fd < 0) {
-                SLOGE("Couldn't open file %s: %s", ftsent->fts_accpath, strerror(errno));
-                result = -1;
-                continue;
+        // Finally make the directory readable by everyone.
+        if (rootSt.st_uid != AID_SYSTEM || rootSt.st_gid != AID_SYSTEM ||
+                (rootSt.st_mode & 07777) != 0755) {
+            if (fchown(rootfd, AID_SYSTEM, AID_SYSTEM) || fchmod(rootfd, 0755)) {
+                SLOGE("Couldn't change owner of existing directory %s: %s",
+                        mountPoint, strerror(errno));
+                walk.failed++;
+            } else {
+                walk.changed++;
             }
+        } else {
+            walk.unchanged++;
+        }
 
-            result |= fchown(fd, AID_SYSTEM, privateFile? gid : AID_SYSTEM);
-
-            if (ftsent->fts_info & FTS_D) {
-                result |= fchmod(fd, 0755);
-            } else if (ftsent->fts_info & FTS_F) {
-                result |= fchmod(fd, privateFile ? 0640 : 0644);
+        walk.queue[walk.queued++] = rootfd;
+        pthread_t threads[FIXUP_THREADS_MAX - 1];
+        int started = 0;
+        for (; started < FIXUP_THREADS_MAX - 1; started++) {
+            if (pthread_create(&threads[started], NULL, fixupWorker, &walk)) {
+                SLOGW("Couldn't start fixup worker (%s)", strerror(errno));
+                break;
             }
-            close(fd);
         }
-        fts_close(fts);
+        fixupWorker(&walk);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_cond_destroy(&walk.cond);
+        pthread_mutex_destroy(&walk.lock);
 
-        // Finally make the directory readable by everyone.
-        int dirfd = open(mountPoint, O_DIRECTORY);
-        if (dirfd < 0 || fchmod(dirfd, 0755)) {
-            SLOGE("Couldn't change owner of existing directory %s: %s", mountPoint, strerror(errno));
+        SLOGI("ASEC %s permissions: %d changed, %d unchanged, %d failed in %lld ms",
+                id, walk.changed, walk.unchanged, walk.failed, elapsedMs(&start));
+        if (walk.failed) {
             result |= -1;
         }
-        close(dirfd);
-    } else {
-        result |= -1;
     }
+    // MStar Android Patch End
 
     result |= Ext4::doMount(loopDevice, mountPoint,
             true /* read-only */,
@@ -1468,66 +1808,328 @@ int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* f
     return 0;
 }
 
-int VolumeManager::renameAsec(const char *id1, const char *id2) {
-    char asecFilename1[255];
-    char *asecFilename2;
+// MStar Android Patch Begin
+/*
+ * Grows an ext4 container to hold numSectors, mounted or not. The image is
+ * extended and its superblock moved to the new tail before the loop and
+ * dm devices are told about the new size, so a failure part way leaves a
+ * container that still mounts, just with the old filesystem size.
+ */
+int VolumeManager::resizeAsec(const char *id, unsigned int numSectors, const char *key) {
+    char asecFileName[255];
     char mountPoint[255];
+    char loopDevice[255];
+    char dmDevice[255];
+    bool cleanupLoop = false;
+    bool cleanupDm = false;
+    int rc = -1;
 
-    const char *dir;
-
-    if (!isLegalAsecId(id1)) {
-        SLOGE("renameAsec: Invalid asec id1 \"%s\"", id1);
+    if (!isLegalAsecId(id)) {
+        SLOGE("resizeAsec: Invalid asec id \"%s\"", id);
         errno = EINVAL;
         return -1;
     }
 
-    if (!isLegalAsecId(id2)) {
-        SLOGE("renameAsec: Invalid asec id2 \"%s\"", id2);
-        errno = EINVAL;
+    if (findAsec(id, asecFileName, sizeof(asecFileName))) {
+        SLOGE("Couldn't find ASEC %s", id);
         return -1;
     }
 
-    if (findAsec(id1, asecFilename1, sizeof(asecFilename1), &dir)) {
-        SLOGE("Couldn't find ASEC %s", id1);
+    if (ThinPool::isThinImage(asecFileName)) {
+        SLOGE("Resizing thin-provisioned ASEC %s is not supported", id);
+        errno = ENOTSUP;
         return -1;
     }
 
-    asprintf(&asecFilename2, "%s/%s.asec", dir, id2);
+    char idHash[33];
+    if (!asecHash(id, idHash, sizeof(idHash))) {
+        SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
+        return -1;
+    }
 
-    int written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id1);
+    int written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
     if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
-        SLOGE("Rename failed: couldn't construct mountpoint");
-        goto out_err;
+        SLOGE("ASEC resize failed for %s: couldn't construct mountpoint", id);
+        return -1;
     }
+    const bool mounted = isMountpointMounted(mountPoint);
 
-    if (isMountpointMounted(mountPoint)) {
-        SLOGW("Rename attempt when src mounted");
-        errno = EBUSY;
-        goto out_err;
+    if (Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+        if (Loop::create(idHash, asecFileName, loopDevice, sizeof(loopDevice))) {
+            SLOGE("ASEC loop device creation failed (%s)", strerror(errno));
+            return -1;
+        }
+        cleanupLoop = true;
     }
 
-    written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id2);
-    if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
-        SLOGE("Rename failed: couldn't construct mountpoint2");
-        goto out_err;
+    unsigned int nr_sec = 0;
+    struct asec_superblock sb;
+    // A read error must not take down a loop device a mounted container is using
+    if (Loop::readInfo(loopDevice, &sb, &nr_sec)) {
+        if (cleanupLoop) {
+            int savedErrno = errno;
+            Loop::destroyByDevice(loopDevice);
+            errno = savedErrno;
+        }
+        return -1;
     }
 
-    if (isMountpointMounted(mountPoint)) {
-        SLOGW("Rename attempt when dst mounted");
-        errno = EBUSY;
-        goto out_err;
-    }
+    const unsigned int oldImgSectors = nr_sec - 1;
+    const unsigned int numImgSectors = asecImageSectors(numSectors);
+    const bool encrypted = sb.c_cipher != ASEC_SB_C_CIPHER_NONE;
+    const char *cipher = NULL;
 
-    if (!access(asecFilename2, F_OK)) {
-        SLOGE("Rename attempt when dst exists");
-        errno = EADDRINUSE;
-        goto out_err;
+    if (sb.magic != ASEC_SB_MAGIC || sb.ver < ASEC_SB_VER_1 || sb.ver > ASEC_SB_VER) {
+        SLOGE("Bad container magic/version (%.8x/%.2x)", sb.magic, sb.ver);
+        errno = EMEDIUMTYPE;
+        goto out;
     }
-
-    if (rename(asecFilename1, asecFilename2)) {
+    if (!(sb.c_opts & ASEC_SB_C_OPTS_EXT4)) {
+        // There is no FAT resizer to grow the filesystem with
+        SLOGE("ASEC %s is not ext4; only ext4 containers can be resized", id);
+        errno = ENOTSUP;
+        goto out;
+    }
+    if (encrypted && (!strcmp(key, "none") || !(cipher = Devmapper::cipherSpec(&sb)))) {
+        SLOGE("ASEC %s is encrypted; its key is needed to resize it", id);
+        errno = EINVAL;
+        goto out;
+    }
+    if (numImgSectors < oldImgSectors) {
+        SLOGE("ASEC %s can't shrink (%u -> %u sectors)", id, oldImgSectors, numImgSectors);
+        errno = EINVAL;
+        goto out;
+    }
+    if (numImgSectors == oldImgSectors) {
+        rc = 0;
+        goto out;
+    }
+
+    // +1 for the superblock, which moves to the new end
+    if (Loop::resizeImageFile(asecFileName, numImgSectors + 1)) {
+        goto out;
+    }
+    {
+        int fd = open(asecFileName, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || pwrite64(fd, &sb, sizeof(sb), (off64_t) numImgSectors * 512) != sizeof(sb)
+                || fsync(fd)) {
+            SLOGE("Failed to write superblock (%s)", strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            truncate64(asecFileName, (off64_t) nr_sec * 512);
+            goto out;
+        }
+        close(fd);
+    }
+    if (Loop::refreshSize(loopDevice)) {
+        truncate64(asecFileName, (off64_t) nr_sec * 512);
+        goto out;
+    }
+    AsecIndex::update(asecFileName);
+    if (!cleanupLoop) {
+        ContainerRegistry::setLoop(idHash, loopDevice, asecFileName, numImgSectors + 1);
+    }
+
+    if (encrypted) {
+        if (!Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
+            if (Devmapper::resize(idHash, loopDevice, key, numImgSectors, cipher)) {
+                goto out;
+            }
+        } else {
+            if (Devmapper::create(idHash, loopDevice, key, numImgSectors,
+                                  dmDevice, sizeof(dmDevice), cipher)) {
+                SLOGE("ASEC device mapping failed (%s)", strerror(errno));
+                goto out;
+            }
+            cleanupDm = true;
+        }
+    } else {
+        strcpy(dmDevice, loopDevice);
+    }
+
+    if (mounted) {
+        // Finalized containers are mounted read-only; growing needs write access
+        struct statfs sfs;
+        bool readOnly = !statfs(mountPoint, &sfs) && (sfs.f_flags & MS_RDONLY);
+        if (readOnly && Ext4::doMount(dmDevice, mountPoint, false, true, false)) {
+            SLOGE("Unable remount to resize %s (%s)", id, strerror(errno));
+            goto out;
+        }
+        rc = Ext4::resize(dmDevice, mountPoint, numImgSectors);
+        if (readOnly && Ext4::doMount(dmDevice, mountPoint, true, true, true)) {
+            SLOGE("Unable to remount %s read-only after resize (%s)", id, strerror(errno));
+            rc = -1;
+        }
+    } else {
+        rc = Ext4::resize(dmDevice, NULL, numImgSectors);
+    }
+
+    if (!rc) {
+        SLOGI("ASEC %s resized from %u to %u sectors", id, oldImgSectors, numImgSectors);
+    }
+
+out:
+    int savedErrno = errno;
+    if (cleanupDm) {
+        Devmapper::destroy(idHash);
+    }
+    if (cleanupLoop) {
+        Loop::destroyByDevice(loopDevice);
+    }
+    errno = savedErrno;
+    return rc;
+}
+// MStar Android Patch End
+
+// MStar Android Patch Begin
+int VolumeManager::snapshotAsec(const char *id, const char *snapId) {
+    char asecFileName[255];
+    char snapFileName[255];
+    char idHash[33];
+    const char *dir;
+
+    if (!isLegalAsecId(id) || !isLegalAsecId(snapId)) {
+        SLOGE("snapshotAsec: Invalid asec id \"%s\" or \"%s\"", id, snapId);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (findAsec(id, asecFileName, sizeof(asecFileName), &dir)) {
+        SLOGE("Couldn't find ASEC %s", id);
+        return -1;
+    }
+
+    if (!ThinPool::isThinImage(asecFileName)) {
+        SLOGE("ASEC %s is not thin-provisioned; can't snapshot it", id);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    int written = snprintf(snapFileName, sizeof(snapFileName), "%s/%s.asec", dir, snapId);
+    if ((written < 0) || (size_t(written) >= sizeof(snapFileName))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!findAsec(snapId, NULL, 0)) {
+        SLOGE("Snapshot target %s exists", snapId);
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    if (!asecHash(id, idHash, sizeof(idHash))) {
+        SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
+        return -1;
+    }
+
+    if (ThinPool::snapshotImage(asecFileName, idHash, snapFileName)) {
+        SLOGE("Snapshot of %s failed (%s)", id, strerror(errno));
+        return -1;
+    }
+    AsecIndex::update(snapFileName);
+    return 0;
+}
+// MStar Android Patch End
+
+// MStar Android Patch Begin
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* rename() that fails with EEXIST instead of replacing newPath */
+static int renameNoReplace(const char *oldPath, const char *newPath) {
+#ifdef __NR_renameat2
+    if (!syscall(__NR_renameat2, AT_FDCWD, oldPath, AT_FDCWD, newPath, RENAME_NOREPLACE)) {
+        return 0;
+    }
+    if (errno != ENOSYS && errno != EINVAL) {
+        return -1;
+    }
+#endif
+    // No renameat2 here; the container locks keep vold itself off newPath
+    if (!access(newPath, F_OK)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(oldPath, newPath);
+}
+// MStar Android Patch End
+
+int VolumeManager::renameAsec(const char *id1, const char *id2) {
+    char asecFilename1[255];
+    char *asecFilename2;
+    char mountPoint[255];
+    // MStar Android Patch Begin
+    bool srcMounted;
+    // MStar Android Patch End
+
+    const char *dir;
+
+    if (!isLegalAsecId(id1)) {
+        SLOGE("renameAsec: Invalid asec id1 \"%s\"", id1);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!isLegalAsecId(id2)) {
+        SLOGE("renameAsec: Invalid asec id2 \"%s\"", id2);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (findAsec(id1, asecFilename1, sizeof(asecFilename1), &dir)) {
+        SLOGE("Couldn't find ASEC %s", id1);
+        return -1;
+    }
+
+    asprintf(&asecFilename2, "%s/%s.asec", dir, id2);
+
+    int written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id1);
+    if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
+        SLOGE("Rename failed: couldn't construct mountpoint");
+        goto out_err;
+    }
+
+    // MStar Android Patch Begin
+    // A mounted container is renamed in place; see renameMountedAsec()
+    srcMounted = isMountpointMounted(mountPoint);
+    // MStar Android Patch End
+
+    written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id2);
+    if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
+        SLOGE("Rename failed: couldn't construct mountpoint2");
+        goto out_err;
+    }
+
+    if (isMountpointMounted(mountPoint)) {
+        SLOGW("Rename attempt when dst mounted");
+        errno = EBUSY;
+        goto out_err;
+    }
+
+    if (!access(asecFilename2, F_OK)) {
+        SLOGE("Rename attempt when dst exists");
+        errno = EADDRINUSE;
+        goto out_err;
+    }
+
+    // MStar Android Patch Begin
+    if (srcMounted) {
+        int rc = renameMountedAsec(id1, id2, asecFilename1, asecFilename2);
+        free(asecFilename2);
+        return rc;
+    }
+
+    if (renameNoReplace(asecFilename1, asecFilename2)) {
         SLOGE("Rename of '%s' to '%s' failed (%s)", asecFilename1, asecFilename2, strerror(errno));
+        if (errno == EEXIST) {
+            errno = EADDRINUSE;
+        }
         goto out_err;
     }
+    AsecIndex::update(asecFilename1);
+    AsecIndex::update(asecFilename2);
+    // MStar Android Patch End
 
     free(asecFilename2);
     return 0;
@@ -1537,11 +2139,151 @@ out_err:
     return -1;
 }
 
+// MStar Android Patch Begin
+/*
+ * Renames a mounted container without tearing it down: the image is renamed
+ * (the loop device holds it open, so it doesn't notice), the mount is moved
+ * to the new mountpoint and the loop and dm devices are relabelled with the
+ * new id hash. Each step is undone if a later one fails.
+ */
+int VolumeManager::renameMountedAsec(const char *id1, const char *id2,
+                                     const char *asecFilename1, const char *asecFilename2) {
+    char mountPoint1[255];
+    char mountPoint2[255];
+    char idHash1[33];
+    char idHash2[33];
+    char loopDevice[255];
+    char dmDevice[255];
+    char backing1[255];
+    char backing2[255];
+    bool haveDm;
+    int savedErrno;
+
+    snprintf(mountPoint1, sizeof(mountPoint1), "%s/%s", Volume::ASECDIR, id1);
+    snprintf(mountPoint2, sizeof(mountPoint2), "%s/%s", Volume::ASECDIR, id2);
+
+    if (!asecHash(id1, idHash1, sizeof(idHash1)) || !asecHash(id2, idHash2, sizeof(idHash2))) {
+        SLOGE("Hash of '%s' or '%s' failed (%s)", id1, id2, strerror(errno));
+        return -1;
+    }
+
+    if (Loop::lookupActive(idHash1, loopDevice, sizeof(loopDevice))) {
+        SLOGE("Mounted ASEC %s has no loop device", id1);
+        errno = EBUSY;
+        return -1;
+    }
+    haveDm = !Devmapper::lookupActive(idHash1, dmDevice, sizeof(dmDevice));
+
+    // A thin ASEC's loop device is bound to its thin volume, whose node stays put
+    if (asecBackingFile(asecFilename1, idHash1, backing1, sizeof(backing1))) {
+        return -1;
+    }
+    if (strcmp(backing1, asecFilename1)) {
+        strlcpy(backing2, backing1, sizeof(backing2));
+    } else {
+        strlcpy(backing2, asecFilename2, sizeof(backing2));
+    }
+
+    if (renameNoReplace(asecFilename1, asecFilename2)) {
+        SLOGE("Rename of '%s' to '%s' failed (%s)", asecFilename1, asecFilename2, strerror(errno));
+        if (errno == EEXIST) {
+            errno = EADDRINUSE;
+        }
+        return -1;
+    }
+
+    if (mkdir(mountPoint2, 0000) && errno != EEXIST) {
+        savedErrno = errno;
+        SLOGE("Mountpoint creation failed (%s)", strerror(errno));
+        goto undo_file;
+    }
+
+    if (mount(mountPoint1, mountPoint2, NULL, MS_MOVE, NULL)) {
+        // e.g. a shared parent mount; the caller can still unmount and remount
+        SLOGW("Unable to move %s to %s (%s)", mountPoint1, mountPoint2, strerror(errno));
+        savedErrno = EBUSY;
+        rmdir(mountPoint2);
+        goto undo_file;
+    }
+
+    if (Loop::relabel(loopDevice, idHash2, backing2)) {
+        savedErrno = errno;
+        goto undo_mount;
+    }
+
+    if (haveDm && Devmapper::rename(idHash1, idHash2)) {
+        savedErrno = errno;
+        goto undo_loop;
+    }
+
+    if (ThinPool::rename(idHash1, idHash2)) {
+        savedErrno = errno;
+        goto undo_dm;
+    }
+
+    rmdir(mountPoint1);
+    ContainerRegistry::rename(idHash1, idHash2, backing2, mountPoint2);
+    renameActiveContainer(id1, id2, mountPoint2);
+    AsecIndex::update(asecFilename1);
+    AsecIndex::update(asecFilename2);
+
+    SLOGI("Renamed mounted ASEC %s to %s", id1, id2);
+    return 0;
+
+undo_dm:
+    if (haveDm) {
+        Devmapper::rename(idHash2, idHash1);
+    }
+undo_loop:
+    Loop::relabel(loopDevice, idHash1, backing1);
+undo_mount:
+    if (mount(mountPoint2, mountPoint1, NULL, MS_MOVE, NULL)) {
+        SLOGE("Unable to move %s back to %s (%s)", mountPoint2, mountPoint1, strerror(errno));
+    } else {
+        rmdir(mountPoint2);
+    }
+undo_file:
+    if (rename(asecFilename2, asecFilename1)) {
+        SLOGE("Unable to rename '%s' back to '%s' (%s)", asecFilename2, asecFilename1,
+                strerror(errno));
+    }
+    errno = savedErrno;
+    return -1;
+}
+
+void VolumeManager::renameActiveContainer(const char *id, const char *newId,
+        const char *newMountPoint) {
+    Mutex::Autolock lock(mActiveContainersLock);
+    for (AsecIdCollection::iterator it = mActiveContainers->begin();
+            it != mActiveContainers->end(); ++it) {
+        if ((*it)->type == ASEC && !strcmp((*it)->id, id)) {
+            free((*it)->id);
+            (*it)->id = strdup(newId);
+            free((*it)->mountPoint);
+            (*it)->mountPoint = strdup(newMountPoint);
+            break;
+        }
+    }
+}
+// MStar Android Patch End
+
 #define UNMOUNT_RETRIES 5
 #define UNMOUNT_SLEEP_BETWEEN_RETRY_MS (1000 * 1000)
+// MStar Android Patch Begin
+#define TEARDOWN_THREADS_MAX 4
+/* How long volume cleanup waits for an operation on a container to finish */
+#define CLEANUP_LOCK_WAIT_MS 5000
+/* How long a freshly created dm device may take to get its node */
+#define DM_NODE_TIMEOUT_MS 1000
+/* ISO 9660 sectors; an ISO loop device may use blocks up to this size */
+#define ISO_BLOCK_SIZE 2048
+// MStar Android Patch End
 
 // MStar Android Patch Begin
 static int unmount_asec_reties = UNMOUNT_RETRIES;
+
+/* Per signal, how long holders of a detached volume get to exit */
+#define DETACHED_KILL_WAIT_MS 2000
 // MStar Android Patch End
 
 int VolumeManager::unmountAsec(const char *id, bool force) {
@@ -1592,17 +2334,15 @@ int VolumeManager::unmountObb(const char *fileName, bool force) {
     return unmountLoopImage(fileName, idHash, fileName, mountPoint, force);
 }
 
-int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
-        const char *fileName, const char *mountPoint, bool force) {
-    if (!isMountpointMounted(mountPoint)) {
-        SLOGE("Unmount request for %s when not mounted", id);
-        errno = ENOENT;
-        return -1;
-    }
-
-    int i, rc;
-    // MStar Android Patch Begin
-    for (i = 1; i <= unmount_asec_reties; i++) {
+// MStar Android Patch Begin
+/*
+ * Unmounts and removes a container mount point, waiting on (and with force,
+ * signalling) whoever keeps it busy between attempts.
+ */
+static int unmountContainerMountPoint(const char *id, const char *mountPoint,
+        bool force, int maxRetries) {
+    int i, rc = -1;
+    for (i = 1; i <= maxRetries; i++) {
         rc = umount(mountPoint);
         if (!rc) {
             break;
@@ -1615,19 +2355,23 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         SLOGW("%s unmount attempt %d failed (%s)",
               id, i, strerror(errno));
 
-        int action = 0; // default is to just complain
+        int sig = 0; // default is to just complain and wait
 
         if (force) {
-            if (i > (unmount_asec_reties - 2))
-                action = 2; // SIGKILL
-            else if (i > (unmount_asec_reties - 3))
-                action = 1; // SIGHUP
+            if (i > (maxRetries - 2))
+                sig = SIGKILL;
+            else if (i > (maxRetries - 3))
+                sig = SIGTERM;
         }
 
-        Process::killProcessesWithOpenFiles(mountPoint, action);
-        usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        // Retry as soon as the holders are gone rather than after a fixed sleep
+        int holders = 0;
+        Process::signalHoldersAndWait(mountPoint, sig,
+                UNMOUNT_SLEEP_BETWEEN_RETRY_MS / 1000, false, &holders);
+        if (!holders) {
+            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        }
     }
-    // MStar Android Patch End
 
     if (rc) {
         errno = EBUSY;
@@ -1638,11 +2382,9 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
     int retries = 10;
 
     while(retries--) {
-        // MStar Android Patch Begin
         if (!rmdir(mountPoint) || errno == ENOENT) {
             break;
         }
-        // MStar Android Patch End
 
         SLOGW("Failed to rmdir %s (%s)", mountPoint, strerror(errno));
         usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
@@ -1651,6 +2393,24 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
     if (!retries) {
         SLOGE("Timed out trying to rmdir %s (%s)", mountPoint, strerror(errno));
     }
+    return 0;
+}
+// MStar Android Patch End
+
+int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
+        const char *fileName, const char *mountPoint, bool force) {
+    if (!isMountpointMounted(mountPoint)) {
+        SLOGE("Unmount request for %s when not mounted", id);
+        errno = ENOENT;
+        return -1;
+    }
+
+    // MStar Android Patch Begin
+    if (unmountContainerMountPoint(id, mountPoint, force, unmount_asec_reties)) {
+        return -1;
+    }
+    ContainerRegistry::clearMountPoint(idHash);
+    // MStar Android Patch End
 
     if (Devmapper::destroy(idHash) && errno != ENXIO) {
         SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
@@ -1662,19 +2422,13 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
     } else {
         SLOGW("Failed to find loop device for {%s} (%s)", fileName, strerror(errno));
     }
+    // MStar Android Patch Begin
+    ThinPool::deactivate(idHash);
+    // MStar Android Patch End
 
-    AsecIdCollection::iterator it;
-    for (it = mActiveContainers->begin(); it != mActiveContainers->end(); ++it) {
-        ContainerData* cd = *it;
-        if (!strcmp(cd->id, id)) {
-            free(*it);
-            mActiveContainers->erase(it);
-            break;
-        }
-    }
-    if (it == mActiveContainers->end()) {
-        SLOGW("mActiveContainers is inconsistent!");
-    }
+    // MStar Android Patch Begin
+    removeActiveContainer(id);
+    // MStar Android Patch End
     return 0;
 }
 
@@ -1709,10 +2463,21 @@ int VolumeManager::destroyAsec(const char *id, bool force) {
         }
     }
 
-    if (unlink(asecFileName)) {
+    // MStar Android Patch Begin
+    if (ThinPool::isThinImage(asecFileName)) {
+        char idHash[33];
+        if (!asecHash(id, idHash, sizeof(idHash)) ||
+                ThinPool::destroyImage(asecFileName, idHash)) {
+            SLOGE("Failed to destroy thin asec '%s' (%s)", asecFileName, strerror(errno));
+            return -1;
+        }
+    // Freeing a multi-GB image's extents can take seconds; do it later
+    } else if (SpaceReclaimer::discard(asecFileName)) {
         SLOGE("Failed to unlink asec '%s' (%s)", asecFileName, strerror(errno));
         return -1;
     }
+    AsecIndex::update(asecFileName);
+    // MStar Android Patch End
 
     if (mDebug) {
         SLOGD("ASEC %s destroyed", id);
@@ -1788,7 +2553,15 @@ int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
     }
 
     const char *dir;
-    if (isAsecInDirectory(Volume::SEC_ASECDIR_INT, asecName)) {
+    // MStar Android Patch Begin
+    AsecIndex::Entry entry;
+    if (!AsecIndex::lookup(id, &entry)) {
+        dir = entry.dir;
+    } else if (errno == ENOENT) {
+        free(asecName);
+        return -1;
+    } else if (isAsecInDirectory(Volume::SEC_ASECDIR_INT, asecName)) {
+    // MStar Android Patch End
         dir = Volume::SEC_ASECDIR_INT;
     } else if (isAsecInDirectory(Volume::SEC_ASECDIR_EXT, asecName)) {
         dir = Volume::SEC_ASECDIR_EXT;
@@ -1849,8 +2622,18 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
 
     char loopDevice[255];
     if (Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
-        if (Loop::create(idHash, asecFileName, loopDevice, sizeof(loopDevice))) {
+        // MStar Android Patch Begin
+        char backingFile[255];
+        if (asecBackingFile(asecFileName, idHash, backingFile, sizeof(backingFile)) ||
+                Loop::create(idHash, backingFile, loopDevice, sizeof(loopDevice))) {
+        // MStar Android Patch End
             SLOGE("ASEC loop device creation failed (%s)", strerror(errno));
+            // MStar Android Patch Begin
+            // Don't leave the thin volume asecBackingFile() activated behind
+            int savedErrno = errno;
+            ThinPool::deactivate(idHash);
+            errno = savedErrno;
+            // MStar Android Patch End
             return -1;
         }
         if (mDebug) {
@@ -1869,26 +2652,54 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
     struct asec_superblock sb;
 
     if (Loop::lookupInfo(loopDevice, &sb, &nr_sec)) {
+        // MStar Android Patch Begin
+        ThinPool::deactivate(idHash);
+        // MStar Android Patch End
         return -1;
     }
 
+    // MStar Android Patch Begin
+    char blockDevice[255];
+    if (asecBlockDevice(asecFileName, idHash, loopDevice, blockDevice, sizeof(blockDevice))) {
+        SLOGE("ASEC thin volume lookup failed (%s)", strerror(errno));
+        destroyAsecLoop(loopDevice, idHash);
+        return -1;
+    }
+    // MStar Android Patch End
+
     if (mDebug) {
         SLOGD("Container sb magic/ver (%.8x/%.2x)", sb.magic, sb.ver);
     }
-    if (sb.magic != ASEC_SB_MAGIC || sb.ver != ASEC_SB_VER) {
+    // MStar Android Patch Begin
+    if (sb.magic != ASEC_SB_MAGIC || sb.ver < ASEC_SB_VER_1 || sb.ver > ASEC_SB_VER) {
+    // MStar Android Patch End
         SLOGE("Bad container magic/version (%.8x/%.2x)", sb.magic, sb.ver);
-        Loop::destroyByDevice(loopDevice);
+        // MStar Android Patch Begin
+        destroyAsecLoop(loopDevice, idHash);
+        // MStar Android Patch End
         errno = EMEDIUMTYPE;
         return -1;
     }
     nr_sec--; // We don't want the devmapping to extend onto our superblock
 
     if (strcmp(key, "none")) {
+        // MStar Android Patch Begin
+        const char *cipher = Devmapper::cipherSpec(&sb);
+        if (!cipher) {
+            destroyAsecLoop(loopDevice, idHash);
+            errno = EMEDIUMTYPE;
+            return -1;
+        }
+        // MStar Android Patch End
         if (Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
-            if (Devmapper::create(idHash, loopDevice, key, nr_sec,
-                                  dmDevice, sizeof(dmDevice))) {
+            // MStar Android Patch Begin
+            if (Devmapper::create(idHash, blockDevice, key, nr_sec,
+                                  dmDevice, sizeof(dmDevice), cipher)) {
+            // MStar Android Patch End
                 SLOGE("ASEC device mapping failed (%s)", strerror(errno));
-                Loop::destroyByDevice(loopDevice);
+                // MStar Android Patch Begin
+                destroyAsecLoop(loopDevice, idHash);
+                // MStar Android Patch End
                 return -1;
             }
             if (mDebug) {
@@ -1901,7 +2712,9 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
         }
         cleanupDm = true;
     } else {
-        strcpy(dmDevice, loopDevice);
+        // MStar Android Patch Begin
+        strcpy(dmDevice, blockDevice);
+        // MStar Android Patch End
     }
 
     if (mkdir(mountPoint, 0000)) {
@@ -1910,23 +2723,20 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
             if (cleanupDm) {
                 Devmapper::destroy(idHash);
             }
-            Loop::destroyByDevice(loopDevice);
+            // MStar Android Patch Begin
+            destroyAsecLoop(loopDevice, idHash);
+            // MStar Android Patch End
             return -1;
         }
     }
 
     /*
      * The device mapper node needs to be created. Sometimes it takes a
-     * while. Wait for up to 1 second. We could also inspect incoming uevents,
-     * but that would take more effort.
+     * while. Wait for up to 1 second.
      */
-    int tries = 25;
-    while (tries--) {
-        if (!access(dmDevice, F_OK) || errno != ENOENT) {
-            break;
-        }
-        usleep(40 * 1000);
-    }
+    // MStar Android Patch Begin
+    BlockNode::waitFor(dmDevice, DM_NODE_TIMEOUT_MS);
+    // MStar Android Patch End
 
     int result;
     if (sb.c_opts & ASEC_SB_C_OPTS_EXT4) {
@@ -1940,11 +2750,16 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
         if (cleanupDm) {
             Devmapper::destroy(idHash);
         }
-        Loop::destroyByDevice(loopDevice);
+        // MStar Android Patch Begin
+        destroyAsecLoop(loopDevice, idHash);
+        // MStar Android Patch End
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
+    // MStar Android Patch Begin
+    ContainerRegistry::setMountPoint(idHash, mountPoint);
+    addActiveContainer(id, ASEC, mountPoint, loopDevice, ownerUid);
+    // MStar Android Patch End
     if (mDebug) {
         SLOGD("ASEC %s mounted", id);
     }
@@ -2063,7 +2878,10 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(img), OBB));
+    // MStar Android Patch Begin
+    ContainerRegistry::setMountPoint(idHash, mountPoint);
+    addActiveContainer(img, OBB, mountPoint, loopDevice, ownerGid);
+    // MStar Android Patch End
     if (mDebug) {
         SLOGD("Image %s mounted", img);
     }
@@ -2084,95 +2902,13 @@ int VolumeManager::mountVolume(const char *label) {
     return v->mountVol();
 }
 
-int VolumeManager::listMountedObbs(SocketClient* cli) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return -1;
-    }
-
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = strlen(Volume::LOOPDIR);
-    char loopDir[loopDirLen + 2];
-    strcpy(loopDir, Volume::LOOPDIR);
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-
-        /*
-         * Should look like:
-         * /dev/block/loop0 /mnt/obb/fc99df1323fd36424f864dcb76b76d65 ...
-         */
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-
-        if (!strncmp(mount_path, loopDir, loopDirLen)) {
-            int fd = open(device, O_RDONLY);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                            (const char*) li.lo_file_name, false);
-                }
-                close(fd);
-            }
-        }
-    }
-
-    fclose(fp);
-    return 0;
-}
-
 // MStar Android Patch Begin
-int VolumeManager::listMountedISOs(SocketClient* cli) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return -1;
-    }
-
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = strlen(Volume::IOSDIR);
-    char loopDir[loopDirLen + 2];
-    strncpy(loopDir, Volume::IOSDIR, loopDirLen);
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    while (fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-
-        /*
-         * Should look like:
-         * /dev/block/loop0 /mnt/ISO/fc99df1323fd36424f864dcb76b76d65 ...
-         */
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-
-        if (!strncmp(mount_path, loopDir, loopDirLen)) {
-            int fd = open(device, O_RDONLY);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                                 (const char*) li.lo_file_name, false);
-                }
-                close(fd);
-            }
-        }
-    }
+int VolumeManager::listMountedObbs(SocketClient* cli, bool detail) {
+    return listActiveContainers(cli, OBB, detail);
+}
 
-    fclose(fp);
-    return 0;
+int VolumeManager::listMountedISOs(SocketClient* cli, bool detail) {
+    return listActiveContainers(cli, ISO, detail);
 }
 
 int VolumeManager::mountISO(const char *img) {
@@ -2180,7 +2916,9 @@ int VolumeManager::mountISO(const char *img) {
     char mountPoint[255];
 
     char idHash[33];
-    if (!asecHash(img,idHash,sizeof(idHash))) {
+    // A recently unmounted image may still be warm
+    int warm = IsoCache::restore(img, idHash, sizeof(idHash));
+    if (warm < 0 && !asecHash(img,idHash,sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", img, strerror(errno));
         return -1;
     }
@@ -2191,6 +2929,18 @@ int VolumeManager::mountISO(const char *img) {
         return -1;
     }
 
+    if (warm > 0) {
+        char loopDevice[255];
+        ContainerRegistry::setMountPoint(idHash, mountPoint);
+        addActiveContainer(img, ISO, mountPoint,
+                Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice)) ? NULL : loopDevice,
+                AID_MEDIA_RW);
+        if (mDebug) {
+            SLOGD("Image %s remounted from cache", img);
+        }
+        return 0;
+    }
+
     if (isMountpointMounted(mountPoint)) {
         SLOGE("Image %s already mounted", img);
         errno = EBUSY;
@@ -2199,7 +2949,7 @@ int VolumeManager::mountISO(const char *img) {
 
     char loopDevice[255];
     if (Loop::lookupActive(idHash,loopDevice,sizeof(loopDevice))) {
-        if (Loop::create(idHash,img,loopDevice,sizeof(loopDevice))) {
+        if (Loop::create(idHash,img,loopDevice,sizeof(loopDevice),ISO_BLOCK_SIZE)) {
             SLOGE("Image loop device creation failed (%s)", strerror(errno));
             return -1;
         }
@@ -2276,7 +3026,8 @@ int VolumeManager::mountISO(const char *img) {
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(img), ISO));
+    ContainerRegistry::setMountPoint(idHash, mountPoint);
+    addActiveContainer(img, ISO, mountPoint, loopDevice, AID_MEDIA_RW);
 
     if (mDebug) {
         SLOGD("Image %s mounted", img);
@@ -2295,6 +3046,19 @@ int VolumeManager::unmountISO(const char *fileName, bool force){
 
     snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::IOSDIR, idHash);
 
+    // Cached images backed by files inside this one would keep it busy
+    IsoCache::flush(mountPoint);
+
+    if (!force && isMountpointMounted(mountPoint) &&
+            !IsoCache::park(fileName, idHash, mountPoint)) {
+        ContainerRegistry::clearMountPoint(idHash);
+        removeActiveContainer(fileName);
+        if (mDebug) {
+            SLOGD("Image %s kept warm", fileName);
+        }
+        return 0;
+    }
+
     return unmountLoopImage(fileName, idHash, fileName, mountPoint, force);
 }
 
@@ -2387,17 +3151,21 @@ int VolumeManager::unmountSamba(const char *mountPoint, bool force) {
         SLOGW("%s unmount attempt %d failed (%s)",
               mountPath, i, strerror(errno));
 
-        int action = 0; // default is to just complain
+        int sig = 0; // default is to just complain and wait
 
         if (force) {
             if (i > (UNMOUNT_RETRIES - 2))
-                action = 2; // SIGKILL
+                sig = SIGKILL;
             else if (i > (UNMOUNT_RETRIES - 3))
-                action = 1; // SIGHUP
+                sig = SIGTERM;
         }
 
-        Process::killProcessesWithOpenFiles(mountPath, action);
-        usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        int holders = 0;
+        Process::signalHoldersAndWait(mountPath, sig,
+                UNMOUNT_SLEEP_BETWEEN_RETRY_MS / 1000, false, &holders);
+        if (!holders) {
+            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        }
     }
 
     if (rc) {
@@ -2709,10 +3477,16 @@ int VolumeManager::unmountAllAsecsInDir(const char *directory) {
                 !strcmp(&dent->d_name[name_len - 5], ASEC_SUFFIX)) {
             char id[ID_BUF_LEN];
             strlcpy(id, dent->d_name, name_len - 4);
+            // MStar Android Patch Begin
+            bool locked = ContainerLocks::acquire(id, CLEANUP_LOCK_WAIT_MS);
             if (unmountAsec(id, true)) {
                 /* Register the error, but try to unmount more asecs */
                 rc = -1;
             }
+            if (locked) {
+                ContainerLocks::release(id);
+            }
+            // MStar Android Patch End
         }
     }
     closedir(d);
@@ -2767,62 +3541,440 @@ bool VolumeManager::isMountpointMounted(const char *mp)
 }
 
 // MStar Android Patch Begin
-void VolumeManager::lockActiveContainers() {
-    mActiveContainersLock.lock();
+void VolumeManager::addActiveContainer(const char *id, container_type_t type,
+        const char *mountPoint, const char *loopDevice, int owner) {
+    ContainerData *cd = new ContainerData(strdup(id), type);
+    cd->mountPoint = mountPoint ? strdup(mountPoint) : NULL;
+    cd->loopDevice = loopDevice ? strdup(loopDevice) : NULL;
+    cd->owner = owner;
+    cd->mountTime = time(NULL);
+
+    Mutex::Autolock lock(mActiveContainersLock);
+    mActiveContainers->push_back(cd);
+}
+
+struct AdoptedContainer {
+    android::String8 file;
+    android::String8 mountPoint;
+    android::String8 loopDevice;
+    container_type_t type;
+};
+
+static void collectMountedImage(const char *hash,
+        const ContainerRegistry::Record &record, void *data) {
+    android::Vector<AdoptedContainer> *found = (android::Vector<AdoptedContainer> *) data;
+    const char *base = strrchr(record.mountPoint, '/');
+    if (!base || !record.loopDevice[0] || strcmp(base + 1, hash)) {
+        return;
+    }
+
+    AdoptedContainer c;
+    size_t len = base - record.mountPoint;
+    if (len == strlen(Volume::LOOPDIR) && !strncmp(record.mountPoint, Volume::LOOPDIR, len)) {
+        c.type = OBB;
+    } else if (len == strlen(Volume::IOSDIR) && !strncmp(record.mountPoint, Volume::IOSDIR, len)) {
+        c.type = ISO;
+    } else {
+        return;
+    }
+    c.file = record.backingFile;
+    c.mountPoint = record.mountPoint;
+    c.loopDevice = record.loopDevice;
+    found->push(c);
+}
+
+/*
+ * Takes back the OBB and ISO mounts a previous instance left behind, so
+ * that listings and volume teardown still cover them.
+ */
+void VolumeManager::adoptActiveContainers() {
+    android::Vector<AdoptedContainer> found;
+    ContainerRegistry::forEach(collectMountedImage, &found);
+
+    Mutex::Autolock lock(mActiveContainersLock);
+    for (size_t i = 0; i < found.size(); i++) {
+        ContainerData *cd = new ContainerData(strdup(found[i].file.string()), found[i].type);
+        cd->mountPoint = strdup(found[i].mountPoint.string());
+        cd->loopDevice = strdup(found[i].loopDevice.string());
+        mActiveContainers->push_back(cd);
+    }
+    if (!found.isEmpty()) {
+        SLOGI("Adopted %zu mounted images", found.size());
+    }
+}
+
+/*
+ * Lists the mounted containers of a type from vold's own bookkeeping. With
+ * detail each line is "<mount time> <owner> <loop device> <mount point>
+ * <source file>", the file last as it may contain spaces; "-" stands for
+ * what isn't known.
+ */
+int VolumeManager::listActiveContainers(SocketClient *cli, container_type_t type, bool detail) {
+    android::Vector<android::String8> lines;
+    {
+        Mutex::Autolock lock(mActiveContainersLock);
+        for (AsecIdCollection::iterator it = mActiveContainers->begin();
+                it != mActiveContainers->end(); ++it) {
+            ContainerData *cd = *it;
+            if (cd->type != type) {
+                continue;
+            }
+            if (!detail) {
+                lines.push(android::String8(cd->id));
+                continue;
+            }
+            android::String8 line;
+            line.appendFormat("%ld %d %s %s %s", (long) cd->mountTime, cd->owner,
+                    cd->loopDevice ? cd->loopDevice : "-",
+                    cd->mountPoint ? cd->mountPoint : "-", cd->id);
+            lines.push(line);
+        }
+    }
+
+    int code = detail ? ResponseCode::ContainerListResult : ResponseCode::AsecListResult;
+    for (size_t i = 0; i < lines.size(); i++) {
+        cli->sendMsg(code, lines[i].string(), false);
+    }
+    return 0;
 }
 
-void VolumeManager::unlockActiveContainers() {
-    mActiveContainersLock.unlock();
+void VolumeManager::removeActiveContainer(const char *id) {
+    Mutex::Autolock lock(mActiveContainersLock);
+    for (AsecIdCollection::iterator it = mActiveContainers->begin();
+            it != mActiveContainers->end(); ++it) {
+        if (!strcmp((*it)->id, id)) {
+            delete *it;
+            mActiveContainers->erase(it);
+            return;
+        }
+    }
+    SLOGW("mActiveContainers is inconsistent!");
+}
+
+#define CONTAINER_TRIM_WAKELOCK "vold_container_trim"
+
+int VolumeManager::trimContainers(SocketClient *cli) {
+    android::Vector<android::String8> ids;
+    android::Vector<int> types;
+    {
+        Mutex::Autolock lock(mActiveContainersLock);
+        for (AsecIdCollection::iterator it = mActiveContainers->begin();
+                it != mActiveContainers->end(); ++it) {
+            // ISO images are read-only; there is nothing to give back
+            if ((*it)->type == ASEC || (*it)->type == OBB) {
+                ids.push(android::String8((*it)->id));
+                types.push((*it)->type);
+            }
+        }
+    }
+
+    unsigned long long totalFreed = 0;
+    int failed = 0;
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        const char *id = ids[i].string();
+        char imageFile[255];
+        char mountPoint[255];
+
+        // Skip containers that stay busy with something else
+        if (!ContainerLocks::acquire(id, CLEANUP_LOCK_WAIT_MS)) {
+            continue;
+        }
+
+        bool found;
+        if (types[i] == ASEC) {
+            found = !findAsec(id, imageFile, sizeof(imageFile)) &&
+                    !getAsecMountPath(id, mountPoint, sizeof(mountPoint));
+        } else {
+            strlcpy(imageFile, id, sizeof(imageFile));
+            found = !getObbMountPath(id, mountPoint, sizeof(mountPoint));
+        }
+
+        struct stat before;
+        if (!found || !isMountpointMounted(mountPoint) || stat(imageFile, &before)) {
+            ContainerLocks::release(id);
+            continue;
+        }
+
+        // A thin ASEC gives its blocks back to the pool, not to its reference file
+        unsigned long long poolBefore, poolAfter, poolTotal;
+        bool thin = types[i] == ASEC && ThinPool::isThinImage(imageFile) &&
+                !ThinPool::usage(&poolBefore, &poolTotal);
+
+        struct fstrim_range range;
+        memset(&range, 0, sizeof(range));
+        range.len = ULLONG_MAX;
+
+        int fd = open(mountPoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || ioctl(fd, FITRIM, &range)) {
+            // Older kernels' vfat and loop drivers can't trim at all
+            if (errno != EOPNOTSUPP && errno != ENOTTY) {
+                SLOGW("Unable to trim %s (%s)", id, strerror(errno));
+                failed++;
+            }
+        } else {
+            struct stat after;
+            unsigned long long freed = 0;
+            if (thin) {
+                if (!ThinPool::usage(&poolAfter, &poolTotal) && poolAfter < poolBefore) {
+                    freed = poolBefore - poolAfter;
+                }
+            } else if (!stat(imageFile, &after) && after.st_blocks < before.st_blocks) {
+                freed = (unsigned long long) (before.st_blocks - after.st_blocks) * 512;
+            }
+            totalFreed += freed;
+
+            SLOGI("Trimmed %llu bytes in %s, %llu bytes freed from its storage",
+                    (unsigned long long) range.len, id, freed);
+            if (cli) {
+                char msg[512];
+                snprintf(msg, sizeof(msg), "%s %llu %llu", id,
+                        (unsigned long long) range.len, freed);
+                cli->sendMsg(ResponseCode::ContainerTrimResult, msg, false);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        ContainerLocks::release(id);
+    }
+
+    SLOGI("Container trim freed %llu bytes", totalFreed);
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+struct AsecImage {
+    android::String8 id;
+    AsecIndex::Entry entry;
+};
+
+static void collectAsecImage(const char *id, const AsecIndex::Entry *entry, void *data) {
+    AsecImage image;
+    image.id = id;
+    image.entry = *entry;
+    ((android::Vector<AsecImage> *) data)->push(image);
+}
+
+/* Adds every image in dir, from the index when it covers dir */
+static void collectAsecImages(const char *dir, android::Vector<AsecImage> *images) {
+    if (!AsecIndex::list(dir, collectAsecImage, images)) {
+        return;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        size_t len = strlen(de->d_name);
+        struct stat st;
+        if (de->d_name[0] == '.' || len <= 5 || strcmp(de->d_name + len - 5, ".asec") ||
+                fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            continue;
+        }
+        AsecImage image;
+        image.id = android::String8(de->d_name, len - 5);
+        image.entry.dir = dir;
+        image.entry.size = st.st_size;
+        image.entry.mtime = st.st_mtime;
+        images->push(image);
+    }
+    closedir(d);
+}
+
+/* Reads the superblock at the end of an image; false if it has none */
+static bool readAsecSuperblock(const char *imageFile, off64_t size, struct asec_superblock *sb) {
+    if (size < 512) {
+        return false;
+    }
+    int fd = open(imageFile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n = pread64(fd, sb, sizeof(*sb), size - 512);
+    close(fd);
+    return n == (ssize_t) sizeof(*sb) && sb->magic == ASEC_SB_MAGIC;
+}
+
+/*
+ * Sends one AsecInfoResult per image:
+ *   <id> <image> <size> <internal|external> <cipher> <fstype>
+ *   <mounted|unmounted> <mountpoint> <loop> <dm>
+ * with "-" for whatever doesn't apply. /proc/mounts is read once for all.
+ * Then one AsecSpaceResult per secure area:
+ *   <internal|external> <bytes of deleted images still being freed>
+ */
+int VolumeManager::listAsecInfo(SocketClient *cli) {
+    android::Vector<AsecImage> images;
+    collectAsecImages(Volume::SEC_ASECDIR_INT, &images);
+    collectAsecImages(Volume::SEC_ASECDIR_EXT, &images);
+
+    android::SortedVector<android::String8> mounted;
+    FILE *fp = fopen("/proc/mounts", "r");
+    if (!fp) {
+        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
+        return -1;
+    }
+    char line[1024];
+    size_t prefixLen = strlen(Volume::ASECDIR);
+    while (fgets(line, sizeof(line), fp)) {
+        char device[256];
+        char mountPath[256];
+        if (sscanf(line, "%255s %255s", device, mountPath) == 2 &&
+                !strncmp(mountPath, Volume::ASECDIR, prefixLen) && mountPath[prefixLen] == '/') {
+            mounted.add(android::String8(mountPath));
+        }
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < images.size(); i++) {
+        const AsecImage &image = images[i];
+        const char *id = image.id.string();
+        char imageFile[255];
+        char mountPoint[255];
+        char idHash[33];
+        char loopDevice[255];
+        char dmDevice[255];
+
+        snprintf(imageFile, sizeof(imageFile), "%s/%s.asec", image.entry.dir, id);
+        snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
+
+        const char *cipher = "-";
+        const char *fsType = "-";
+        struct asec_superblock sb;
+        unsigned long long thinSectors;
+        off64_t size = image.entry.size;
+        // A thin container's superblock is in its volume, not the reference
+        if (ThinPool::isThinImage(imageFile, NULL, &thinSectors)) {
+            size = (off64_t) thinSectors * 512;
+        } else if (readAsecSuperblock(imageFile, size, &sb)) {
+            if (sb.c_cipher == ASEC_SB_C_CIPHER_NONE) {
+                cipher = "none";
+            } else if (!(cipher = Devmapper::cipherSpec(&sb))) {
+                cipher = "unknown";
+            }
+            fsType = (sb.c_opts & ASEC_SB_C_OPTS_EXT4) ? "ext4" : "fat";
+        }
+
+        const bool hashed = asecHash(id, idHash, sizeof(idHash)) != NULL;
+        if (!hashed || Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+            strlcpy(loopDevice, "-", sizeof(loopDevice));
+        }
+        if (!hashed || Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
+            strlcpy(dmDevice, "-", sizeof(dmDevice));
+        }
+
+        const bool isMounted = mounted.indexOf(android::String8(mountPoint)) >= 0;
+        char msg[1024];
+        snprintf(msg, sizeof(msg), "%s %s %lld %s %s %s %s %s %s %s", id, imageFile,
+                (long long) size,
+                image.entry.dir == Volume::SEC_ASECDIR_INT ? "internal" : "external",
+                cipher, fsType, isMounted ? "mounted" : "unmounted",
+                isMounted ? mountPoint : "-", loopDevice, dmDevice);
+        cli->sendMsg(ResponseCode::AsecInfoResult, msg, false);
+    }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "internal %lld",
+            (long long) SpaceReclaimer::pendingBytes(Volume::SEC_ASECDIR_INT));
+    cli->sendMsg(ResponseCode::AsecSpaceResult, msg, false);
+    snprintf(msg, sizeof(msg), "external %lld",
+            (long long) SpaceReclaimer::pendingBytes(Volume::SEC_ASECDIR_EXT));
+    cli->sendMsg(ResponseCode::AsecSpaceResult, msg, false);
+    return 0;
+}
+
+void *VolumeManager::containerTrimThread(void *arg) {
+    VolumeManager *vm = (VolumeManager *) arg;
+    vm->trimContainers(NULL);
+    release_wake_lock(CONTAINER_TRIM_WAKELOCK);
+    return NULL;
+}
+
+int VolumeManager::startContainerTrim() {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    acquire_wake_lock(PARTIAL_WAKE_LOCK, CONTAINER_TRIM_WAKELOCK);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thread, &attr, containerTrimThread, this);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        SLOGE("Unable to start container trim (%s)", strerror(rc));
+        release_wake_lock(CONTAINER_TRIM_WAKELOCK);
+        errno = rc;
+        return -1;
+    }
+    return 0;
 }
 // MStar Android Patch End
 
 int VolumeManager::cleanupAsec(Volume *v, bool force) {
-    int rc = 0;
     // MStar Android Patch Begin
-    Mutex::Autolock lock(mActiveContainersLock);
-    const char* externalStorage = getenv("EXTERNAL_STORAGE");
-    bool primaryStorage = externalStorage && !strcmp(v->getMountpoint(), externalStorage);
+    return cleanupAsec(v->getMountpoint(), v->getFuseMountpoint(), force);
+}
 
+int VolumeManager::cleanupAsec(const char *mountpoint, const char *fuseMountpoint, bool force) {
+    int rc = 0;
+    const char* externalStorage = getenv("EXTERNAL_STORAGE");
+    bool primaryStorage = externalStorage && !strcmp(mountpoint, externalStorage);
 
     char asecFileName[255];
 
-    AsecIdCollection removeAsec;
-    AsecIdCollection removeObb;
+    // Unmounting edits the list, so work from a copy of it
+    android::Vector<android::String8> ids;
+    android::Vector<int> types;
+    {
+        Mutex::Autolock lock(mActiveContainersLock);
+        for (AsecIdCollection::iterator it = mActiveContainers->begin();
+                it != mActiveContainers->end(); ++it) {
+            ids.push(android::String8((*it)->id));
+            types.push((*it)->type);
+        }
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        const char *id = ids[i].string();
+        int type = types[i];
 
-    for (AsecIdCollection::iterator it = mActiveContainers->begin(); it != mActiveContainers->end();) {
-        ContainerData* cd = *it;
-        ++it;
+        // Let an operation in flight on the container finish first
+        bool locked = ContainerLocks::acquire(id, CLEANUP_LOCK_WAIT_MS);
 
-        if (primaryStorage && cd->type == ASEC) {
-            SLOGI("Unmounting ASEC %s (dependant on %s)", cd->id, v->getMountpoint());
+        if (primaryStorage && type == ASEC) {
+            SLOGI("Unmounting ASEC %s (dependant on %s)", id, mountpoint);
             /* Try 10 times, sure to wait for systemserver to close all the "*.asec" file */
             unmount_asec_reties = 10;
-            if (unmountAsec(cd->id, force)) {
-                SLOGE("Failed to unmount ASEC %s (%s)", cd->id, strerror(errno));
+            if (unmountAsec(id, force)) {
+                SLOGE("Failed to unmount ASEC %s (%s)", id, strerror(errno));
                 rc = -1;
             }
             unmount_asec_reties = UNMOUNT_RETRIES;
-        } else if (cd->type == ASEC) {
-            if (findAsec(cd->id, asecFileName, sizeof(asecFileName))) {
-                SLOGE("Couldn't find ASEC %s; cleaning up", cd->id);
-                removeAsec.push_back(cd);
+        } else if (type == ASEC) {
+            if (findAsec(id, asecFileName, sizeof(asecFileName))) {
+                SLOGE("Couldn't find ASEC %s; cleaning up", id);
             } else {
                 SLOGD("Found ASEC at path %s", asecFileName);
-                if (!strncmp(asecFileName, Volume::SEC_ASECDIR_EXT,
-                        strlen(Volume::SEC_ASECDIR_EXT))) {
-                    removeAsec.push_back(cd);
-                }
             }
-        } else if (cd->type == OBB) {
-            if (v == getVolumeForFile(cd->id)) {
-                SLOGI("Unmounting OBB %s (dependant on %s)", cd->id, v->getMountpoint());
-                if (unmountObb(cd->id, force)) {
-                    SLOGE("Failed to unmount OBB %s (%s)", cd->id, strerror(errno));
+        } else if (type == OBB) {
+            if (!strncmp(id, fuseMountpoint, strlen(fuseMountpoint))) {
+                SLOGI("Unmounting OBB %s (dependant on %s)", id, mountpoint);
+                if (unmountObb(id, force)) {
+                    SLOGE("Failed to unmount OBB %s (%s)", id, strerror(errno));
                     rc = -1;
                 }
             }
-        } else if (cd->type != ISO){
-            SLOGE("Unknown container type %d!", cd->type);
+        } else if (type != ISO){
+            SLOGE("Unknown container type %d!", type);
+        }
+
+        if (locked) {
+            ContainerLocks::release(id);
         }
     }
 
@@ -2832,52 +3984,483 @@ int VolumeManager::cleanupAsec(Volume *v, bool force) {
 
 // MStar Android Patch Begin
 int VolumeManager::cleanupISO(Volume *v, bool force) {
-    char mountPoint[255];
+    return cleanupISO(v->getFuseMountpoint(), force);
+}
+
+/*
+ * Teardown plan for the loop containers (ISOs and OBBs) that depend on a
+ * volume. Containers form a forest: an image either lives on the volume
+ * itself or inside the mount of another ISO/OBB. Leaves are torn down
+ * first, independent ones in parallel, and a parent becomes ready once the
+ * last of its children is gone.
+ */
+struct TeardownNode {
+    ContainerData *cd;
     char idHash[33];
-    int len = 0;
-    AsecIdCollection::iterator it;
+    char mountPoint[255];
+    char loopDevice[255];
+    int parent;
+    int pendingChildren;
+    int onVolume;       // 0 = not resolved yet, 1 = yes, -1 = no
+    bool childFailed;
+    int rc;
+};
+
+struct TeardownPlan {
+    TeardownNode *nodes;
+    int *ready;
+    int readyCount;
+    int remaining;
+    bool force;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Index of the container whose mount holds the image id, or -1 */
+static int findContainerParent(const char *id,
+        const android::KeyedVector<android::String8, int> &byMountPoint) {
+    const char *dirs[] = { Volume::IOSDIR, Volume::LOOPDIR };
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        size_t len = strlen(dirs[i]);
+        if (strncmp(id, dirs[i], len) || id[len] != '/') {
+            continue;
+        }
+        const char *end = strchr(id + len + 1, '/');
+        if (!end) {
+            continue;
+        }
+        ssize_t idx = byMountPoint.indexOfKey(android::String8(id, end - id));
+        if (idx >= 0) {
+            return byMountPoint.valueAt(idx);
+        }
+    }
+    return -1;
+}
+
+static int teardownContainer(TeardownNode *node, bool force) {
+    ContainerData *cd = node->cd;
+
+    if (node->childFailed) {
+        SLOGE("Not unmounting %s, a container inside it is still mounted", cd->id);
+        return -1;
+    }
+
+    SLOGI("Unmounting %s %s", cd->type == ISO ? "ISO" : "OBB", cd->id);
+    if (unmountContainerMountPoint(cd->id, node->mountPoint, force, unmount_asec_reties)) {
+        return -1;
+    }
+    ContainerRegistry::clearMountPoint(node->idHash);
+
+    if (cd->type == OBB && Devmapper::destroy(node->idHash) && errno != ENXIO) {
+        SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
+    }
+
+    if (node->loopDevice[0]) {
+        Loop::destroyByDevice(node->loopDevice);
+    } else {
+        SLOGW("Failed to find loop device for {%s}", cd->id);
+    }
+    return 0;
+}
+
+static void *teardownWorker(void *arg) {
+    TeardownPlan *plan = (TeardownPlan *) arg;
+
+    pthread_mutex_lock(&plan->lock);
+    while (true) {
+        while (!plan->readyCount && plan->remaining) {
+            pthread_cond_wait(&plan->cond, &plan->lock);
+        }
+        if (!plan->remaining) {
+            break;
+        }
+
+        int idx = plan->ready[--plan->readyCount];
+        TeardownNode *node = &plan->nodes[idx];
+        pthread_mutex_unlock(&plan->lock);
+
+        int rc = teardownContainer(node, plan->force);
+
+        pthread_mutex_lock(&plan->lock);
+        node->rc = rc;
+        plan->remaining--;
+        if (node->parent >= 0) {
+            TeardownNode *parent = &plan->nodes[node->parent];
+            if (rc) {
+                parent->childFailed = true;
+            }
+            if (!--parent->pendingChildren) {
+                plan->ready[plan->readyCount++] = node->parent;
+            }
+        }
+        pthread_cond_broadcast(&plan->cond);
+    }
+    pthread_mutex_unlock(&plan->lock);
+    return NULL;
+}
+
+int VolumeManager::cleanupISO(const char *fuseMountpoint, bool force) {
+    // Cached images hold the volume busy like mounted ones
+    IsoCache::flush(fuseMountpoint);
+
+    // Let operations in flight on the containers finish first
+    android::SortedVector<android::String8> ids;
+    {
+        Mutex::Autolock lock(mActiveContainersLock);
+        for (AsecIdCollection::iterator it = mActiveContainers->begin();
+                it != mActiveContainers->end(); ++it) {
+            if ((*it)->type == ISO || (*it)->type == OBB) {
+                ids.add(android::String8((*it)->id));
+            }
+        }
+    }
+
+    // In sorted order, like ContainerLocks::Autolock
+    android::Vector<android::String8> locked;
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ContainerLocks::acquire(ids[i].string(), CLEANUP_LOCK_WAIT_MS)) {
+            locked.push(ids[i]);
+        }
+    }
+
+    int rc = teardownLoopContainers(fuseMountpoint, force);
+
+    for (size_t i = 0; i < locked.size(); i++) {
+        ContainerLocks::release(locked[i].string());
+    }
+    return rc;
+}
+
+int VolumeManager::teardownLoopContainers(const char *fuseMountpoint, bool force) {
     Mutex::Autolock lock(mActiveContainersLock);
+    AsecIdCollection::iterator it;
+    int count = 0;
+    int i, rc = 0;
 
-    strncpy(mountPoint, v->getFuseMountpoint(), 255);
-rescan:
     for (it = mActiveContainers->begin(); it != mActiveContainers->end(); ++it) {
-        ContainerData* cd = *it;
-        if (cd->type == ISO) {
-            len = strlen(mountPoint);
-            if(strncmp(mountPoint,cd->id,len) == 0) {
-                cd->type = (container_type_t)-1;
-            }
+        if ((*it)->type == ISO || (*it)->type == OBB) {
+            count++;
         }
     }
+    if (!count) {
+        return 0;
+    }
+
+    TeardownNode *nodes = (TeardownNode *) calloc(count, sizeof(TeardownNode));
+    int *scratch = (int *) calloc(count * 2, sizeof(int));
+    const char **hashes = (const char **) calloc(count, sizeof(char *));
+    char **loopDevices = (char **) calloc(count, sizeof(char *));
+    if (!nodes || !scratch || !hashes || !loopDevices) {
+        free(nodes);
+        free(scratch);
+        free(hashes);
+        free(loopDevices);
+        errno = ENOMEM;
+        return -1;
+    }
 
+    // Hash every container once and index the mount points
+    android::KeyedVector<android::String8, int> byMountPoint;
+    int n = 0;
     for (it = mActiveContainers->begin(); it != mActiveContainers->end(); ++it) {
         ContainerData *cd = *it;
-        if (cd->type == -1) {
-            if (!asecHash(cd->id,idHash,sizeof(idHash))) {
-                SLOGE("Hash of '%s' failed (%s)", cd->id, strerror(errno));
-                return -1;
+        if (cd->type != ISO && cd->type != OBB) {
+            continue;
+        }
+        TeardownNode *node = &nodes[n];
+        node->cd = cd;
+        node->parent = -1;
+        if (!asecHash(cd->id, node->idHash, sizeof(node->idHash))) {
+            SLOGE("Hash of '%s' failed (%s)", cd->id, strerror(errno));
+            node->onVolume = -1;
+            n++;
+            continue;
+        }
+        snprintf(node->mountPoint, sizeof(node->mountPoint), "%s/%s",
+                cd->type == ISO ? Volume::IOSDIR : Volume::LOOPDIR, node->idHash);
+        byMountPoint.add(android::String8(node->mountPoint), n);
+        n++;
+    }
+
+    size_t len = strlen(fuseMountpoint);
+    for (i = 0; i < n; i++) {
+        if (nodes[i].onVolume) {
+            continue;
+        }
+        nodes[i].parent = findContainerParent(nodes[i].cd->id, byMountPoint);
+        if (nodes[i].parent < 0) {
+            nodes[i].onVolume = strncmp(fuseMountpoint, nodes[i].cd->id, len) ? -1 : 1;
+        }
+    }
+
+    // A nested container depends on the volume iff its parent does
+    int *chain = scratch;
+    for (i = 0; i < n; i++) {
+        int depth = 0;
+        int j = i;
+        while (!nodes[j].onVolume && depth < n) {
+            chain[depth++] = j;
+            j = nodes[j].parent;
+        }
+        int onVolume = nodes[j].onVolume ? nodes[j].onVolume : -1;
+        while (depth) {
+            nodes[chain[--depth]].onVolume = onVolume;
+        }
+    }
+
+    TeardownPlan plan;
+    plan.nodes = nodes;
+    plan.ready = scratch + count;
+    plan.readyCount = 0;
+    plan.remaining = 0;
+    plan.force = force;
+
+    int numHashes = 0;
+    for (i = 0; i < n; i++) {
+        if (nodes[i].onVolume != 1) {
+            continue;
+        }
+        plan.remaining++;
+        if (nodes[i].parent >= 0) {
+            nodes[nodes[i].parent].pendingChildren++;
+        }
+        hashes[numHashes] = nodes[i].idHash;
+        loopDevices[numHashes] = nodes[i].loopDevice;
+        numHashes++;
+    }
+    if (!plan.remaining) {
+        goto out;
+    }
+    for (i = 0; i < n; i++) {
+        if (nodes[i].onVolume == 1 && !nodes[i].pendingChildren) {
+            plan.ready[plan.readyCount++] = i;
+        }
+    }
+
+    SLOGI("Tearing down %d containers dependant on %s", plan.remaining, fuseMountpoint);
+
+    // One pass over the loop devices instead of one per container
+    Loop::lookupActiveMany(hashes, loopDevices, sizeof(nodes[0].loopDevice), numHashes);
+
+    {
+        pthread_mutex_init(&plan.lock, NULL);
+        pthread_cond_init(&plan.cond, NULL);
+
+        int numThreads = plan.readyCount < TEARDOWN_THREADS_MAX ?
+                plan.readyCount : TEARDOWN_THREADS_MAX;
+        pthread_t threads[TEARDOWN_THREADS_MAX];
+        int started = 0;
+        for (i = 1; i < numThreads; i++) {
+            if (pthread_create(&threads[started], NULL, teardownWorker, &plan)) {
+                SLOGW("Failed to start teardown thread (%s)", strerror(errno));
+                break;
             }
-            snprintf(mountPoint,sizeof(mountPoint),"%s/%s",Volume::IOSDIR,idHash);
-            cd->type = (container_type_t)-2;
-            goto rescan;
+            started++;
+        }
+        teardownWorker(&plan);
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
         }
+
+        pthread_cond_destroy(&plan.cond);
+        pthread_mutex_destroy(&plan.lock);
     }
 
-    it = mActiveContainers->end();
-    while (it != mActiveContainers->begin()) {
-        --it;
-        ContainerData* cd = *it;
-        if (cd->type == -2) {
-            SLOGI("Unmounting ISO %s (dependant on %s)", cd->id, v->getFuseMountpoint());
-            if (unmountISO(cd->id, force)) {
-                SLOGE("Failed to unmount ISO %s (%s)", cd->id, strerror(errno));
-                return -1;
+    {
+        // Drop what was torn down from the active list in a single pass
+        android::SortedVector<ContainerData *> gone;
+        for (i = 0; i < n; i++) {
+            if (nodes[i].onVolume != 1) {
+                continue;
+            }
+            if (nodes[i].rc) {
+                SLOGE("Failed to unmount %s (%s)", nodes[i].cd->id, strerror(EBUSY));
+                rc = -1;
+            } else {
+                gone.add(nodes[i].cd);
+            }
+        }
+        for (it = mActiveContainers->begin(); it != mActiveContainers->end();) {
+            if (gone.indexOf(*it) >= 0) {
+                delete *it;
+                it = mActiveContainers->erase(it);
+            } else {
+                ++it;
             }
-            it = mActiveContainers->end();
         }
     }
 
-    return 0;
+out:
+    free(nodes);
+    free(scratch);
+    free(hashes);
+    free(loopDevices);
+    if (rc) {
+        errno = EBUSY;
+    }
+    return rc;
+}
+
+/* True if container mountPoint (NULL for none) holds path */
+static bool isInside(const char *path, const char *mountPoint) {
+    if (!mountPoint) {
+        return false;
+    }
+    size_t len = strlen(mountPoint);
+    return !strncmp(path, mountPoint, len) && path[len] == '/';
+}
+
+/*
+ * Runs on the uevent thread, so only what must be taken before the
+ * mountpoint is reused happens here; the holder scan waits for the worker.
+ */
+void VolumeManager::queueDetachedCleanup(const char *mountpoint, const char *fuseMountpoint,
+        int rootFd) {
+    const char* externalStorage = getenv("EXTERNAL_STORAGE");
+    bool primaryStorage = externalStorage && !strcmp(mountpoint, externalStorage);
+
+    DetachedVolume *dv = new DetachedVolume;
+    dv->mountpoint = strdup(mountpoint);
+    dv->rootFd = rootFd;
+    IsoCache::collect(fuseMountpoint, &dv->cachedIsos);
+
+    {
+        // Same rules as cleanupISO() and cleanupAsec(); repeated until
+        // containers nested in the ones found are found too
+        Mutex::Autolock lock(mActiveContainersLock);
+        android::SortedVector<android::String8> found;
+        size_t len = strlen(fuseMountpoint);
+        bool added = true;
+        while (added) {
+            added = false;
+            for (AsecIdCollection::iterator it = mActiveContainers->begin();
+                    it != mActiveContainers->end(); ++it) {
+                ContainerData *cd = *it;
+                if (found.indexOf(android::String8(cd->id)) >= 0) {
+                    continue;
+                }
+                bool depends = false;
+                if (cd->type == ASEC) {
+                    depends = primaryStorage;
+                } else if (!strncmp(cd->id, fuseMountpoint, len)) {
+                    depends = true;
+                } else {
+                    for (size_t i = 0; i < dv->containers.size() && !depends; i++) {
+                        const DetachedContainer &parent = dv->containers[i];
+                        depends = parent.type != ASEC && isInside(cd->id, parent.mountPoint.string());
+                    }
+                }
+                if (!depends) {
+                    continue;
+                }
+
+                DetachedContainer c;
+                c.id = cd->id;
+                c.mountPoint = cd->mountPoint ? cd->mountPoint : "";
+                c.loopDevice = cd->loopDevice ? cd->loopDevice : "";
+                c.type = cd->type;
+                dv->containers.push(c);
+                found.add(c.id);
+                added = true;
+            }
+        }
+    }
+
+    Mutex::Autolock lock(mDetachedLock);
+    mDetachedVolumes.push_back(dv);
+
+    if (!mDetachedThreadStarted) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, detachedCleanupThread, this)) {
+            SLOGE("Failed to start detached volume cleanup thread (%s)", strerror(errno));
+        } else {
+            mDetachedThreadStarted = true;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    mDetachedCond.signal();
+}
+
+void *VolumeManager::detachedCleanupThread(void *arg) {
+    ((VolumeManager *) arg)->runDetachedCleanup();
+    return NULL;
+}
+
+void VolumeManager::runDetachedCleanup() {
+    while (true) {
+        DetachedVolume *dv;
+        {
+            Mutex::Autolock lock(mDetachedLock);
+            while (mDetachedVolumes.empty()) {
+                mDetachedCond.wait(mDetachedLock);
+            }
+            dv = *mDetachedVolumes.begin();
+            mDetachedVolumes.erase(mDetachedVolumes.begin());
+        }
+
+        SLOGI("Cleaning up after detached volume %s", dv->mountpoint);
+
+        Process::HolderSnapshot *holders = NULL;
+        if (dv->rootFd >= 0) {
+            holders = Process::snapshotHolders(dv->rootFd);
+            close(dv->rootFd);
+        }
+
+        IsoCache::flush(dv->cachedIsos);
+
+        // Innermost first
+        for (size_t i = dv->containers.size(); i-- > 0;) {
+            const DetachedContainer &c = dv->containers[i];
+            const char *id = c.id.string();
+
+            // Let an operation in flight on the container finish first
+            bool locked = ContainerLocks::acquire(id, CLEANUP_LOCK_WAIT_MS);
+            if (isActiveContainer(id, c.loopDevice.string())) {
+                SLOGI("Unmounting %s (dependant on detached %s)", id, dv->mountpoint);
+                int rc;
+                if (c.type == ISO) {
+                    rc = unmountISO(id, true);
+                } else if (c.type == OBB) {
+                    rc = unmountObb(id, true);
+                } else {
+                    rc = unmountAsec(id, true);
+                }
+                if (rc) {
+                    SLOGE("Failed to unmount %s (%s)", id, strerror(errno));
+                }
+            }
+            if (locked) {
+                ContainerLocks::release(id);
+            }
+        }
+
+        // The mount is gone from the namespace; whoever used it goes too
+        if (holders) {
+            Process::signalSnapshotAndWait(holders, SIGTERM, DETACHED_KILL_WAIT_MS, true);
+            Process::freeSnapshot(holders);
+        }
+
+        SLOGI("Detached volume %s cleaned up", dv->mountpoint);
+        free(dv->mountpoint);
+        delete dv;
+    }
+}
+
+bool VolumeManager::isActiveContainer(const char *id, const char *loopDevice) {
+    Mutex::Autolock lock(mActiveContainersLock);
+    for (AsecIdCollection::iterator it = mActiveContainers->begin();
+            it != mActiveContainers->end(); ++it) {
+        ContainerData *cd = *it;
+        if (!strcmp(cd->id, id)) {
+            return !strcmp(cd->loopDevice ? cd->loopDevice : "", loopDevice);
+        }
+    }
+    return false;
 }
 // MStar Android Patch End
 
@@ -18,14 +18,20 @@
 #define _VOLUMEMANAGER_H
 
 #include <pthread.h>
+// MStar Android Patch Begin
+#include <time.h>
+// MStar Android Patch End
 
 #ifdef __cplusplus
 // MStar Android Patch Begin
 #include <utils/List.h>
+#include <utils/String8.h>
+#include <utils/Vector.h>
 #include <utils/threads.h>
 #include <sysutils/SocketListener.h>
 
 #include "Volume.h"
+#include "Process.h"
 
 using namespace::android;
 
@@ -43,6 +49,12 @@ public:
     ContainerData(char* _id, container_type_t _type)
             : id(_id)
             , type(_type)
+            // MStar Android Patch Begin
+            , mountPoint(NULL)
+            , loopDevice(NULL)
+            , owner(-1)
+            , mountTime(0)
+            // MStar Android Patch End
     {}
 
     ~ContainerData() {
@@ -50,10 +62,23 @@ public:
             free(id);
             id = NULL;
         }
+        // MStar Android Patch Begin
+        free(mountPoint);
+        free(loopDevice);
+        // MStar Android Patch End
     }
 
     char *id;
     container_type_t type;
+    // MStar Android Patch Begin
+    /* NULL when not known, e.g. for a raw ASEC */
+    char *mountPoint;
+    char *loopDevice;
+    /* Owner uid (ASEC) or gid (OBB, ISO), -1 if not known */
+    int owner;
+    /* 0 if mounted before this vold instance started */
+    time_t mountTime;
+    // MStar Android Patch End
 };
 
 typedef android::List<ContainerData*> AsecIdCollection;
@@ -78,6 +103,36 @@ private:
     // MStar Android Patch Begin
     Mutex                   mVolumesLock;
     Mutex                   mActiveContainersLock;
+
+    /* A container that was mounted off a volume when it was detached */
+    struct DetachedContainer {
+        android::String8 id;
+        android::String8 mountPoint;
+        /* Tells it apart from a later container with the same id */
+        android::String8 loopDevice;
+        container_type_t type;
+    };
+
+    /*
+     * What a detached volume left behind, recorded before the volume went
+     * idle: its mount point may serve new media by the time this is
+     * cleaned up, so only these are torn down.
+     */
+    struct DetachedVolume {
+        char *mountpoint;
+        /* Containers inside other containers come after their parents */
+        android::Vector<DetachedContainer> containers;
+        /* IsoCache entries of images on the volume */
+        android::Vector<unsigned int> cachedIsos;
+        /* Open on the detached filesystem's root until its holders are found */
+        int rootFd;
+    };
+    typedef android::List<DetachedVolume *> DetachedVolumeCollection;
+
+    DetachedVolumeCollection mDetachedVolumes;
+    Mutex                   mDetachedLock;
+    Condition               mDetachedCond;
+    bool                    mDetachedThreadStarted;
     // MStar Android Patch End
 
 public:
@@ -100,8 +155,6 @@ public:
     void disableVolumeManager(void) { mVolManagerDisabled = 1; }
     // MStar Android Patch Begin
     int getVolumeLabel(SocketClient *cli, const char *label);
-    void lockActiveContainers();
-    void unlockActiveContainers();
     int getVolumeUuid(SocketClient *cli, const char *pathStr);
     void refreshVolumeUUIDAfterFormat(const char *pathStr);
     // MStar Android Patch End
@@ -109,8 +162,12 @@ public:
     /* ASEC */
     int findAsec(const char *id, char *asecPath = NULL, size_t asecPathLen = 0,
             const char **directory = NULL) const;
+    // MStar Android Patch Begin
+    /* imageFlags are Loop::IMAGE_xxx flags for the backing image file */
     int createAsec(const char *id, unsigned numSectors, const char *fstype,
-                   const char *key, const int ownerUid, bool isExternal);
+                   const char *key, const int ownerUid, bool isExternal,
+                   int imageFlags = 0);
+    // MStar Android Patch End
     int finalizeAsec(const char *id);
 
     /**
@@ -128,11 +185,29 @@ public:
     int mountAsec(const char *id, const char *key, int ownerUid);
     int unmountAsec(const char *id, bool force);
     int renameAsec(const char *id1, const char *id2);
+    // MStar Android Patch Begin
+    int resizeAsec(const char *id, unsigned int numSectors, const char *key);
+    /* Copy-on-write copy of a thin-provisioned ASEC under snapId */
+    int snapshotAsec(const char *id, const char *snapId);
+
+    /*
+     * Issues FITRIM inside every mounted ASEC and OBB so that blocks freed
+     * in them are punched out of their images, reporting each one to cli
+     * if given. startContainerTrim() runs it on a thread of its own.
+     */
+    int trimContainers(SocketClient *cli);
+    int startContainerTrim();
+
+    /* Streams what the framework would otherwise query per container */
+    int listAsecInfo(SocketClient *cli);
+    // MStar Android Patch End
     int getAsecMountPath(const char *id, char *buffer, int maxlen);
     int getAsecFilesystemPath(const char *id, char *buffer, int maxlen);
 
     /* Loopback images */
-    int listMountedObbs(SocketClient* cli);
+    // MStar Android Patch Begin
+    int listMountedObbs(SocketClient* cli, bool detail = false);
+    // MStar Android Patch End
     int mountObb(const char *fileName, const char *key, int ownerUid);
     int unmountObb(const char *fileName, bool force);
     int getObbMountPath(const char *id, char *buffer, int maxlen);
@@ -141,7 +216,7 @@ public:
 
     // MStar Android Patch Begin
     /* ISO images*/
-    int listMountedISOs(SocketClient* cli);
+    int listMountedISOs(SocketClient* cli, bool detail = false);
     int mountISO(const char *fileName);
     int unmountISO(const char *fileName, bool force);
     int getISOMountPath(const char *id, char *buffer, int maxlen);
@@ -161,7 +236,18 @@ public:
     // XXX: Post froyo this should be moved and cleaned up
     int cleanupAsec(Volume *v, bool force);
     // MStar Android Patch Begin
+    int cleanupAsec(const char *mountpoint, const char *fuseMountpoint, bool force);
+    /* Unmounts the ISOs and OBBs backed by a volume, nested ones first */
     int cleanupISO(Volume *v, bool force);
+    int cleanupISO(const char *fuseMountpoint, bool force);
+
+    /*
+     * Tears down what depended on a volume that has already been lazily
+     * detached: containers backed by it and processes still holding the
+     * filesystem (dev). Runs on a background thread so the caller, usually
+     * the uevent thread, never blocks on it.
+     */
+    void queueDetachedCleanup(const char *mountpoint, const char *fuseMountpoint, int rootFd);
     // MStar Android Patch End
 
     void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
@@ -188,6 +274,21 @@ public:
 private:
     VolumeManager();
     void readInitialState();
+    // MStar Android Patch Begin
+    static void *detachedCleanupThread(void *arg);
+    static void *containerTrimThread(void *arg);
+    void runDetachedCleanup();
+    bool isActiveContainer(const char *id, const char *loopDevice);
+    void addActiveContainer(const char *id, container_type_t type,
+                            const char *mountPoint, const char *loopDevice, int owner);
+    void adoptActiveContainers();
+    int listActiveContainers(SocketClient *cli, container_type_t type, bool detail);
+    void removeActiveContainer(const char *id);
+    void renameActiveContainer(const char *id, const char *newId, const char *newMountPoint);
+    int renameMountedAsec(const char *id1, const char *id2,
+                          const char *asecFilename1, const char *asecFilename2);
+    int teardownLoopContainers(const char *fuseMountpoint, bool force);
+    // MStar Android Patch End
     bool isMountpointMounted(const char *mp);
     bool isAsecInDirectory(const char *dir, const char *asec) const;
     bool isLegalAsecId(const char *id) const;
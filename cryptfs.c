@@ -48,9 +48,9 @@
 #include <logwrap/logwrap.h>
 #include "VolumeManager.h"
 #include "VoldUtil.h"
+#include "dm_client.h"
 #include "crypto_scrypt.h"
 
-#define DM_CRYPT_BUF_SIZE 4096
 #define DATA_MNT_POINT "/data"
 
 #define HASH_COUNT 2000
@@ -86,20 +86,6 @@ static void cryptfs_reboot(int recovery)
     return;
 }
 
-static void ioctl_init(struct dm_ioctl *io, size_t dataSize, const char *name, unsigned flags)
-{
-    memset(io, 0, dataSize);
-    io->data_size = dataSize;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = flags;
-    if (name) {
-        strncpy(io->name, name, sizeof(io->name));
-    }
-}
-
 /**
  * Gets the default device scrypt parameters for key derivation time tuning.
  * The parameters should lead to about one second derivation time for the
@@ -685,43 +671,48 @@ void convert_key_to_hex_ascii(unsigned char *master_key, unsigned int keysize,
 }
 
 static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
-                                     char *real_blk_name, const char *name, int fd,
+                                     char *real_blk_name, const char *name,
                                      char *extra_params)
 {
-  char buffer[DM_CRYPT_BUF_SIZE];
+  char *buffer;
   struct dm_ioctl *io;
   struct dm_target_spec *tgt;
   char *crypt_params;
   char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
   int i;
 
-  io = (struct dm_ioctl *) buffer;
-
-  /* Load the mapping table for this device */
-  tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
+  for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
+    /* Load the mapping table for this device */
+    io = dm_client_init(name, 0);
+    if (!io) {
+      return -1;
+    }
+    buffer = (char *) io;
+    tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
 
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  io->target_count = 1;
-  tgt->status = 0;
-  tgt->sector_start = 0;
-  tgt->length = crypt_ftr->fs_size;
-  strcpy(tgt->target_type, "crypt");
+    io->target_count = 1;
+    tgt->status = 0;
+    tgt->sector_start = 0;
+    tgt->length = crypt_ftr->fs_size;
+    strcpy(tgt->target_type, "crypt");
 
-  crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
-  convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
-  sprintf(crypt_params, "%s %s 0 %s 0 %s", crypt_ftr->crypto_type_name,
-          master_key_ascii, real_blk_name, extra_params);
-  crypt_params += strlen(crypt_params) + 1;
-  crypt_params = (char *) (((unsigned long)crypt_params + 7) & ~8); /* Align to an 8 byte boundary */
-  tgt->next = crypt_params - buffer;
+    crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+    convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
+    sprintf(crypt_params, "%s %s 0 %s 0 %s", crypt_ftr->crypto_type_name,
+            master_key_ascii, real_blk_name, extra_params);
+    crypt_params += strlen(crypt_params) + 1;
+    crypt_params = (char *) (((unsigned long)crypt_params + 7) & ~8); /* Align to an 8 byte boundary */
+    tgt->next = crypt_params - buffer;
 
-  for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
-    if (! ioctl(fd, DM_TABLE_LOAD, io)) {
+    if (! dm_client_ioctl(DM_TABLE_LOAD, &io)) {
       break;
     }
     usleep(500000);
   }
 
+  /* The shared buffer held the key in the clear */
+  io = dm_client_init(NULL, 0);
+
   if (i == TABLE_LOAD_RETRIES) {
     /* We failed to load the table, return an error */
     return -1;
@@ -731,25 +722,24 @@ static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr, unsigned c
 }
 
 
-static int get_dm_crypt_version(int fd, const char *name,  int *version)
+static int get_dm_crypt_version(const char *name,  int *version)
 {
-    char buffer[DM_CRYPT_BUF_SIZE];
     struct dm_ioctl *io;
     struct dm_target_versions *v;
-    int i;
-
-    io = (struct dm_ioctl *) buffer;
 
-    ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+    io = dm_client_init(name, 0);
+    if (!io) {
+        return -1;
+    }
 
-    if (ioctl(fd, DM_LIST_VERSIONS, io)) {
+    if (dm_client_ioctl(DM_LIST_VERSIONS, &io)) {
         return -1;
     }
 
     /* Iterate over the returned versions, looking for name of "crypt".
      * When found, get and return the version.
      */
-    v = (struct dm_target_versions *) &buffer[sizeof(struct dm_ioctl)];
+    v = (struct dm_target_versions *) &((char *) io)[sizeof(struct dm_ioctl)];
     while (v->next) {
         if (! strcmp(v->name, "crypt")) {
             /* We found the crypt driver, return the version, and get out */
@@ -767,35 +757,27 @@ static int get_dm_crypt_version(int fd, const char *name,  int *version)
 static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
                                     char *real_blk_name, char *crypto_blk_name, const char *name)
 {
-  char buffer[DM_CRYPT_BUF_SIZE];
-  char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
-  char *crypt_params;
   struct dm_ioctl *io;
-  struct dm_target_spec *tgt;
   unsigned int minor;
-  int fd;
-  int i;
   int retval = -1;
   int version[3];
   char *extra_params;
   int load_count;
 
-  if ((fd = open("/dev/device-mapper", O_RDWR)) < 0 ) {
+  if (dm_client_fd() < 0) {
     SLOGE("Cannot open device-mapper\n");
     goto errout;
   }
 
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_CREATE, io)) {
+  io = dm_client_init(name, 0);
+  if (!io || dm_client_ioctl(DM_DEV_CREATE, &io)) {
     SLOGE("Cannot create dm-crypt device\n");
     goto errout;
   }
 
   /* Get the device status, in particular, the name of it's device file */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_STATUS, io)) {
+  io = dm_client_init(name, 0);
+  if (!io || dm_client_ioctl(DM_DEV_STATUS, &io)) {
     SLOGE("Cannot retrieve dm-crypt device status\n");
     goto errout;
   }
@@ -803,7 +785,7 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char
   snprintf(crypto_blk_name, MAXPATHLEN, "/dev/block/dm-%u", minor);
 
   extra_params = "";
-  if (! get_dm_crypt_version(fd, name, version)) {
+  if (! get_dm_crypt_version(name, version)) {
       /* Support for allow_discards was added in version 1.11.0 */
       if ((version[0] >= 2) ||
           ((version[0] == 1) && (version[1] >= 11))) {
@@ -813,7 +795,7 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char
   }
 
   load_count = load_crypto_mapping_table(crypt_ftr, master_key, real_blk_name, name,
-                                         fd, extra_params);
+                                         extra_params);
   if (load_count < 0) {
       SLOGE("Cannot load dm-crypt mapping table.\n");
       goto errout;
@@ -822,9 +804,9 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char
   }
 
   /* Resume this device to activate it */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+  io = dm_client_init(name, 0);
 
-  if (ioctl(fd, DM_DEV_SUSPEND, io)) {
+  if (!io || dm_client_ioctl(DM_DEV_SUSPEND, &io)) {
     SLOGE("Cannot resume the dm-crypt device\n");
     goto errout;
   }
@@ -833,27 +815,21 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char
   retval = 0;
 
 errout:
-  close(fd);   /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
   return retval;
 }
 
 static int delete_crypto_blk_dev(char *name)
 {
-  int fd;
-  char buffer[DM_CRYPT_BUF_SIZE];
   struct dm_ioctl *io;
   int retval = -1;
 
-  if ((fd = open("/dev/device-mapper", O_RDWR)) < 0 ) {
+  if (dm_client_fd() < 0) {
     SLOGE("Cannot open device-mapper\n");
     goto errout;
   }
 
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_REMOVE, io)) {
+  io = dm_client_init(name, 0);
+  if (!io || dm_client_ioctl(DM_DEV_REMOVE, &io)) {
     SLOGE("Cannot remove dm-crypt device\n");
     goto errout;
   }
@@ -862,8 +838,6 @@ static int delete_crypto_blk_dev(char *name)
   retval = 0;
 
 errout:
-  close(fd);    /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
   return retval;
 
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#define LOG_TAG "Vold"
+#include "cutils/log.h"
+#include "dm_client.h"
+
+struct dm_buffer {
+    char *data;
+    size_t size;
+};
+
+static pthread_mutex_t dm_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dm_fd = -1;
+
+static pthread_once_t dm_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dm_key;
+
+static dm_client_ioctl_fn dm_ioctl_override = NULL;
+
+static void free_dm_buffer(void *arg)
+{
+    struct dm_buffer *buf = (struct dm_buffer *) arg;
+
+    free(buf->data);
+    free(buf);
+}
+
+static void make_dm_key(void)
+{
+    pthread_key_create(&dm_key, free_dm_buffer);
+}
+
+static struct dm_buffer *get_dm_buffer(size_t min_size)
+{
+    struct dm_buffer *buf;
+    char *data;
+    size_t size;
+
+    pthread_once(&dm_key_once, make_dm_key);
+    buf = (struct dm_buffer *) pthread_getspecific(dm_key);
+    if (!buf) {
+        buf = (struct dm_buffer *) calloc(1, sizeof(*buf));
+        if (!buf) {
+            return NULL;
+        }
+        pthread_setspecific(dm_key, buf);
+    }
+
+    if (buf->size >= min_size) {
+        return buf;
+    }
+
+    size = buf->size ? buf->size : DM_CLIENT_BUFFER_MIN;
+    while (size < min_size) {
+        size *= 2;
+    }
+    data = (char *) realloc(buf->data, size);
+    if (!data) {
+        SLOGE("Error allocating %zu byte devmapper buffer", size);
+        return NULL;
+    }
+    /* realloc keeps what the caller already put in the buffer */
+    memset(data + buf->size, 0, size - buf->size);
+    buf->data = data;
+    buf->size = size;
+    return buf;
+}
+
+int dm_client_fd(void)
+{
+    int fd;
+
+    pthread_mutex_lock(&dm_fd_lock);
+    if (dm_fd < 0) {
+        dm_fd = open("/dev/device-mapper", O_RDWR | O_CLOEXEC);
+        if (dm_fd < 0) {
+            SLOGE("Error opening devmapper (%s)", strerror(errno));
+        }
+    }
+    fd = dm_fd;
+    pthread_mutex_unlock(&dm_fd_lock);
+    return fd;
+}
+
+struct dm_ioctl *dm_client_init(const char *name, unsigned flags)
+{
+    struct dm_buffer *buf = get_dm_buffer(DM_CLIENT_BUFFER_MIN);
+    struct dm_ioctl *io;
+
+    if (!buf) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /*
+     * Payloads are small. Only the minimum is cleared and offered to the
+     * kernel, which copies all of data_size in and out on every ioctl, even
+     * if a big listing grew this thread's buffer; dm_client_ioctl() offers
+     * more only to a reply that didn't fit.
+     */
+    memset(buf->data, 0, DM_CLIENT_BUFFER_MIN);
+    io = (struct dm_ioctl *) buf->data;
+    io->data_size = DM_CLIENT_BUFFER_MIN;
+    io->data_start = sizeof(struct dm_ioctl);
+    io->version[0] = 4;
+    io->version[1] = 0;
+    io->version[2] = 0;
+    io->flags = flags;
+    if (name) {
+        size_t ret = strlcpy(io->name, name, sizeof(io->name));
+        if (ret >= sizeof(io->name))
+            abort();
+    }
+    return io;
+}
+
+void dm_client_set_ioctl_fn(dm_client_ioctl_fn fn)
+{
+    dm_ioctl_override = fn;
+}
+
+int dm_client_ioctl(unsigned long cmd, struct dm_ioctl **io)
+{
+    int fd = -1;
+
+    if (!dm_ioctl_override) {
+        fd = dm_client_fd();
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    while (1) {
+        struct dm_buffer *buf;
+        size_t offered = (*io)->data_size;
+        size_t size;
+        int rc;
+
+        rc = dm_ioctl_override ? dm_ioctl_override(cmd, *io) : ioctl(fd, cmd, *io);
+        if (rc) {
+            return -1;
+        }
+        if (!((*io)->flags & DM_BUFFER_FULL_FLAG)) {
+            return 0;
+        }
+
+        /*
+         * The kernel leaves data_size at the size of what it wrote, not
+         * what it needed, so grow from the size we offered it. The buffer
+         * itself may already be bigger from an earlier reply.
+         */
+        if (offered >= DM_CLIENT_BUFFER_MAX) {
+            SLOGE("Devmapper reply does not fit in %d bytes", DM_CLIENT_BUFFER_MAX);
+            errno = ENOBUFS;
+            return -1;
+        }
+        size = offered * 2;
+        if (size > DM_CLIENT_BUFFER_MAX) {
+            size = DM_CLIENT_BUFFER_MAX;
+        }
+        buf = get_dm_buffer(size);
+        if (!buf) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *io = (struct dm_ioctl *) buf->data;
+        (*io)->data_size = size;
+        (*io)->flags &= ~DM_BUFFER_FULL_FLAG;
+    }
+}
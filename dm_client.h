@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DM_CLIENT_H
+#define _DM_CLIENT_H
+
+#include <sys/cdefs.h>
+#include <linux/dm-ioctl.h>
+
+/*
+ * Device-mapper client shared by Devmapper and cryptfs. The control device
+ * is opened once and kept; every thread gets its own ioctl buffer, which
+ * is reused from call to call and grown when the kernel reports
+ * DM_BUFFER_FULL_FLAG.
+ */
+
+#define DM_CLIENT_BUFFER_MIN (16 * 1024)
+#define DM_CLIENT_BUFFER_MAX (4 * 1024 * 1024)
+
+__BEGIN_DECLS
+  /* Persistent fd on /dev/device-mapper, or -1 */
+  int dm_client_fd(void);
+
+  /*
+   * Returns this thread's ioctl buffer, zeroed and set up for name/flags,
+   * or NULL. The returned pointer is valid until the next dm_client call
+   * on this thread.
+   */
+  struct dm_ioctl *dm_client_init(const char *name, unsigned flags);
+
+  /*
+   * Issues cmd with this thread's buffer. When the kernel flags the buffer
+   * as full it is grown and the ioctl reissued; *io is updated to point at
+   * the (possibly moved) buffer.
+   */
+  int dm_client_ioctl(unsigned long cmd, struct dm_ioctl **io);
+
+  /*
+   * Replaces the ioctl on the control device, for tests; NULL restores
+   * it. Not thread safe.
+   */
+  typedef int (*dm_client_ioctl_fn)(unsigned long cmd, struct dm_ioctl *io);
+  void dm_client_set_ioctl_fn(dm_client_ioctl_fn fn);
+__END_DECLS
+
+#endif
@@ -3,7 +3,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 test_src_files := \
-	VolumeManager_test.cpp
+	VolumeManager_test.cpp \
+	DmClient_test.cpp
 
 shared_libraries := \
 	liblog \
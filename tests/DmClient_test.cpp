@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#define LOG_TAG "DmClient_test"
+#include <utils/Log.h>
+#include "../dm_client.h"
+#include "../Devmapper.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+/* Payload the fake control device wants to return */
+static size_t sReplySize;
+static int sCalls;
+/* If set, DM_LIST_DEVICES lists this many devices instead */
+static int sNumDevices;
+
+#define DEVICE_NAME_FORMAT "vold-test-%04d-with-a-name-long-enough-to-fill-the-list"
+
+static size_t deviceEntrySize(const char *name) {
+    // Entries are 8-byte aligned, as the kernel lays them out
+    return (offsetof(struct dm_name_list, name) + strlen(name) + 1 + 7) & ~7;
+}
+
+static int fakeListDevices(struct dm_ioctl *io) {
+    char name[128];
+    size_t needed = 0;
+    for (int i = 0; i < sNumDevices; i++) {
+        snprintf(name, sizeof(name), DEVICE_NAME_FORMAT, i);
+        needed += deviceEntrySize(name);
+    }
+    if (io->data_size - io->data_start < needed) {
+        io->flags |= DM_BUFFER_FULL_FLAG;
+        io->data_size = offsetof(struct dm_ioctl, data);
+        return 0;
+    }
+
+    char *p = ((char *) io) + io->data_start;
+    struct dm_name_list *n = NULL;
+    for (int i = 0; i < sNumDevices; i++) {
+        n = (struct dm_name_list *) p;
+        snprintf(name, sizeof(name), DEVICE_NAME_FORMAT, i);
+        n->dev = i + 1;
+        strcpy(n->name, name);
+        n->next = deviceEntrySize(name);
+        p += n->next;
+    }
+    if (n) {
+        n->next = 0;
+    }
+    io->data_size = io->data_start + needed;
+    return 0;
+}
+
+/*
+ * Behaves like the kernel on a reply that doesn't fit: flags the buffer
+ * full and leaves data_size at the header size rather than the size needed.
+ */
+static int fakeIoctl(unsigned long cmd, struct dm_ioctl *io) {
+    sCalls++;
+    if (cmd == DM_LIST_DEVICES && sNumDevices) {
+        return fakeListDevices(io);
+    }
+    if (io->data_size - io->data_start < sReplySize) {
+        io->flags |= DM_BUFFER_FULL_FLAG;
+        io->data_size = offsetof(struct dm_ioctl, data);
+        return 0;
+    }
+    memset(((char *) io) + io->data_start, 'x', sReplySize);
+    io->data_size = io->data_start + sReplySize;
+    return 0;
+}
+
+class DmClientTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+        sCalls = 0;
+        sNumDevices = 0;
+        dm_client_set_ioctl_fn(fakeIoctl);
+    }
+
+    virtual void TearDown() {
+        dm_client_set_ioctl_fn(NULL);
+    }
+};
+
+TEST_F(DmClientTest, SmallReplyFitsFirstTime) {
+    sReplySize = 1024;
+    struct dm_ioctl *io = dm_client_init("small", 0);
+    ASSERT_TRUE(io != NULL);
+
+    EXPECT_EQ(0, dm_client_ioctl(DM_LIST_DEVICES, &io));
+    EXPECT_EQ(1, sCalls);
+}
+
+TEST_F(DmClientTest, BufferGrowsForLargeReply) {
+    // Needs two doublings of the 16 KB buffer
+    sReplySize = 3 * DM_CLIENT_BUFFER_MIN;
+    struct dm_ioctl *io = dm_client_init("large", 0);
+    ASSERT_TRUE(io != NULL);
+
+    EXPECT_EQ(0, dm_client_ioctl(DM_LIST_DEVICES, &io));
+    EXPECT_EQ(3, sCalls)
+            << "Should grow 16 KB -> 32 KB -> 64 KB and reissue the ioctl each time";
+    EXPECT_EQ(io->data_start + sReplySize, io->data_size);
+    EXPECT_STREQ("large", io->name)
+            << "Growing should keep the request header";
+}
+
+TEST_F(DmClientTest, SmallRequestAfterGrowthOffersMinimum) {
+    sReplySize = 3 * DM_CLIENT_BUFFER_MIN;
+    struct dm_ioctl *io = dm_client_init("large", 0);
+    ASSERT_TRUE(io != NULL);
+    ASSERT_EQ(0, dm_client_ioctl(DM_LIST_DEVICES, &io));
+
+    // The grown buffer stays with the thread, but isn't offered again
+    io = dm_client_init("small", 0);
+    ASSERT_TRUE(io != NULL);
+    EXPECT_EQ((size_t) DM_CLIENT_BUFFER_MIN, io->data_size);
+
+    sCalls = 0;
+    sReplySize = 1024;
+    EXPECT_EQ(0, dm_client_ioctl(DM_LIST_DEVICES, &io));
+    EXPECT_EQ(1, sCalls);
+}
+
+static void countDevice(const char *name, unsigned long long dev, void *data) {
+    int *count = (int *) data;
+    char expected[128];
+    snprintf(expected, sizeof(expected), DEVICE_NAME_FORMAT, (int) dev - 1);
+    EXPECT_STREQ(expected, name);
+    (*count)++;
+}
+
+struct ListResult {
+    int rc;
+    int count;
+};
+
+/* Runs on a thread of its own, so it starts from an unused 16 KB buffer */
+static void *listDevicesThread(void *arg) {
+    ListResult *result = (ListResult *) arg;
+    result->rc = Devmapper::listDevices(countDevice, &result->count);
+    return NULL;
+}
+
+TEST_F(DmClientTest, ListDevicesLargerThanMinimumBuffer) {
+    // About 32 KB of listing, twice the initial buffer
+    sNumDevices = 400;
+    ListResult result = { -1, 0 };
+    pthread_t thread;
+
+    ASSERT_EQ(0, pthread_create(&thread, NULL, listDevicesThread, &result));
+    pthread_join(thread, NULL);
+    EXPECT_EQ(0, result.rc);
+    EXPECT_EQ(sNumDevices, result.count);
+    EXPECT_GT(sCalls, 1)
+            << "The listing should not have fit in the initial buffer";
+}
+
+TEST_F(DmClientTest, GivesUpAtMaximum) {
+    sReplySize = DM_CLIENT_BUFFER_MAX;
+    struct dm_ioctl *io = dm_client_init("huge", 0);
+    ASSERT_TRUE(io != NULL);
+
+    EXPECT_EQ(-1, dm_client_ioctl(DM_LIST_DEVICES, &io));
+    EXPECT_EQ(ENOBUFS, errno);
+    EXPECT_LT(sCalls, 16)
+            << "Should stop once the buffer reached DM_CLIENT_BUFFER_MAX";
+}
+
+}